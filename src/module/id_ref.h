@@ -0,0 +1,521 @@
+/**
+ * @author Alberto Bombardelli
+ *
+ * @file id_ref.h
+ *
+ * @brief File containing the implementation of the id_ref and registry mechanisms
+ *
+ * The functions are quite straightforward, this module just combines the 
+ * xarrays with reference counted objects. Refer to them for a further
+ * documentation
+ *
+ * Lifetime: the registry owns a reference of each id_ref, id_registry_find
+ * takes another one that the caller drops with id_ref_put. The readers never
+ * lock the id_ref: the remover marks it dead (id_ref_kill), tears the object
+ * down while the readers might still use it and removes it from the
+ * registry; the memory of the object is released by the last id_ref_put and
+ * the id_ref itself after a RCU grace period, so the lookups stay lock-free.
+ *
+*/
+#ifndef __ID_REF_H__
+#define __ID_REF_H__
+
+#include <linux/xarray.h>
+#include <linux/kref.h>
+#include <linux/rcupdate.h>
+#include <linux/slab.h>
+#include <linux/percpu.h>
+
+/**
+ * @struct id_ref
+ *
+ * @brief Identifier reference
+ *
+ * This struct is a reference counted handle stored in a registry
+ * (id_registry) that keeps alive the object (data) it refers to.
+*/
+struct id_ref {
+	/** 
+	 * @brief Identifier for the registry
+	 *
+	 * This is the index of the id_ref in its registry
+	*/
+	int id;
+
+	/**
+	 * @brief Set once by the remover, the lookups fail from then on
+	*/
+	int dead;
+
+	/**
+	 * @brief References: the registry and each user of id_registry_find
+	*/
+	struct kref ref;
+
+	/**
+	 * @brief RCU head used to free the id_ref after the lookups
+	*/
+	struct rcu_head rcu;
+
+	/** 
+	 * @brief Object referred by the id
+	*/
+	void *data;
+
+	/**
+	 * @brief Called on data by the last id_ref_put to free it
+	*/
+	void (*free_data)(void *data);
+};
+
+/**
+ * @brief Bits of an identifier used as index in the registry
+ *
+ * An identifier is (generation << ID_REGISTRY_INDEX_BITS | index): the
+ * index is a slot of the registry (the slots are reused) and the generation
+ * tells apart the objects that used the same slot. The generation belongs
+ * to the slot: it is bumped each time the slot is freed, so a stale id is
+ * accepted again only after 2^ID_REGISTRY_GEN_BITS reuses of that slot.
+*/
+#define ID_REGISTRY_INDEX_BITS 20
+
+/** @brief Bits of the generation, the identifiers stay positive ints */
+#define ID_REGISTRY_GEN_BITS 11
+
+/** @brief Mask of the index in an identifier */
+#define ID_REGISTRY_INDEX_MASK ((1U << ID_REGISTRY_INDEX_BITS) - 1)
+
+/** @brief Mask of the generation (shifted out of the identifier) */
+#define ID_REGISTRY_GEN_MASK ((1U << ID_REGISTRY_GEN_BITS) - 1)
+
+/** @brief Flags of the xarray of a registry (index 0 is never used) */
+#define ID_REGISTRY_FLAGS XA_FLAGS_ALLOC1
+
+/** @brief Mark of the free slots that nobody holds in a batch */
+#define ID_REGISTRY_FREE_MARK XA_MARK_1
+
+/** @brief Identifiers kept by each CPU (see id_registry_batch) */
+#define ID_REGISTRY_BATCH 16
+
+/**
+ * @struct id_registry_batch
+ *
+ * @brief Free identifiers owned by a CPU
+ *
+ * The identifiers are handed out and given back without the lock of the
+ * xarray, which is taken once for ID_REGISTRY_BATCH of them (see
+ * id_registry_refill).
+*/
+struct id_registry_batch {
+	/** number of identifiers in ids */
+	unsigned int nr;
+	/** free identifiers, with the generation of their next object */
+	int ids[ID_REGISTRY_BATCH];
+};
+
+/**
+ * @struct id_registry
+ *
+ * @brief Registry of id_refs indexed by identifier
+ *
+ * A slot of xa holds either the id_ref of a live object or, while it is
+ * free or reserved, the generation of its next object (xa_mk_value). A free
+ * slot is either in the batch of a CPU or marked with ID_REGISTRY_FREE_MARK.
+*/
+struct id_registry {
+	/** slots of the registry */
+	struct xarray xa;
+	/** per-CPU free identifiers */
+	struct id_registry_batch __percpu *batch;
+};
+
+/**
+ * @brief Index in the registry of an identifier
+ *
+ * @param[in] id: identifier
+*/
+#define id_registry_index(id)						\
+	((unsigned long)(id) & ID_REGISTRY_INDEX_MASK)
+
+/**
+ * @brief Identifier of a slot with a given generation
+ *
+ * @param[in] gen: generation
+ * @param[in] index: index of the slot
+*/
+#define id_registry_make_id(gen, index)					\
+	((int)(((u32)(gen) & ID_REGISTRY_GEN_MASK) <<			\
+	       ID_REGISTRY_INDEX_BITS | (u32)(index)))
+
+/**
+ * @brief Generation of an identifier
+ *
+ * @param[in] id: identifier
+*/
+#define id_registry_gen(id)						\
+	(((u32)(id) >> ID_REGISTRY_INDEX_BITS) & ID_REGISTRY_GEN_MASK)
+
+/**
+ * @brief Initialize an empty registry
+ *
+ * @param[out] registry: registry to initialize
+ *
+ * @return 0 if no error occurs, -ENOMEM otherwise
+*/
+static inline int id_registry_init(struct id_registry *registry)
+{
+	xa_init_flags(&registry->xa, ID_REGISTRY_FLAGS);
+
+	registry->batch = alloc_percpu(struct id_registry_batch);
+
+	return registry->batch ? 0 : -ENOMEM;
+}
+
+/**
+ * @brief Destroy a registry emptied with id_registry_reclaim
+ *
+ * @param[in] registry: registry to destroy
+*/
+static inline void id_registry_destroy(struct id_registry *registry)
+{
+	free_percpu(registry->batch);
+	xa_destroy(&registry->xa);
+}
+
+/**
+ * @brief Give back identifiers that the batch of current CPU cannot keep
+ *
+ * @param[in] registry: registry of the identifiers
+ * @param[in] ids: free identifiers, their slots hold their generation
+ * @param[in] nr: number of identifiers
+*/
+static inline void id_registry_unbatch(struct id_registry *registry,
+				       const int *ids, unsigned int nr)
+{
+	xa_lock(&registry->xa);
+
+	while (nr--)
+		__xa_set_mark(&registry->xa, id_registry_index(ids[nr]),
+			      ID_REGISTRY_FREE_MARK);
+
+	xa_unlock(&registry->xa);
+}
+
+/**
+ * @brief Reserve a batch of identifiers and return one of them
+ *
+ * @param[in] registry: registry of the identifiers
+ * @param[out] id: the new identifier
+ *
+ * The marked free slots are taken first (they keep their generation), then
+ * new slots are allocated with generation 0. The lock of the xarray is
+ * taken once for the whole batch.
+ *
+ * @return 0 if no error occurs, -EBUSY if the registry is full, -ENOMEM
+ *	otherwise
+*/
+static inline int id_registry_refill(struct id_registry *registry, int *id)
+{
+	struct id_registry_batch *batch;
+	int ids[ID_REGISTRY_BATCH];
+	unsigned int nr = 0;
+	unsigned long index;
+	void *entry;
+	int res = 0;
+
+	xa_lock(&registry->xa);
+
+	xa_for_each_marked(&registry->xa, index, entry, ID_REGISTRY_FREE_MARK) {
+		__xa_clear_mark(&registry->xa, index, ID_REGISTRY_FREE_MARK);
+		ids[nr++] = id_registry_make_id(xa_to_value(entry), index);
+
+		if (nr == ID_REGISTRY_BATCH)
+			break;
+	}
+
+	while (nr < ID_REGISTRY_BATCH) {
+		u32 new_index;
+
+		/* it might drop the lock to allocate */
+		res = __xa_alloc(&registry->xa, &new_index, xa_mk_value(0),
+				 XA_LIMIT(1, ID_REGISTRY_INDEX_MASK),
+				 GFP_KERNEL);
+
+		if (res)
+			break;
+
+		ids[nr++] = id_registry_make_id(0, new_index);
+	}
+
+	xa_unlock(&registry->xa);
+
+	if (! nr)
+		return res;
+
+	*id = ids[--nr];
+
+	batch = get_cpu_ptr(registry->batch);
+
+	while (nr && batch->nr < ID_REGISTRY_BATCH)
+		batch->ids[batch->nr++] = ids[--nr];
+
+	put_cpu_ptr(registry->batch);
+
+	/* current moved to a CPU whose batch is already full */
+	if (nr)
+		id_registry_unbatch(registry, ids, nr);
+
+	return 0;
+}
+
+/**
+ * @brief Reserve a new identifier in a registry
+ *
+ * @param[in] registry: registry of the identifier
+ * @param[out] id: the new identifier
+ *
+ * The identifier comes from the batch of current CPU, without any lock
+ * when the batch is not empty. Its slot stays reserved (lookups find
+ * nothing) until id_registry_add or id_registry_release.
+ *
+ * @return 0 if no error occurs, -EBUSY if the registry is full, -ENOMEM
+ *	otherwise
+*/
+static inline int id_registry_reserve(struct id_registry *registry, int *id)
+{
+	struct id_registry_batch *batch;
+
+	batch = get_cpu_ptr(registry->batch);
+
+	if (likely(batch->nr)) {
+		*id = batch->ids[--batch->nr];
+		put_cpu_ptr(registry->batch);
+		return 0;
+	}
+
+	put_cpu_ptr(registry->batch);
+
+	return id_registry_refill(registry, id);
+}
+
+/**
+ * @brief Release an identifier reserved with id_registry_reserve and never
+ * added
+ *
+ * @param[in] registry: registry of the identifier
+ * @param[in] id: identifier to release
+ *
+ * Its slot still holds its generation: the identifier goes back to the
+ * batch of current CPU, or it is marked free if the batch is full.
+*/
+static inline void id_registry_release(struct id_registry *registry, int id)
+{
+	struct id_registry_batch *batch;
+
+	batch = get_cpu_ptr(registry->batch);
+
+	if (likely(batch->nr < ID_REGISTRY_BATCH)) {
+		batch->ids[batch->nr++] = id;
+		put_cpu_ptr(registry->batch);
+		return;
+	}
+
+	put_cpu_ptr(registry->batch);
+
+	id_registry_unbatch(registry, &id, 1);
+}
+
+/**
+ * @brief Add an object to its reserved slot
+ *
+ * @param[in] registry: registry of the identifier
+ * @param[in] id: identifier reserved with id_registry_reserve
+ * @param[in] entry: object (with the id already set)
+ *
+ * @return 0 if the object was added, -ENOMEM otherwise
+*/
+#define id_registry_store(registry, id, entry)				\
+	(xa_err(xa_store(&(registry)->xa, id_registry_index(id),	\
+			 (entry), GFP_KERNEL)))
+
+/**
+ * @brief Find an object using his id
+ *
+ * @param[in] registry: registry of the objects
+ * @param[in] _id: identifier to find
+ * @param[out] entry_ref: object to be found, setted to NULL if none is found
+ *	or if the identifier is stale
+ *
+ * The object type must have an id field. The free and reserved slots hold
+ * a value entry (their generation), they are never returned.
+ *
+ * @return no return (do while macro)
+*/
+#define id_registry_lookup(registry, _id, entry_ref)			\
+	do {								\
+		void *__entry = (_id) > 0 ?				\
+			xa_load(&(registry)->xa, id_registry_index(_id)) : \
+			NULL;						\
+		*(entry_ref) = xa_is_value(__entry) ? NULL : __entry;	\
+		if (*(entry_ref) && (*(entry_ref))->id != (_id))	\
+			*(entry_ref) = NULL;				\
+	} while (0)
+
+/**
+ * @brief Add a new id_ref to a registry
+ *
+ * @param[in] registry: registry in which the id_ref gets added
+ * @param[in] _ref: id_ref to add, its id was reserved with id_registry_reserve
+ *
+ * The reference of id_ref_init becomes the one of the registry.
+ *
+ * @return 0 if the id_ref was added, -ENOMEM otherwise
+*/
+#define id_registry_add(registry, _ref)					\
+	(id_registry_store((registry), (_ref)->id, (_ref)))
+
+/**
+ * @brief Free the object and the id_ref (after a RCU grace period)
+ *
+ * @param[in] kref: kref of the id_ref, the last reference was dropped
+*/
+static inline void id_ref_release(struct kref *kref)
+{
+	struct id_ref *ref = container_of(kref, struct id_ref, ref);
+
+	if (ref->data)
+		ref->free_data(ref->data);
+
+	kfree_rcu(ref, rcu);
+}
+
+/**
+ * @brief Drop a reference
+ *
+ * @param[in] _ref: id_ref returned by id_registry_find
+*/
+#define id_ref_put(_ref)						\
+	(kref_put(&(_ref)->ref, id_ref_release))
+
+/**
+ * @brief Take another reference
+ *
+ * @param[in] _ref: id_ref already referenced by the caller
+*/
+#define id_ref_get(_ref)						\
+	(kref_get(&(_ref)->ref))
+
+/**
+ * @brief Find a live object using his id and take a reference to it
+ *
+ * @param[in] registry: registry of the id_refs
+ * @param[in] _id: identifier to find
+ * @param[out] ref_ref: id_ref found, setted to NULL if none is found or if
+ *	the object is being removed
+ *
+ * The lookup is RCU safe and it is a direct index in the registry, it never
+ * fails because of a concurrent reader. The reference must be dropped with
+ * id_ref_put.
+ *
+ * @return no return (do while macro)
+*/
+#define id_registry_find(registry, _id, ref_ref)			\
+	do {								\
+		rcu_read_lock();					\
+		id_registry_lookup((registry), (_id), (ref_ref));	\
+		if (*(ref_ref) &&					\
+		    ! kref_get_unless_zero(&(*(ref_ref))->ref))		\
+			*(ref_ref) = NULL;				\
+		rcu_read_unlock();					\
+		if (*(ref_ref) && READ_ONCE((*(ref_ref))->dead)) {	\
+			id_ref_put(*(ref_ref));				\
+			*(ref_ref) = NULL;				\
+		}							\
+	} while (0)
+
+/**
+ * @brief Mark an id_ref dead
+ *
+ * @param[in] _ref: id_ref to kill
+ *
+ * Only one remover wins, the lookups fail after this call.
+ *
+ * @return 1 if the caller killed the id_ref, 0 if it was already dead
+*/
+#define id_ref_kill(_ref)						\
+	(! xchg(&(_ref)->dead, 1))
+
+/**
+ * @brief Remove an id_ref from a registry
+ *
+ * @param[in] registry: registry of the id_refs
+ * @param[in] ref: id_ref to be removed, already dead
+ *
+ * The slot gets the next generation and goes back to the batch of current
+ * CPU. The reference of the registry is dropped, the caller still holds his
+ * own.
+*/
+static inline void id_registry_remove(struct id_registry *registry,
+				      struct id_ref *ref)
+{
+	u32 gen = id_registry_gen(ref->id) + 1;
+	unsigned long index = id_registry_index(ref->id);
+
+	/* the slot is present, nothing is allocated */
+	xa_store(&registry->xa, index, xa_mk_value(gen & ID_REGISTRY_GEN_MASK),
+		 GFP_ATOMIC);
+
+	id_registry_release(registry, id_registry_make_id(gen, index));
+	id_ref_put(ref);
+}
+
+/**
+ * @brief Initialize id_ref structure
+ *
+ * @param[in] _id: new id
+ * @param[in] _data: object referred by the id
+ * @param[out] _ref: out id_ref res
+ * @param[in] _free_data: function that frees _data
+ *
+ * The only reference is the one of the registry (see id_registry_add), if
+ * the id_ref is never added it is released with id_ref_put.
+ *
+ * @return None: do/while macro
+*/
+#define id_ref_init(_id, _data, _ref, _free_data)			\
+	do {								\
+		(_ref)->id = _id;					\
+		(_ref)->dead = 0;					\
+		(_ref)->data = _data;					\
+		(_ref)->free_data = _free_data;				\
+		kref_init(&(_ref)->ref);				\
+	} while (0)
+
+/**
+ * @brief Empty a registry of id_refs
+ *
+ * @param[in] registry: registry of the id_refs
+ * @param index: unsigned long iterator
+ * @param tmp_ref: id_ref iterator
+ * @param[in] deinit_data: function that tears down the objects still alive
+ *
+ * The objects still alive are killed and torn down, then the reference of
+ * the registry is dropped. The free slots are left to id_registry_destroy.
+ *
+ * @note Nobody must be able to reach the registry anymore (e.g. the
+ *	session is being released)
+ *
+ * @return None: do/while macro
+*/
+#define id_registry_reclaim(registry, index, tmp_ref, deinit_data)	\
+	do {								\
+		xa_for_each(&(registry)->xa, (index), (tmp_ref)) {	\
+			if (xa_is_value(tmp_ref))			\
+				continue;				\
+			xa_erase(&(registry)->xa, (index));		\
+			if (id_ref_kill(tmp_ref))			\
+				deinit_data(tmp_ref->data);		\
+			id_ref_put(tmp_ref);				\
+		}							\
+	} while (0)
+#endif /* __ID_REF_H__ */
@@ -13,17 +13,25 @@
 #include "ums_complist_internal.h"
 /* Only for delete part */
 #include "ums_scheduler_internal.h"
-#include "id_rwlock.h"
+#include "id_ref.h"
 #include "ums_scheduler.h"
 #include "ums_proc.h"
+#include "ums_trace.h"
+#include "ums_session.h"
 
-#include <linux/kfifo.h>
 #include <linux/list.h>
-#include <linux/hashtable.h>
+#include <linux/xarray.h>
 #include <linux/slab.h>
 #include <linux/ptrace.h>
 #include <linux/sched/task_stack.h>
+#include <linux/sched/signal.h>
 #include <asm/processor.h>
+#include <linux/log2.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/anon_inodes.h>
+#include <linux/file.h>
+#include <linux/poll.h>
 
 /**
  * @brief Constant that represent the fact that a compelem has no host
@@ -48,8 +56,8 @@
  * @note This macro assumes that the completion list can be
  *	safely reserved
  *
- * @warning Do not call without reserving it with the semaphore/queue
- *	mechanism
+ * @warning Do not call without reserving it with the ready shards
+ *	mechanism (see reserve_compelem)
  *
  * @return No return value (do/while macro)
  *
@@ -80,8 +88,8 @@
  * @note This macro covers only a part of the release mechanism implemented
  *	in this module. 
  *
- * @warning Do not call without reserving it with the semaphore/queue
- *	mechanism
+ * @warning Do not call without reserving it with the ready shards
+ *	mechanism (see reserve_compelem)
  *
  * @return No return value (do/while macro)
  *
@@ -99,40 +107,6 @@
 		(elem)->pid = -1;				\
 	} while (0)
 
-/**
- * @brief Register the compelement in complist as ready
- *
- * @param complist: completion list in which compelem get registered as ready
- * @param compelem: completion elem to be marked as ready
- *
- * This function register the completion element inside the complist. It used
- * a locked kfifo to safely insert the completion element inside the queue,
- * then it triggers an up to the integer semaphore used by complist.
- *
- * This mechanism is the dual of the reservation mechanism that calls down
- * to ensure that he can access to the queue and then safely calls 
- * kfifo_in_spinlocked.
- *
- *
- * @return No return value (do/while macro)
- *
- * @note This function does not check that a compelem is inserted twice, 
- *	that is a responsability of the developer.
- * @sa ums_compelem_add
- * @sa ums_compelem_store_reg
- * @sa ums_complist
- * @sa ums_compelem
-*/
-#define __register_compelem(complist, compelem)			\
-	do {							\
-		/* check if lock is necessary for kfifo */	\
-		kfifo_in_spinlocked(&(complist)->ready_queue,	\
-				    &(compelem),		\
-				    sizeof(compelem),		\
-				    &(complist)->ready_lock);	\
-		up(&complist->elem_sem);			\
-	} while (0)
-
 /**
  * @brief Ensure that current can run this compelem
  *
@@ -153,6 +127,16 @@
 #define __check_memory(complist)				\
 	(complist->mm != current->mm)
 
+/**
+ * @brief Check that a priority is one of the UMS_PRIO_* levels
+ *
+ * @param[in] prio: priority passed by the user
+ *
+ * @return non-zero if prio is valid
+*/
+#define __valid_prio(prio)					\
+	((unsigned int)(prio) < UMS_PRIO_LEVELS)
+
 /**
  * @brief Constant for the idle string used in complem proc file
 */
@@ -208,79 +192,40 @@
 #define COMPLIST_DIR_NAME "completion_lists"
 
 /**
- * @brief Find a compelem from the completion element hash table
- *
- * @param[in] id: identifier
- * @param[out] compelem: ref to the resulting compelem
- *
- * @return void
- * @note If no element was found set compelem to NULL
- * @todo Move into a private macro.
-*/
-#define __get_from_compelem_id(_id, compelem)			\
-	do {							\
-		*compelem = NULL;				\
-		hash_for_each_possible_rcu(ums_compelem_hash,	\
-					   *compelem,		\
-					   list, _id) {		\
-			if ((*compelem)->id == _id)		\
-				break;				\
-		}						\
-	} while (0)
-/**
- * @brief hash_rwlock of the completion lists
- *
- * Delete safe completion list hash to safely read and write to the
- * completion list. Maps identifiers to real ums_complist structures
- *
- *
- * \sa id_rwlock.h
- * \sa DEFINE_HASHRWLOCK
+ * @brief name of the file with the info of a completion list
 */
-static DEFINE_HASHRWLOCK(ums_complist_hash, UMS_COMPLIST_HASH_BITS);
+#define COMPLIST_INFO_FILE "info"
 
 /**
- * @brief Hash table of completion elements
+ * @brief Sort key of a completion element in an EDF completion list
  *
- * Maps compelem_id to ums_compelem. No need to use rwlocks since 
- * completion lists are accessed only by a thread at the same time.
- *
-*/
-static DEFINE_HASHTABLE(ums_compelem_hash, UMS_COMPELEM_HASH_BITS);
-
-/**
- * @brief Atomic counter for the complist ids
+ * @param[in] compelem: completion element
  *
- * This counter is used to define concurrently new completion lists
- * using atomic_inc_return which atomically increments and return the
- * incremented value.
+ * The elements without a deadline go after all the others.
  *
- * @sa ums_complist_id
- * @sa ums_complist_hash
+ * @return the deadline in ns, U64_MAX if there is none
 */
-static atomic_t ums_complist_counter = ATOMIC_INIT(0);
+#define __edf_key(compelem)					\
+	((compelem)->deadline ? (compelem)->deadline : U64_MAX)
 
 /**
- * @brief Atomic counter for the compelem ids
+ * @brief Check (without locks) that a completion element is ready
  *
- * This counter is used to define concurrently new completion lists
- * using atomic_inc_return which atomically increments and return the
- * incremented value.
+ * @param[in] compelem: completion element
  *
- * @sa ums_compelem_id
- * @sa ums_compelem_hash
+ * @return non-zero if the element is in a ready shard or in the EDF tree
 */
-static atomic_t ums_compelem_counter = ATOMIC_INIT(0);
+#define __is_ready(compelem)					\
+	(READ_ONCE((compelem)->shard) ||			\
+	 ! RB_EMPTY_NODE(&(compelem)->edf_node))
 
 /**
- * @brief completion list proc top level directory `completion_lists`
+ * @brief Scans of the ready shards before a reserver gives up
  *
- * This is the entry of the proc directory /proc/ums/compl
- *
- * @sa ums_complist_proc_init
- * @sa ums_complist_proc_deinit
+ * A scan misses an element only while ums_compelem_switch or
+ * ums_compelem_set_prio move it, the reserver then spins or sleeps.
 */
-static struct proc_dir_entry *ums_complist_dir = NULL;
+#define READY_POP_RETRIES 4
 
 static ssize_t compelem_proc_read(struct file *file,
 				  char __user *ubuf, 
@@ -302,6 +247,22 @@ static struct proc_ops ums_compelem_proc_ops =
 	.proc_read = compelem_proc_read,
 };
 
+static ssize_t complist_proc_read(struct file *file,
+				  char __user *ubuf,
+				  size_t count,
+				  loff_t *ppos);
+
+/**
+ * @brief completion list legal operation for its info proc file
+ *
+ * @sa complist_proc_read
+ * @sa ums_compelem_proc_ops
+*/
+static struct proc_ops ums_complist_proc_ops =
+{
+	.proc_read = complist_proc_read,
+};
+
 /* end procfs */
 
 /**
@@ -321,57 +282,269 @@ struct id_entry {
 	struct list_head list;
 };
 
-static int new_complist(ums_complist_id comp_id,
-			 struct ums_complist *complist);
+static int new_complist(struct ums_session *session,
+			ums_complist_id comp_id,
+			struct ums_complist *complist);
 
-static int remove_complist(ums_complist_id comp_id);
+static int remove_complist(struct ums_session *session,
+			   ums_complist_id comp_id);
 
 static int deinit_complist(struct ums_complist *complist);
 
+static void free_complist(void *data);
+
 static int new_compelement(ums_compelem_id elem_id,
-			   struct ums_complist *complist,
+			   struct id_ref *complist_ref,
+			   int prio,
+			   u64 deadline,
 			   struct ums_compelem *comp_elem);
 
+static void deinit_compelem(struct ums_compelem *compelem);
+
+static void compelem_unready(struct ums_compelem *compelem);
+
+static void free_compelem(void *data);
+
 
 static int reserve_compelem(struct ums_complist *complist,
 			    struct ums_compelem **compelem,
 			    struct list_head *reserve_head,
 			    int do_sleep);
 
+static void __register_compelem(struct ums_complist *complist,
+				struct ums_compelem *compelem,
+				int yielded);
+
+static int ready_ring_publish(struct ums_ready_ring *ring,
+			      struct ums_compelem *compelem);
+
+static struct ums_compelem *ready_ring_claim(struct ums_session *session,
+					     struct ums_ready_ring *ring);
+
+static void ready_ring_free(struct ums_ready_ring *ring);
+
+static struct ums_compelem *ready_shards_pop(struct ums_complist *complist,
+					     int first_cpu);
+
+static void shard_queued(struct ums_complist *complist,
+			 struct ums_ready_shard *shard,
+			 int prio);
+
+static void shard_dequeued(struct ums_complist *complist,
+			   struct ums_ready_shard *shard,
+			   int prio);
+
+static int complist_has_ready(struct ums_complist *complist);
+
+static int complist_nr_ready(struct ums_complist *complist);
+
+static void ready_shards_lock(struct ums_ready_shard *a,
+			      struct ums_ready_shard *b);
+
+static void ready_shards_unlock(struct ums_ready_shard *a,
+				struct ums_ready_shard *b);
+
+static void ready_shards_push(struct ums_complist *complist,
+			      struct ums_compelem *compelem,
+			      int head);
+
+static void shards_enqueue_tail(struct ums_complist *complist,
+				struct ums_compelem *compelem);
+
+static void shards_enqueue_head(struct ums_complist *complist,
+				struct ums_compelem *compelem);
+
+static struct ums_compelem *shards_pick_local(struct ums_complist *complist);
+
+static struct ums_compelem *shards_pick_rr(struct ums_complist *complist);
+
+static int shards_swap(struct ums_complist *complist,
+		       struct ums_compelem *from,
+		       struct ums_compelem *to);
+
+static void edf_enqueue(struct ums_complist *complist,
+			struct ums_compelem *compelem);
+
+static struct ums_compelem *edf_pop(struct ums_complist *complist);
+
+static int edf_swap(struct ums_complist *complist,
+		    struct ums_compelem *from,
+		    struct ums_compelem *to);
+
+static bool edf_less(struct rb_node *a, const struct rb_node *b);
+
+static void check_deadline(struct ums_compelem *compelem, u64 now);
+
+static void track_cpu(struct ums_compelem *compelem);
+
+static void track_arrival(struct ums_complist *complist);
+
+static struct ums_compelem *idle_spin(struct ums_complist *complist);
+
+static __poll_t complist_fd_poll(struct file *file, poll_table *wait);
+
+static int complist_fd_release(struct inode *inode, struct file *file);
+
+/**
+ * @brief name of the anonymous inode of the completion list files
+*/
+#define UMS_COMPLIST_FD_NAME "[ums_complist]"
+
+/**
+ * @brief file operations of the completion list file descriptor
+ *
+ * @sa ums_complist_fd
+*/
+static const struct file_operations complist_fd_fops = {
+	.owner = THIS_MODULE,
+	.poll = complist_fd_poll,
+	.release = complist_fd_release,
+};
+
+/**
+ * @brief The completion list policies, indexed by UMS_POLICY_*
+ *
+ * @sa ums_policy_ops
+*/
+static const struct ums_policy_ops ums_policies[UMS_POLICY_COUNT] = {
+	[UMS_POLICY_FIFO] = {
+		.name = "fifo",
+		.enqueue = shards_enqueue_tail,
+		.pick_next = shards_pick_local,
+		.swap = shards_swap,
+		.ready_ring = 1,
+	},
+	[UMS_POLICY_EDF] = {
+		.name = "edf",
+		.enqueue = edf_enqueue,
+		.pick_next = edf_pop,
+		.swap = edf_swap,
+	},
+	[UMS_POLICY_LIFO] = {
+		.name = "lifo",
+		.enqueue = shards_enqueue_head,
+		/* the element that yields must not run again right away */
+		.on_yield = shards_enqueue_tail,
+		.pick_next = shards_pick_local,
+		.swap = shards_swap,
+	},
+	[UMS_POLICY_RR] = {
+		.name = "rr",
+		.enqueue = shards_enqueue_tail,
+		.pick_next = shards_pick_rr,
+		.swap = shards_swap,
+		.ready_ring = 1,
+	},
+};
+
+/**
+ * @brief Find a completion list and take a reference to it
+ *
+ * @param[in] session: session that owns the completion list
+ * @param[in] comp_id: completion list identifier
+ * @param[out] ref: id_ref of the completion list (release it with
+ *	id_ref_put)
+ *
+ * The completion list stays allocated until the reference is dropped, but
+ * it can be removed concurrently (see ums_complist.dead).
+ *
+ * @return 0 if the completion list was found, -ENOENT if it does not
+ *	exist or it is being removed
+*/
+static int complist_get(struct ums_session *session,
+			ums_complist_id comp_id,
+			struct id_ref **ref)
+{
+	id_registry_find(&session->complists, comp_id, ref);
+
+	if (! *ref)
+		return -ENOENT;
+
+	return 0;
+}
+
+/**
+ * @brief Find a completion element and take a reference to it
+ *
+ * @param[in] session: session that owns the completion element
+ * @param[in] id: completion element identifier
+ * @param[out] ref: id_ref of the completion element (release it with
+ *	id_ref_put)
+ *
+ * The element and its completion list stay allocated until the reference
+ * is dropped, but the element can be removed concurrently.
+ *
+ * @return 0 if the element was found, -ENOENT if it does not exist or it
+ *	is being removed
+*/
+static int compelem_get(struct ums_session *session,
+			ums_compelem_id id,
+			struct id_ref **ref)
+{
+	id_registry_find(&session->compelems, id, ref);
+
+	if (! *ref)
+		return -ENOENT;
+
+	return 0;
+}
+
 /**
  *
  * @brief Add a new empty completion list
  *
+ * @param[in] session: session that owns the new list
  * @param[out] result: identifier of the new created list
  *
- * @return 0 if no error occured, non-zero otherwise
+ * @return 0 if no error occured, -errno otherwise
 */
-int ums_complist_add(ums_complist_id *result)
+int ums_complist_add(struct ums_session *session, ums_complist_id *result)
 {
 	int res;
 	struct ums_complist* ums_complist;
-	struct id_rwlock *lock;
+	struct id_ref *ref;
+
+	res = id_registry_reserve(&session->complists, result);
 
-	*result = atomic_inc_return(&ums_complist_counter);
+	if (unlikely(res))
+		return res;
 
 	ums_complist = (struct ums_complist*) kmalloc(sizeof(struct ums_complist),
 						      GFP_KERNEL);
 
 	if (! ums_complist) {
-		return -1;
+		id_registry_release(&session->complists, *result);
+		return -ENOMEM;
 	}
 
-	res = new_complist(*result, ums_complist);
+	res = new_complist(session, *result, ums_complist);
 
 
 	if (res) {
+		id_registry_release(&session->complists, *result);
 		kfree(ums_complist);
+		return res;
+	}
+
+	ref = kmalloc(sizeof(struct id_ref), GFP_KERNEL);
+
+	if (! ref) {
+		id_registry_release(&session->complists, *result);
+		deinit_complist(ums_complist);
+		free_complist(ums_complist);
+		return -ENOMEM;
 	}
 
-	lock = kmalloc(sizeof(struct id_rwlock), GFP_KERNEL);
-	id_rwlock_init(*result, ums_complist, lock);
+	id_ref_init(*result, ums_complist, ref, free_complist);
+
+	res = id_registry_add(&session->complists, ref);
 
-	hashrwlock_add(ums_complist_hash, lock);
+	if (unlikely(res)) {
+		id_registry_release(&session->complists, *result);
+		deinit_complist(ums_complist);
+		/* frees ums_complist */
+		id_ref_put(ref);
+	}
 
 	return res;
 }
@@ -379,6 +552,7 @@ int ums_complist_add(ums_complist_id *result)
 /**
  * @brief Register a scheduler to the completion list
  *
+ * @param[in] session: session that owns the completion list
  * @param[in] id: identifier of the completion list
  * @param[in] sched_id: identifier of the scheduler to be added
  *
@@ -386,49 +560,55 @@ int ums_complist_add(ums_complist_id *result)
  * scheduler that are using this completion list. If the thread group id of
  * the scheduler is different from the complist one return an error.
  * 
- * @note The procedure uses spin_lock for the list and read lock for the 
- *	scheduler, hence, it is thread safe.
+ * @note The procedure uses spin_lock for the list and a reference for the
+ *	completion list, hence, it is thread safe.
  *
- * @return 0 if no error occured, non-zero otherwise
+ * @return 0 if no error occured, -errno otherwise
 */
-int ums_complist_add_scheduler(ums_complist_id id, 
+int ums_complist_add_scheduler(struct ums_session *session,
+			       ums_complist_id id, 
 			       ums_sched_id sched_id)
 {
 	int res;
-	struct id_rwlock *lock;
+	struct id_ref *ref;
 	struct ums_complist *complist;
 	struct id_entry *sched_list;
 
-	hashrwlock_find(ums_complist_hash, id, &lock);
-
-	if (! lock)
-		return -1;
-
-	if (! lock->data)
-		return -1;
+	sched_list = kmalloc(sizeof(struct id_entry), GFP_KERNEL);
 
-	res = 0;
+	if (! sched_list)
+		return -ENOMEM;
 
-	complist = lock->data;
+	sched_list->id = sched_id;
 
-	sched_list = kmalloc(sizeof(struct id_entry), GFP_KERNEL);
+	res = complist_get(session, id, &ref);
 
-	sched_list->id = sched_id;
+	if (res) {
+		kfree(sched_list);
+		return res;
+	}
 
-	if (! id_read_trylock(lock))
-		return -1;
+	complist = ref->data;
 
 	if (__check_memory(complist)) {
-		res = -EFAULT;
+		res = -EPERM;
 	}
 	else {
+		/* serialized with deinit_complist */
 		spin_lock(&complist->schedulers_lock);
-		list_add(&sched_list->list, &complist->schedulers);
+
+		if (complist->dead) {
+			res = -ENOENT;
+		}
+		else {
+			list_add(&sched_list->list, &complist->schedulers);
+			res = 0;
+		}
+
 		spin_unlock(&complist->schedulers_lock);
-		res = 0;
 	}
 
-	id_read_unlock(lock);
+	id_ref_put(ref);
 
 	if (res)
 		kfree(sched_list);
@@ -437,29 +617,25 @@ int ums_complist_add_scheduler(ums_complist_id id,
 }
 
 
-static int remove_complist(ums_complist_id id)
+static int remove_complist(struct ums_session *session, ums_complist_id id)
 {
-	struct ums_complist *complist;
-	struct id_rwlock *lock;
+	struct id_ref *ref;
 
-	hashrwlock_find(ums_complist_hash, id, &lock);
+	id_registry_find(&session->complists, id, &ref);
 
-	if (! lock)
-		return -1;
-
-	if (! lock->data)
+	if (! ref)
 		/* Already removed means success */
 		return 0;
 
-	complist = lock->data;
-
-	id_write_lock(lock);
+	if (id_ref_kill(ref)) {
+		deinit_complist(ref->data);
 
-	deinit_complist(complist);
-	lock->data = NULL;
-	kfree(complist);
+		/* the index can be reused, the memory is freed by the last
+		 * user */
+		id_registry_remove(&session->complists, ref);
+	}
 
-	id_write_unlock(lock);
+	id_ref_put(ref);
 
 	return 0;
 }
@@ -467,8 +643,11 @@ static int remove_complist(ums_complist_id id)
 /**
  * @brief Add a new completion list
  *
+ * @param[in] session: session that owns the completion list
  * @param[out] result: the new compelem identifier
  * @param[in] list_id: the already existing complist that will contains compelem
+ * @param[in] prio: priority of the compelem (UMS_PRIO_*)
+ * @param[in] deadline: absolute deadline of the compelem in ns, 0 if none
  * @param user_data: A user mode pointer in which is going to be stored the result id
  *
  * This function check if the completion list exists, 
@@ -480,57 +659,61 @@ static int remove_complist(ums_complist_id id)
  * @sa ums_complist_create
  * @sa __register_compelem
  *
- * @return EFAULT if the function fails, otherwise it gets stuck until remove is called.
+ * @return -errno if the function fails, otherwise it gets stuck until remove is called.
 */
-int ums_compelem_add(ums_compelem_id* result,
+int ums_compelem_add(struct ums_session *session,
+		     ums_compelem_id* result,
 		     ums_complist_id list_id,
+		     int prio,
+		     u64 deadline,
 		     void * __user user_data)
 {
 	int res;
 	struct ums_compelem *compelem;
 	struct ums_complist *complist;
-	struct id_rwlock *lock;
-
-	*result = atomic_inc_return(&ums_compelem_counter);
-
-	hashrwlock_find(ums_complist_hash, list_id, &lock);
+	struct id_ref *ref;
 
-	if (! lock) {
-		printk(KERN_DEBUG "Complist %d not found!\n", list_id);
-		return -1;
-	}
+	if (! __valid_prio(prio))
+		return -EINVAL;
 
-	if (! lock->data) {
-		printk(KERN_DEBUG "Complist %d has been deleted!\n", list_id);
-		return -1;
-	}
+	res = complist_get(session, list_id, &ref);
 
-	if (! id_read_trylock(lock))
-		return -1;
+	if (res)
+		return res;
 
-	complist = lock->data;
+	complist = ref->data;
 
 	if (__check_memory(complist)) {
-		res = -EFAULT;
+		res = -EPERM;
 	}
 	else {
 		compelem = kmalloc(sizeof(struct ums_compelem), GFP_KERNEL);
 
 		if (unlikely(! compelem))  {
-			res = -1;
+			res = -ENOMEM;
 		}
 		else {
-			res = new_compelement(*result, complist, compelem);
+			res = id_registry_reserve(&session->compelems,
+						  result);
+
+			if (likely(! res))
+				res = new_compelement(*result, ref, prio,
+						      deadline, compelem);
 
-			__register_compelem(complist, compelem);
+			if (likely(! res))
+				__register_compelem(complist, compelem, 0);
+			else
+				kfree(compelem);
 		}
 	}
 
-	id_read_unlock(lock);
+	id_ref_put(ref);
 
 	if (res)
 		return res;
 
+	trace_ums_compelem_add(list_id, *result, 0);
+
 	/* copy to the user the current id before sleeping forever */
 	/* When a scheduler thread will wake up he will have the correct 
 	 * informations */
@@ -547,41 +730,65 @@ int ums_compelem_add(ums_compelem_id* result,
 /**
  * @brief Remove a completion element
  *
+ * @param[in] session: session that owns the completion element
  * @param[in] id: completion element identifier
  *
  * This function is in charge of removing the completion element.
  * It has also another effect: if it find out that the completion list
  * after the removal of "self" is empty, it then triggers delete_complist
  *
- * @warning This function is not thread safe. Is the developer that is responsible
- * of enacting a single use policy of this function (when the same id is the
- * parameter)
+ * Only one of the concurrent removals of the same element succeeds (see
+ * id_ref_kill). The element is taken out of the ready structures and its
+ * time slice is stopped, the memory is released by the last reference (see
+ * free_compelem).
  *
- * @return 0 if everything is ok, non-zero otherwise
+ * @return 0 if everything is ok, -ENOENT if the element does not exist (or
+ *	the id is stale) or it is being removed, -EFAULT if current cannot
+ *	remove it
 */
-int ums_compelem_remove(ums_compelem_id id)
+int ums_compelem_remove(struct ums_session *session, ums_compelem_id id)
 {
 	struct ums_compelem *compelem;
+	struct id_ref *ref;
+	int res;
 
-	__get_from_compelem_id(id, &compelem);
+	res = compelem_get(session, id, &ref);
 
-	if (! compelem)
-		return -EFAULT;
+	if (res)
+		return res;
 
-	if (unlikely(compelem->pid != current->pid)) {
-		return -EFAULT;
+	compelem = ref->data;
+
+	/* Either the thread that runs it or, when user space switches the
+	 * elements by itself (hybrid mode), a sched worker of its completion
+	 * list that hosts it while it is parked or running */
+	if (unlikely(compelem->pid != current->pid &&
+		     (__check_memory(compelem->complist) ||
+		      (! compelem->parked &&
+		       compelem->host_id == COMPELEM_NO_HOST) ||
+		      ums_sched_current_complist() !=
+		      compelem->complist->id))) {
+		res = -EFAULT;
+		goto compelem_remove_exit;
 	}
 
-	hash_del_rcu(&compelem->list);
-
-	if (compelem->reserve_head) {
-		list_del(&compelem->reserve_list);
-		if (list_empty(compelem->reserve_head))
-			kfree(compelem->reserve_head);
+	/* a concurrent removal won */
+	if (! id_ref_kill(ref)) {
+		res = -ENOENT;
+		goto compelem_remove_exit;
 	}
 
+	trace_ums_compelem_remove(compelem->complist->id, id, compelem->host_id);
+
+	/* drops the reference of the registry */
+	id_registry_remove(&session->compelems, ref);
 
-	printk(KERN_DEBUG "Delete compelem %d proc file", id);
+	compelem_unready(compelem);
+
+	if (compelem->reserve_head)
+		__set_released(compelem);
+
+	ums_sched_compelem_removed(id);
 
 	/* critical list region */
 	spin_lock(&compelem->complist->compelems_lock);
@@ -594,197 +801,518 @@ int ums_compelem_remove(ums_compelem_id id)
 		/* Here using the function with locks is still necessary for
 		 * safety reasons! */
 		spin_unlock(&compelem->complist->compelems_lock);
-		remove_complist(compelem->complist->id);
+		remove_complist(session, compelem->complist->id);
 	}
 	else
 		spin_unlock(&compelem->complist->compelems_lock);
 
+	deinit_compelem(compelem);
 
-	ums_proc_delete(compelem->proc_file);
-
-	wake_up_process(compelem->elem_task);
-	kfree(compelem);
-
-	return 0;
+compelem_remove_exit:
+	/* the last one frees the element */
+	id_ref_put(ref);
+	return res;
 }
 
 /**
- * @brief Initialize the completion list sub-module
+ * @brief Change the priority of a completion element
+ *
+ * @param[in] session: session that owns the completion element
+ * @param[in] id: completion element identifier
+ * @param[in] prio: new priority (UMS_PRIO_*)
+ *
+ * If the element is in a ready shard it is moved to the queue of the new
+ * level (at its tail) of the same shard. Otherwise the new priority is
+ * used the next time the element becomes ready: a registration that runs
+ * concurrently might still queue it once at the previous level.
  *
- * @return 0 if the module is successfully created, non-zero otherwise
+ * @return 0 if everything is OK, -EINVAL if prio is not valid, -ENOENT if
+ *	the element does not exist, -EPERM if current does not share the
+ *	memory map of its completion list
 */
-int ums_complist_init(void)
+int ums_compelem_set_prio(struct ums_session *session,
+			  ums_compelem_id id,
+			  int prio)
 {
-	/* TODO: use hash_rwlock_init */
-	hash_init(ums_complist_hash);
-	hash_init(ums_compelem_hash);
-	id_rwlock_init_mod();
+	struct ums_compelem *compelem;
+	struct ums_complist *complist;
+	struct ums_ready_shard *shard;
+	struct id_ref *ref;
+	int res;
 
-	return 0;
+	if (! __valid_prio(prio))
+		return -EINVAL;
+
+	res = compelem_get(session, id, &ref);
+
+	if (res)
+		return res;
+
+	compelem = ref->data;
+	complist = compelem->complist;
+
+	if (__check_memory(complist)) {
+		res = -EPERM;
+		goto set_prio_exit;
+	}
+
+	WRITE_ONCE(compelem->prio, prio);
+
+	shard = READ_ONCE(compelem->shard);
+
+	if (! shard)
+		goto set_prio_exit;
+
+	spin_lock(&shard->lock);
+
+	/* the element might have been reserved in the meantime */
+	if (compelem->shard == shard && compelem->ready_prio != prio) {
+		list_move_tail(&compelem->ready_node, &shard->queue[prio]);
+		shard_dequeued(complist, shard, compelem->ready_prio);
+		shard_queued(complist, shard, prio);
+		compelem->ready_prio = prio;
+	}
+
+	spin_unlock(&shard->lock);
+
+set_prio_exit:
+	id_ref_put(ref);
+	return res;
 }
 
 /**
- * @brief Initialize completion list proc submodule
- *
- * @param ums_dir ums directory, which is going to be the parent dir of completion_list dir
- * Initialized the proc directory used in this file to handle proc filesystem info.
+ * @brief Change the deadline of a completion element
  *
- * @sa COMPLIST_DIR_NAME
- * @sa ums_complist_dir
+ * @param[in] session: session that owns the completion element
+ * @param[in] id: completion element identifier
+ * @param[in] deadline: new absolute deadline in ns, 0 for none
  *
- * @return 0 if the directory is succesfully created, non-zero otherwise
+ * If the element is ready in an EDF completion list it is moved to its new
+ * position. The miss of the new deadline is counted again. The reference of
+ * the element keeps its list, and so edf_lock, allocated.
  *
+ * @return 0 if everything is OK, -ENOENT if the element does not exist,
+ *	-EPERM if current does not share the memory map of its completion
+ *	list
 */
-int ums_complist_proc_init(struct proc_dir_entry *ums_dir)
+int ums_compelem_set_deadline(struct ums_session *session,
+			      ums_compelem_id id,
+			      u64 deadline)
 {
-	ums_complist_dir = proc_mkdir(COMPLIST_DIR_NAME, ums_dir);
+	struct ums_compelem *compelem;
+	struct ums_complist *complist;
+	struct id_ref *ref;
+	int queued, res;
+
+	res = compelem_get(session, id, &ref);
 
-	return !ums_complist_dir;
+	if (res)
+		return res;
+
+	compelem = ref->data;
+	complist = compelem->complist;
+
+	if (__check_memory(complist)) {
+		id_ref_put(ref);
+		return -EPERM;
+	}
+
+	spin_lock(&complist->edf_lock);
+
+	queued = ! RB_EMPTY_NODE(&compelem->edf_node);
+
+	if (queued)
+		rb_erase_cached(&compelem->edf_node, &complist->edf_root);
+
+	WRITE_ONCE(compelem->deadline, deadline);
+	compelem->deadline_missed = 0;
+
+	if (queued)
+		rb_add_cached(&compelem->edf_node, &complist->edf_root,
+			      edf_less);
+
+	spin_unlock(&complist->edf_lock);
+
+	id_ref_put(ref);
+	return 0;
 }
 
 /**
- * @brief Deinitialize ums completion list sub-module
- * 
- * Remove completion list and completion elements hash and structures that
- * were used in this sub-module
+ * @brief Set the policy of a completion list
  *
- * @sa ums_complist_proc_init
- * @sa ums_complist_deinit
- * @sa ums_complist_init
- * @sa ums_complist_dir
+ * @param[in] session: session that owns the completion list
+ * @param[in] id: completion list identifier
+ * @param[in] policy: one of the UMS_POLICY_* values
+ * @param[in] flags: UMS_POLICY_F_* flags
  *
- * @return void
+ * The ready elements are kept in the structure of the policy (the shards
+ * or the EDF tree), so the policy can change only while the completion
+ * list has no elements.
+ *
+ * @return 0 if everything is OK, -EINVAL if policy or flags are not
+ *	valid, -ENOENT
+ *	if the completion list does not exist, -EPERM if current does not
+ *	share its memory map, -EBUSY if it has elements
 */
-void ums_complist_deinit(void)
+int ums_complist_set_policy(struct ums_session *session,
+			    ums_complist_id id,
+			    unsigned int policy,
+			    unsigned int flags)
 {
-	int bkt;
-	struct list_head *iter, *safe_iter;
-	struct hlist_node *tmp;
-	struct ums_compelem *res_elem;
-	struct id_rwlock *tmp_rwlock;
+	int res;
+	struct ums_complist *complist;
+	struct id_ref *ref;
 
-	id_rwlock_deinit_mod(iter, safe_iter, tmp_rwlock, deinit_complist);
+	if (policy >= UMS_POLICY_COUNT ||
+	    (flags & ~UMS_POLICY_F_KERNEL_DISPATCH))
+		return -EINVAL;
 
-	hash_for_each_safe(ums_compelem_hash, bkt, tmp, res_elem, list) {
-		if (res_elem) {
-			ums_proc_delete(res_elem->proc_file);
+	res = complist_get(session, id, &ref);
 
-			wake_up_process(res_elem->elem_task);
-			kfree(res_elem);
-		}
+	if (res)
+		return res;
+
+	complist = ref->data;
+
+	if (__check_memory(complist)) {
+		res = -EPERM;
+		goto set_policy_exit;
+	}
 
+	/* serialized with new_compelement */
+	spin_lock(&complist->compelems_lock);
+
+	if (list_empty(&complist->compelems)) {
+		WRITE_ONCE(complist->ops, &ums_policies[policy]);
+		WRITE_ONCE(complist->policy_flags, flags);
 	}
+	else
+		res = -EBUSY;
+
+	spin_unlock(&complist->compelems_lock);
+
+set_policy_exit:
+	id_ref_put(ref);
+	return res;
 }
 
 /**
- * @brief Deinitialize ums completion list proc sub-module
- * 
- * Remove `completion_list` folder entry.
+ * @brief Set the spin budget of the idle reservers of a completion list
  *
- * @sa ums_complist_proc_init
- * @sa ums_complist_deinit
- * @sa ums_complist_init
- * @sa ums_complist_dir
+ * @param[in] session: session that owns the completion list
+ * @param[in] id: completion list identifier
+ * @param[in] spin_ns: maximum spin in ns, 0 to always sleep
  *
- * @return void
+ * @sa idle_spin
+ *
+ * @return 0 if no error occured, -EINVAL if spin_ns is above
+ *	UMS_IDLE_SPIN_MAX_NS, -ENOENT if the list does not exist, -EPERM if
+ *	current does not share its memory map
 */
-void ums_complist_proc_deinit(void)
+int ums_complist_set_idle(struct ums_session *session,
+			  ums_complist_id id,
+			  u64 spin_ns)
 {
-	ums_proc_delete(ums_complist_dir);
-	ums_complist_dir = NULL;
+	int res;
+	struct id_ref *ref;
+
+	if (spin_ns > UMS_IDLE_SPIN_MAX_NS)
+		return -EINVAL;
+
+	res = complist_get(session, id, &ref);
+
+	if (res)
+		return res;
+
+	if (__check_memory((struct ums_complist *)ref->data))
+		res = -EPERM;
+	else
+		WRITE_ONCE(((struct ums_complist *)ref->data)->spin_ns,
+			   spin_ns);
+
+	id_ref_put(ref);
+	return res;
 }
 
 /**
- * @brief Reserve a list of completion element
+ * @brief Set the time slice of the elements of a completion list
  *
- * @param[in] comp_id: identifier of the completion list 
- * @param[in] to_reserve: the maximum number of completion element to be reserved
- * @param[out] ret_array: a pointer to an already initialized array that stores the result
+ * @param[in] session: session that owns the completion list
+ * @param[in] id: completion list identifier
+ * @param[in] slice_ns: time slice in ns, 0 for none
+ *
+ * @return 0 if no error occured, -ENOENT if the list does not exist,
+ *	-EPERM if current does not share its memory map
+*/
+int ums_complist_set_time_slice(struct ums_session *session,
+				ums_complist_id id,
+				u64 slice_ns)
+{
+	int res;
+	struct id_ref *ref;
+
+	res = complist_get(session, id, &ref);
+
+	if (res)
+		return res;
+
+	if (__check_memory((struct ums_complist *)ref->data))
+		res = -EPERM;
+	else
+		WRITE_ONCE(((struct ums_complist *)ref->data)->time_slice,
+			   slice_ns);
+
+	id_ref_put(ref);
+	return res;
+}
+
+/**
+ * @brief Time slice of a completion element
+ *
+ * @param[in] session: session that owns the completion element
+ * @param[in] id: completion element identifier
+ *
+ * @return the time slice of the list of the element in ns, 0 if none or
+ *	if the element does not exist
+*/
+u64 ums_compelem_time_slice(struct ums_session *session,
+			    ums_compelem_id id)
+{
+	struct ums_compelem *compelem;
+	struct id_ref *ref;
+	u64 slice;
+
+	if (compelem_get(session, id, &ref))
+		return 0;
+
+	compelem = ref->data;
+	slice = READ_ONCE(compelem->complist->time_slice);
+
+	id_ref_put(ref);
+	return slice;
+}
+
+/**
+ * @brief Wait for the removal of a completion list
+ *
+ * @param[in] session: session that owns the completion list
+ * @param[in] id: completion list to wait for
+ * @param[in] timeout_ns: maximum wait in ns, negative to wait forever
+ *
+ * A completion list is removed when its last element ends. Any number of
+ * threads can wait for the same list.
+ *
+ * @return 0 if the list has been removed, -ENOENT if it does not exist (or
+ *	it was already removed), -EPERM if current does not share its memory
+ *	map, -ETIMEDOUT if the timeout expired, -EINTR if a signal arrived
+*/
+int ums_complist_wait(struct ums_session *session,
+		      ums_complist_id id,
+		      s64 timeout_ns)
+{
+	struct ums_complist *complist;
+	struct id_ref *ref;
+	int res;
+
+	res = complist_get(session, id, &ref);
+
+	if (res)
+		return res;
+
+	complist = ref->data;
+
+	if (__check_memory(complist)) {
+		id_ref_put(ref);
+		return -EPERM;
+	}
+
+	if (timeout_ns < 0)
+		res = wait_event_interruptible(complist->drain_wait,
+					       READ_ONCE(complist->dead));
+	else
+		res = wait_event_interruptible_hrtimeout(complist->drain_wait,
+							 READ_ONCE(complist->dead),
+							 ns_to_ktime(timeout_ns));
+
+	id_ref_put(ref);
+
+	if (res == -ETIME)
+		return -ETIMEDOUT;
+
+	return res ? -EINTR : 0;
+}
+
+/**
+ * @brief Create a file descriptor to poll a completion list
+ *
+ * @param[in] dev_file: device file, the new file keeps its session alive
+ * @param[in] comp_id: completion list identifier
+ *
+ * The new file holds a reference of the completion list until it is
+ * closed, see complist_fd_poll.
+ *
+ * @return the new file descriptor, -ENOENT if the list does not exist,
+ *	-EPERM if current does not share its memory map, -errno otherwise
+*/
+int ums_complist_fd(struct file *dev_file, ums_complist_id comp_id)
+{
+	struct ums_complist_file *cfile;
+	int res, fd;
+
+	cfile = kmalloc(sizeof(struct ums_complist_file), GFP_KERNEL);
+
+	if (unlikely(! cfile))
+		return -ENOMEM;
+
+	res = complist_get(dev_file->private_data, comp_id, &cfile->ref);
+
+	if (res) {
+		kfree(cfile);
+		return res;
+	}
+
+	if (__check_memory((struct ums_complist *)cfile->ref->data)) {
+		id_ref_put(cfile->ref);
+		kfree(cfile);
+		return -EPERM;
+	}
+
+	cfile->dev_file = get_file(dev_file);
+
+	fd = anon_inode_getfd(UMS_COMPLIST_FD_NAME, &complist_fd_fops, cfile,
+			      O_RDONLY | O_CLOEXEC);
+
+	if (fd < 0) {
+		id_ref_put(cfile->ref);
+		fput(cfile->dev_file);
+		kfree(cfile);
+	}
+
+	return fd;
+}
+
+/**
+ * @brief Initialize the completion lists of a session
+ *
+ * @param[in] session: new session
+ *
+ * Creates the completion lists proc directory of the session.
+ *
+ * @sa COMPLIST_DIR_NAME
+ *
+ * @return 0 if the directory is succesfully created, non-zero otherwise
+*/
+int ums_complist_session_init(struct ums_session *session)
+{
+	session->complist_dir = proc_mkdir(COMPLIST_DIR_NAME,
+					   session->proc_dir);
+
+	return ! session->complist_dir;
+}
+
+/**
+ * @brief Destroy the completion lists and elements of a session
+ *
+ * @param[in] session: session being released
+ *
+ * Free the completion elements still registered, then the completion lists
+ * (which remove their schedulers) with their id_ref, and remove the
+ * `completion_lists` folder entry.
+ *
+ * @sa ums_complist_session_init
+ *
+ * @return void
+*/
+void ums_complist_session_deinit(struct ums_session *session)
+{
+	unsigned long index;
+	struct id_ref *tmp_ref;
+
+	/* the elements drop their references of the lists */
+	id_registry_reclaim(&session->compelems, index, tmp_ref,
+			    deinit_compelem);
+
+	id_registry_reclaim(&session->complists, index, tmp_ref,
+			    deinit_complist);
+
+	ums_proc_delete(session->complist_dir);
+	session->complist_dir = NULL;
+}
+
+/**
+ * @brief Reserve a list of completion element
+ *
+ * @param[in] session: session that owns the completion list
+ * @param[in] comp_id: identifier of the completion list 
+ * @param[in] to_reserve: the maximum number of completion element to be reserved
+ * @param[in] reserve_head: reservation list of the caller, owned by the
+ *	scheduler worker so that the reservation does not allocate memory
+ * @param[out] ret_array: a pointer to an already initialized array that stores the result
  * @param[out] size: resulting size of ret_array
+ * @param[in] do_sleep: wait for the first element if none is ready
  *
  * This function is in charge of reserving completion elements to the threads 
  * that wants to execute them. The semantinc is the following: the function
  * will try to get at-least one element. 
  *
- * The first element is reserved using a down_interruptible semaphore instruction,
+ * The first element is reserved waiting (interruptible) on ready_wait,
  * i.e. if there is no free element the process get put on wait. 
  * Eventually a completion element will get free'd and then it will get out
  * of this lock state. It that does not occurs, it is sufficient to wake-up the
  * process using and SIGINT signal.
  *
  *
- * @todo Fix the return values
- *
  * @sa ums_compelem_exec
  * @sa reserve_compelem
  *
- * @return 0 if everything is ok, non-zero othewise. 
- * Failures can be due: internal errors, interruptions during wait, 
- *	absense of completion list
+ * @return 0 if everything is ok, -errno othewise. 
+ * Failures can be due: interruptions during wait (-EINTR), absense (or
+ *	concurrent removal) of completion list (-ENOENT), no ready element
+ *	without do_sleep (-EAGAIN)
 */
-int ums_complist_reserve(ums_complist_id comp_id,
+int ums_complist_reserve(struct ums_session *session,
+			 ums_complist_id comp_id,
 			 int to_reserve,
+			 struct list_head *reserve_head,
 			 ums_compelem_id *ret_array,
-			 int *size)
+			 int *size,
+			 int do_sleep)
 {
 	int i;
 	int res;
 	struct ums_complist *complist;
 	struct ums_compelem *compelem_0;
-	struct id_rwlock *lock;
-	struct list_head *reserve_list;
+	struct id_ref *ref;
 
 	res = 0;
 	*size = 0;
 
-	/* Even if at the moment lock is not necessary for this feature it is 
-	 * better to leave it active */
-	hashrwlock_find(ums_complist_hash, comp_id, &lock);
+	res = complist_get(session, comp_id, &ref);
 
-	if (! lock)
-		return -1;
-
-	if (! lock->data)
-		return -1;
-
-	complist = lock->data;
+	if (res)
+		return res;
 
-	if (! id_read_trylock(lock))
-		return -1;
+	complist = ref->data;
 
 	if (unlikely(__check_memory(complist))) {
-		res = -1;
-		goto complist_reserve_exit;
-	}
-
-	/* reserve list is destroyed in Execute function by the choosen compelem */
-	reserve_list = kmalloc(sizeof(struct list_head), GFP_KERNEL);
-
-	if (unlikely(! reserve_list)) {
-		res = -2;
+		res = -EPERM;
 		goto complist_reserve_exit;
 	}
 
-	INIT_LIST_HEAD(reserve_list);
-
 	if (to_reserve == 0) {
 		res = 0;
 		goto complist_reserve_exit;
 	}
 
-	id_read_unlock(lock);
+	/* the reference keeps the completion list allocated while this
+	 * thread sleeps, the removal of its scheduler sends SIGINT */
+	res = reserve_compelem(complist, &compelem_0, reserve_head, do_sleep);
 
-	/* Leaving this locked generates deadlocks (which are not good :) )*/
-	if (unlikely(reserve_compelem(complist, &compelem_0, reserve_list, 1))) {
-		res = -2;
+	if (unlikely(res))
 		goto complist_reserve_exit;
-	}
 
-	if (unlikely(! id_read_trylock(lock)))
-		return -1;
-
-	if (unlikely(! compelem_0)) {
-		res = -2;
+	if (! compelem_0) {
+		res = -EAGAIN;
 		goto complist_reserve_exit;
 	}
 
@@ -794,10 +1322,8 @@ int ums_complist_reserve(ums_complist_id comp_id,
 		struct ums_compelem *compelem_i = NULL;
 
 		if (unlikely(reserve_compelem(complist, &compelem_i,
-					      reserve_list, 0))) {
-			res = -2;
-			goto complist_reserve_exit;
-		}
+					      reserve_head, 0)))
+			break;
 
 		if (! compelem_i)
 			break;
@@ -807,13 +1333,232 @@ int ums_complist_reserve(ums_complist_id comp_id,
 	*size = i;
 
 complist_reserve_exit:
-	id_read_unlock(lock);
+	id_ref_put(ref);
+	return res;
+}
+
+/**
+ * @brief Reserve the next element of a completion list in kernel dispatch
+ *
+ * @param[in] session: session that owns the completion list
+ * @param[in] comp_id: identifier of the completion list
+ * @param[in] reserve_head: reservation list of the calling worker
+ * @param[out] id: reserved element
+ *
+ * If the list has UMS_POLICY_F_KERNEL_DISPATCH, its policy picks the next
+ * ready element without sleeping, as the first element of
+ * ums_complist_reserve.
+ *
+ * @sa ums_sched_yield
+ *
+ * @return 0 if an element was reserved, -EAGAIN if the list is not in
+ *	kernel dispatch mode or no element is ready, -ENOENT if the list does
+ *	not exist, -EPERM if current does not share its memory map
+*/
+int ums_complist_dispatch(struct ums_session *session,
+			  ums_complist_id comp_id,
+			  struct list_head *reserve_head,
+			  ums_compelem_id *id)
+{
+	int res;
+	struct ums_complist *complist;
+	struct ums_compelem *compelem = NULL;
+	struct id_ref *ref;
+
+	res = complist_get(session, comp_id, &ref);
+
+	if (res)
+		return res;
+
+	complist = ref->data;
+
+	if (unlikely(__check_memory(complist)))
+		res = -EPERM;
+	else if (! (READ_ONCE(complist->policy_flags) &
+		    UMS_POLICY_F_KERNEL_DISPATCH))
+		res = -EAGAIN;
+	else if (reserve_compelem(complist, &compelem, reserve_head, 0) ||
+		 ! compelem)
+		res = -EAGAIN;
+	else
+		*id = compelem->id;
+
+	id_ref_put(ref);
+	return res;
+}
+
+/**
+ * @brief Create the ready ring of a completion list
+ *
+ * @param[in] session: session that owns the completion list
+ * @param[in, out] args: the completion list and the requested entries,
+ *	filled with the layout of the ring memory
+ *
+ * Once the ring exists the ready elements are published in it (see
+ * __register_compelem), the elements already in the ready queue stay there.
+ *
+ * @sa UMS_REQUEST_READY_RING_SETUP
+ * @sa ums_complist_ready_ring_mmap
+ *
+ * @return 0 if no error occured, -EINVAL if the entries are not valid,
+ *	-ENOENT/-EAGAIN/-EPERM if the completion list cannot be accessed,
+ *	-EBUSY if the ring already exists, -ENOMEM
+*/
+int ums_complist_ready_ring_setup(struct ums_session *session,
+				  struct ums_ready_ring_args *args)
+{
+	struct ums_complist *complist;
+	struct ums_ready_ring *ring;
+	struct id_ref *ref;
+	size_t ids_off;
+	u32 entries;
+	int res = 0;
+
+	if (! args->entries || args->entries > UMS_READY_RING_MAX_ENTRIES)
+		return -EINVAL;
+
+	entries = roundup_pow_of_two(args->entries);
+	ids_off = ALIGN(sizeof(struct ums_ready_ring_hdr), SMP_CACHE_BYTES);
+
+	ring = kzalloc(sizeof(struct ums_ready_ring), GFP_KERNEL);
+
+	if (unlikely(! ring))
+		return -ENOMEM;
+
+	ring->size = PAGE_ALIGN(ids_off + entries * sizeof(__s32));
+	ring->mem = vmalloc_user(ring->size);
+
+	if (unlikely(! ring->mem)) {
+		kfree(ring);
+		return -ENOMEM;
+	}
+
+	ring->hdr = ring->mem;
+	ring->ids = ring->mem + ids_off;
+	ring->entries = entries;
+	ring->hdr->mask = entries - 1;
+	ring->hdr->entries = entries;
+
+	res = complist_get(session, args->complist_id, &ref);
+
+	if (res)
+		goto ready_ring_setup_fail;
+
+	complist = ref->data;
+
+	if (__check_memory(complist))
+		res = -EPERM;
+	else if (cmpxchg(&complist->ready_ring, NULL, ring))
+		res = -EBUSY;
+
+	id_ref_put(ref);
+
+	if (res)
+		goto ready_ring_setup_fail;
+
+	args->entries = entries;
+	args->ids_off = ids_off;
+	args->ring_size = ring->size;
+
+	return 0;
+
+ready_ring_setup_fail:
+	ready_ring_free(ring);
+	return res;
+}
+
+/**
+ * @brief Map the ready ring of a completion list in user space
+ *
+ * @param[in] session: session that owns the completion list
+ * @param[in] comp_id: completion list identifier
+ * @param[in] vma: user mapping (at most the ring size)
+ *
+ * @return 0 if no error occured, -errno otherwise
+ *
+ * @sa UMS_MMAP_READY_RING
+*/
+int ums_complist_ready_ring_mmap(struct ums_session *session,
+				 ums_complist_id comp_id,
+				 struct vm_area_struct *vma)
+{
+	struct ums_complist *complist;
+	struct ums_ready_ring *ring;
+	struct id_ref *ref;
+	int res;
+
+	res = complist_get(session, comp_id, &ref);
+
+	if (res)
+		return res;
+
+	complist = ref->data;
+	ring = READ_ONCE(complist->ready_ring);
+
+	if (__check_memory(complist))
+		res = -EPERM;
+	else if (! ring)
+		res = -ENODEV;
+	else if (vma->vm_end - vma->vm_start > ring->size)
+		res = -EINVAL;
+	else
+		res = remap_vmalloc_range(vma, ring->mem, 0);
+
+	id_ref_put(ref);
+
 	return res;
 }
 
+/**
+ * @brief Detach a running completion element parked in user space
+ *
+ * @param session: session that owns the completion element
+ * @param compelem_id: completion element identifier
+ *
+ * Like ums_compelem_store_reg, but the registers are not stored (user space
+ * owns them) and the element is not registered as ready. The element stays
+ * parked until the module resumes it again (see ums_compelem_exec).
+ *
+ * @note This function must be called by the worker that did execute the compelem.
+ *
+ * @sa UMS_EXEC_F_PARKED
+ *
+ * @return 0 if everything is OK, -ENOENT if the element does not exist
+ *	anymore (it was removed while parked), -EFAULT if current does not
+ *	run it
+*/
+int ums_compelem_park(struct ums_session *session,
+		      ums_compelem_id compelem_id)
+{
+	struct ums_compelem *compelem;
+	struct id_ref *ref;
+
+	if (compelem_get(session, compelem_id, &ref))
+		return -ENOENT;
+
+	compelem = ref->data;
+
+	if (unlikely(__check_pid(compelem))) {
+		id_ref_put(ref);
+		return -EFAULT;
+	}
+
+	trace_ums_park(compelem->complist->id, compelem->id,
+		       compelem->host_id);
+
+	compelem->parked = 1;
+	compelem->pid = -1;
+	compelem->total_time += ktime_get_ns() - compelem->switch_time;
+	compelem->host_id = COMPELEM_NO_HOST;
+
+	id_ref_put(ref);
+	return 0;
+}
+
 /***
  * @brief Update the context of the compelem
  *
+ * @param session: session that owns the completion element
  * @param compelem_id: completion element identifier
  *
  * This procedure set the context using current, mark compelem as free and
@@ -824,33 +1569,47 @@ complist_reserve_exit:
  * @return 0 if everything is OK, -EFAULT if the completion 
  * element does not exist
 */
-int ums_compelem_store_reg(ums_compelem_id compelem_id)
+int ums_compelem_store_reg(struct ums_session *session,
+			   ums_compelem_id compelem_id)
 {
-	struct ums_compelem *compelem = NULL;
-
-	__get_from_compelem_id(compelem_id, &compelem);
+	struct ums_compelem *compelem;
+	struct id_ref *ref;
 
-	if (! compelem)
+	if (compelem_get(session, compelem_id, &ref))
 		return -EFAULT;
 
-	if (unlikely(__check_pid(compelem)))
+	compelem = ref->data;
+
+	if (unlikely(__check_pid(compelem))) {
+		id_ref_put(ref);
 		return -EFAULT;
+	}
+
+	trace_ums_store_reg(compelem->complist->id, compelem->id,
+			    compelem->host_id);
 
 	get_ums_context(current, &compelem->entry_ctx);
 
-	__register_compelem(compelem->complist, compelem);
+	check_deadline(compelem, ktime_get_ns());
+
+	compelem->parked = 0;
+
+	__register_compelem(compelem->complist, compelem, 1);
 
 	compelem->total_time += ktime_get_ns() - compelem->switch_time;
 	compelem->host_id = COMPELEM_NO_HOST;
 
+	id_ref_put(ref);
 	return 0;
 }
 
 /**
  * @brief Execute a reserved completion element
  *
+ * @param[in] session: session that owns the completion element
  * @param[in] compelem_id: completion element identifier
  * @param[in] host_id: scheduler executer id
+ * @param[in] flags: UMS_EXEC_F_* flags
  *
  * This function executes a completion list. It sets host_id and perform the
  * context switch. This function returns an error if the caller is not the
@@ -858,32 +1617,53 @@ int ums_compelem_store_reg(ums_compelem_id compelem_id)
  * if the completion list does not exist. This function also frees the other
  * elements of the reservation list.
  *
+ * With UMS_EXEC_F_CLAIMED the element must have been claimed from the ready
+ * ring instead: the reservation is replaced by the ring_ready flag, which
+ * only one caller can clear.
+ *
  * @sa ums_compelem_store_reg
  * @sa ums_complist_reserve
- * @return 0 if no error, otherwise non-zero
+ * @return 0 if no error, -EFAULT if the element cannot be run by current,
+ *	-EAGAIN if a claimed element is not published in the ready ring
 */
-int ums_compelem_exec(ums_compelem_id compelem_id,
-		      ums_sched_id host_id)
+int ums_compelem_exec(struct ums_session *session,
+		      ums_compelem_id compelem_id,
+		      ums_sched_id host_id,
+		      unsigned int flags)
 {
 	struct list_head *list_iter, *temp_head;
 
-	struct ums_compelem *compelem = NULL;
-	struct ums_complist *complist = NULL;
-
-	__get_from_compelem_id(compelem_id, &compelem);
+	struct ums_compelem *compelem;
+	struct id_ref *ref;
+	int res = 0;
 
-	if (! compelem) {
+	if (compelem_get(session, compelem_id, &ref))
 		return -EFAULT;
+
+	compelem = ref->data;
+
+	if (flags & UMS_EXEC_F_CLAIMED) {
+		if (__check_memory(compelem->complist)) {
+			res = -EFAULT;
+			goto compelem_exec_exit;
+		}
+
+		if (! xchg(&compelem->ring_ready, 0)) {
+			res = -EAGAIN;
+			goto compelem_exec_exit;
+		}
+
+		compelem->pid = current->pid;
+
+		goto compelem_exec_switch;
 	}
 
 	/* Here __check_pid is used to ensure that the caller already reserved
-	 * this compelem */
-	if (__check_pid(compelem))
-		return -EFAULT;
-
-	/* completion element must be reserved */
-	if (! compelem->reserve_head)
-		return -EFAULT;
+	 * this compelem, which must be reserved */
+	if (__check_pid(compelem) || ! compelem->reserve_head) {
+		res = -EFAULT;
+		goto compelem_exec_exit;
+	}
 
 	/* release the other reserved compelems */
 	/* By construction this function can be accessed only by one at the 
@@ -896,50 +1676,192 @@ int ums_compelem_exec(ums_compelem_id compelem_id,
 
 		if (to_release != compelem) {
 			__set_released(to_release);
-			__register_compelem(complist, to_release);
+			__register_compelem(to_release->complist, to_release,
+					    0);
 		}
 
 	}	
 
-	/* remove the reservation list */
-	kfree(compelem->reserve_head);
+	/* the reservation list is owned by the reserving worker, just leave
+	 * it empty */
+	list_del(&compelem->reserve_list);
 	compelem->reserve_head = NULL;
 
+compelem_exec_switch:
 	put_ums_context(current, &compelem->entry_ctx);
 
+	/* the module owns the element again */
+	compelem->parked = 0;
+
 	/* update proc stats data */
 	compelem->n_switch++;
 	compelem->host_id = host_id;
 	compelem->switch_time = ktime_get_ns();
 
-	return 0;
-}
+	track_cpu(compelem);
+
+	check_deadline(compelem, compelem->switch_time);
 
+compelem_exec_exit:
+	id_ref_put(ref);
+	return res;
+}
 
 
 /**
- * @brief Initialize ums_complist structure
- * 
- * Initialize lists, spin locks, semaphore and the proc directory entry.
+ * @brief Switch directly from the running compelem to a ready one
  *
- * @return 0 if everything is OK, otherwise an error code
+ * @param[in] session: session that owns the completion elements
+ * @param[in] from_id: completion element currently executed by current
+ * @param[in] to_id: ready completion element of the same completion list
+ * @param[in] host_id: scheduler executer id
+ *
+ * This function stores the context of from_id, takes to_id out of its
+ * ready queue and puts its context, all in a single step. from_id takes the
+ * place of to_id in the ready queue (see ums_policy_ops.swap), so the number of
+ * ready elements does not change and no reserver is woken up.
+ *
+ * @sa ums_compelem_store_reg
+ * @sa ums_compelem_exec
+ * @return 0 if no error, -EFAULT if from_id is not executed by current or
+ *	if the elements do not exist, -EAGAIN if to_id is not ready
 */
-static int new_complist(ums_complist_id comp_id,
-			struct ums_complist *complist)
+int ums_compelem_switch(struct ums_session *session,
+			ums_compelem_id from_id,
+			ums_compelem_id to_id,
+			ums_sched_id host_id)
 {
-	int res;
+	struct ums_compelem *from, *to;
+	struct id_ref *from_ref, *to_ref;
+	struct ums_complist *complist;
+	int res = 0;
+	u64 now;
 
-	complist->id = comp_id;
+	if (from_id == to_id || compelem_get(session, from_id, &from_ref))
+		return -EFAULT;
+
+	if (compelem_get(session, to_id, &to_ref)) {
+		id_ref_put(from_ref);
+		return -EFAULT;
+	}
+
+	from = from_ref->data;
+	to = to_ref->data;
+	complist = from->complist;
+
+	if (__check_pid(from) || to->complist != complist) {
+		res = -EFAULT;
+		goto compelem_switch_exit;
+	}
+
+	if (! __is_ready(to)) {
+		res = -EAGAIN;
+		goto compelem_switch_exit;
+	}
+
+	get_ums_context(current, &from->entry_ctx);
+
+	now = ktime_get_ns();
+
+	check_deadline(from, now);
+
+	if (READ_ONCE(complist->ops)->swap(complist, from, to)) {
+		res = -EAGAIN;
+		goto compelem_switch_exit;
+	}
+
+	from->total_time += now - from->switch_time;
+	from->host_id = COMPELEM_NO_HOST;
+
+	to->pid = current->pid;
+
+	put_ums_context(current, &to->entry_ctx);
+
+	to->parked = 0;
+	to->n_switch++;
+	to->host_id = host_id;
+	to->switch_time = now;
+
+	track_cpu(to);
+
+	check_deadline(to, now);
+
+compelem_switch_exit:
+	id_ref_put(to_ref);
+	id_ref_put(from_ref);
+	return res;
+}
+
+
+/**
+ * @brief Initialize ums_complist structure
+ * 
+ * Initialize lists, spin locks, ready shards, the proc directory entry and
+ * its info file.
+ *
+ * @return 0 if everything is OK, -ENOMEM if the shards or their masks
+ *	cannot be allocated
+*/
+static int new_complist(struct ums_session *session,
+			ums_complist_id comp_id,
+			struct ums_complist *complist)
+{
+	int res;
+	int cpu, prio;
+
+	complist->id = comp_id;
 	complist->mm = current->mm;
+	complist->session = session;
 
 
-	res = kfifo_alloc(&complist->ready_queue, PAGE_SIZE, GFP_KERNEL);
+	res = 0;
 
-	if (res) {
-		goto new_complist_exit;
+	complist->shards = alloc_percpu(struct ums_ready_shard);
+
+	if (unlikely(! complist->shards))
+		return -ENOMEM;
+
+	for_each_possible_cpu(cpu) {
+		struct ums_ready_shard *shard;
+
+		shard = per_cpu_ptr(complist->shards, cpu);
+		spin_lock_init(&shard->lock);
+		shard->nr_ready = 0;
+		shard->cpu = cpu;
+
+		for (prio = 0; prio < UMS_PRIO_LEVELS; prio++)
+			INIT_LIST_HEAD(&shard->queue[prio]);
+	}
+
+	for (prio = 0; prio < UMS_PRIO_LEVELS; prio++) {
+		if (unlikely(! zalloc_cpumask_var(&complist->ready_cpus[prio],
+						  GFP_KERNEL))) {
+			while (prio--)
+				free_cpumask_var(complist->ready_cpus[prio]);
+			free_percpu(complist->shards);
+			return -ENOMEM;
+		}
 	}
 
-	sema_init(&complist->elem_sem, 0);
+	complist->ops = &ums_policies[UMS_POLICY_FIFO];
+	complist->policy_flags = 0;
+	atomic_set(&complist->rr_cursor, 0);
+	complist->edf_root = RB_ROOT_CACHED;
+	spin_lock_init(&complist->edf_lock);
+	complist->edf_nr = 0;
+	atomic64_set(&complist->deadline_misses, 0);
+
+	init_waitqueue_head(&complist->ready_wait);
+	init_waitqueue_head(&complist->drain_wait);
+	complist->spin_ns = UMS_IDLE_SPIN_DEFAULT_NS;
+	atomic64_set(&complist->last_arrival, 0);
+	complist->arrival_gap = 0;
+	atomic64_set(&complist->spin_hits, 0);
+	atomic64_set(&complist->spin_misses, 0);
+	complist->time_slice = 0;
+	complist->ready_ring = NULL;
+	complist->nr_waiters = 0;
+	complist->dead = 0;
 
 	INIT_LIST_HEAD(&complist->compelems);
 	INIT_LIST_HEAD(&complist->schedulers);
@@ -948,72 +1870,255 @@ static int new_complist(ums_complist_id comp_id,
 	spin_lock_init(&complist->schedulers_lock);
 	spin_lock_init(&complist->compelems_lock);
 	/* init proc directory */
-	ums_proc_geniddir(complist->id, ums_complist_dir, &complist->proc_dir);
+	ums_proc_geniddir(complist->id, session->complist_dir,
+			  &complist->proc_dir);
+
+	complist->proc_info_file = proc_create_data(COMPLIST_INFO_FILE,
+						    COMPELEM_FILE_MODE,
+						    complist->proc_dir,
+						    &ums_complist_proc_ops,
+						    complist);
 
-new_complist_exit:
 	return res;
 }
 
 /**
  * @brief Delete the completion list data
  * 
- * Initialize lists, spin locks, semaphore and the proc directory entry.
+ * Mark the completion list dead, remove its schedulers and the proc
+ * directory entry. The memory is released by free_complist.
  *
- * @note This function assumes that it is running in isolation and that no
- *	completion element is present in the list.
+ * @note This function assumes that only one thread removes the completion
+ *	list (see id_ref_kill) and that no completion element is present in
+ *	the list. The users that still hold a reference can run concurrently.
  * @return 0 if everything is OK, otherwise an error code
 */
 static int deinit_complist(struct ums_complist *complist)
 {
 	struct list_head *iter, *safeiter;
+	LIST_HEAD(schedulers);
 
-	kfifo_free(&complist->ready_queue);
+	/* no new element nor scheduler can be added after this */
+	spin_lock(&complist->compelems_lock);
+	complist->dead = 1;
+	spin_unlock(&complist->compelems_lock);
 
-	/* isolation is granted by already in use write_lock */
-	list_for_each_safe(iter, safeiter, &complist->schedulers) {
+	spin_lock(&complist->schedulers_lock);
+	list_splice_init(&complist->schedulers, &schedulers);
+	spin_unlock(&complist->schedulers_lock);
+
+	list_for_each_safe(iter, safeiter, &schedulers) {
 		struct id_entry *sched_entry;
 
 		sched_entry = list_entry(iter, struct id_entry, list);
 
 		if (likely(sched_entry)) {
-			ums_sched_remove(sched_entry->id);
+			ums_sched_remove(complist->session, sched_entry->id);
 			kfree(sched_entry);
 		}
 	}
 
 	ums_proc_delete(complist->proc_dir);
 
+	/* the pollers see EPOLLHUP (see complist_fd_poll) */
+	wake_up_all(&complist->ready_wait);
+	wake_up_all(&complist->drain_wait);
+
 	return 0;
 }
 
+/**
+ * @brief Free a completion list torn down by deinit_complist
+ *
+ * @param[in] data: the ums_complist
+ *
+ * Called by the last id_ref_put, nobody can reach the completion list
+ * anymore through its id.
+*/
+static void free_complist(void *data)
+{
+	struct ums_complist *complist = data;
+	int prio;
+
+	ready_ring_free(complist->ready_ring);
+
+	for (prio = 0; prio < UMS_PRIO_LEVELS; prio++)
+		free_cpumask_var(complist->ready_cpus[prio]);
+
+	free_percpu(complist->shards);
+	kfree(complist);
+}
+
+/**
+ * @brief Tear down a completion element that is not registered anymore
+ *
+ * @param[in] compelem: completion element, already killed (see
+ *	id_ref_kill)
+ *
+ * Remove the proc file and wake up the thread of the element, blocked in
+ * ums_compelem_add. The memory is released by free_compelem.
+*/
+static void deinit_compelem(struct ums_compelem *compelem)
+{
+	ums_proc_delete(compelem->proc_file);
+
+	wake_up_process(compelem->elem_task);
+}
+
+/**
+ * @brief Take a removed completion element out of the ready structures
+ *
+ * @param[in] compelem: completion element, already killed (see
+ *	id_ref_kill)
+ *
+ * The element leaves its ready shard and the EDF tree under their locks,
+ * so no reserver can pick it anymore. Its id might stay in the ready ring:
+ * the claimers skip it (see ready_ring_claim).
+*/
+static void compelem_unready(struct ums_compelem *compelem)
+{
+	struct ums_complist *complist = compelem->complist;
+	struct ums_ready_shard *shard;
+
+	xchg(&compelem->ring_ready, 0);
+
+	shard = READ_ONCE(compelem->shard);
+
+	if (shard) {
+		spin_lock(&shard->lock);
+
+		/* a reserver might have popped it in the meantime */
+		if (compelem->shard == shard) {
+			list_del_init(&compelem->ready_node);
+			compelem->shard = NULL;
+			shard_dequeued(complist, shard, compelem->ready_prio);
+		}
+
+		spin_unlock(&shard->lock);
+	}
+
+	spin_lock(&complist->edf_lock);
+
+	if (! RB_EMPTY_NODE(&compelem->edf_node)) {
+		rb_erase_cached(&compelem->edf_node, &complist->edf_root);
+		RB_CLEAR_NODE(&compelem->edf_node);
+		WRITE_ONCE(complist->edf_nr, complist->edf_nr - 1);
+	}
+
+	spin_unlock(&complist->edf_lock);
+}
+
+/**
+ * @brief Free a completion element torn down by deinit_compelem
+ *
+ * @param[in] data: the ums_compelem
+ *
+ * Called by the last id_ref_put, it also drops the reference of the
+ * completion list of the element.
+*/
+static void free_compelem(void *data)
+{
+	struct ums_compelem *compelem = data;
+
+	free_ums_context(&compelem->entry_ctx);
+	id_ref_put(compelem->complist_ref);
+	kfree(compelem);
+}
+
 /**
  * @brief Initialize ums_compelem data structure
  *
  * @param[in] elem_id: new identifier for the compelem
- * @param[in] complist: completion list that owns the new element
+ * @param[in] complist_ref: reference of the completion list that owns the
+ *	new element, the element takes its own
+ * @param[in] prio: priority of the new element (UMS_PRIO_*)
+ * @param[in] deadline: absolute deadline of the new element, 0 if none
  * @param[out] comp_elem: completion element initialized
  *
- * @return 0 if no error occurs, and error code otherwise
+ * The element is published in the registry with its id_ref, freed by
+ * free_compelem.
+ *
+ * @return 0 if no error occurs, -ENOENT if the completion list is being
+ *	removed, -ENOMEM if the id_ref or the FPU area cannot be allocated or
+ *	the element cannot be added to the registry (in all cases nothing is
+ *	initialized and elem_id is released)
 */
 static int new_compelement(ums_compelem_id elem_id,
-			   struct ums_complist *complist,
+			   struct id_ref *complist_ref,
+			   int prio,
+			   u64 deadline,
 			   struct ums_compelem *comp_elem)
 {
+	struct ums_complist *complist = complist_ref->data;
+	struct id_ref *ref;
+
+	ref = kmalloc(sizeof(struct id_ref), GFP_KERNEL);
+
+	if (unlikely(! ref)) {
+		id_registry_release(&complist->session->compelems, elem_id);
+		return -ENOMEM;
+	}
+
 	comp_elem->id = elem_id;
 	comp_elem->elem_task = current;
 	comp_elem->complist = complist;
+	comp_elem->complist_ref = complist_ref;
+	comp_elem->pid = -1;
 	comp_elem->host_id = COMPELEM_NO_HOST;
 	comp_elem->reserve_head = NULL;
-
-	/* TODO: check this add instructions!!! */
-	hash_add(ums_compelem_hash, &comp_elem->list, comp_elem->id);
-	list_add(&comp_elem->complist_head, &complist->compelems);
-
-	gen_ums_context(current, &comp_elem->entry_ctx);
-	
+	comp_elem->ring_ready = 0;
+	comp_elem->parked = 0;
+	INIT_LIST_HEAD(&comp_elem->ready_node);
+	comp_elem->shard = NULL;
+	comp_elem->prio = prio;
+	comp_elem->ready_prio = prio;
+	comp_elem->deadline = deadline;
+	comp_elem->deadline_missed = 0;
+	RB_CLEAR_NODE(&comp_elem->edf_node);
 	comp_elem->n_switch = 0;
+	comp_elem->last_cpu = -1;
+	comp_elem->n_migrations = 0;
 	comp_elem->switch_time = 0;
 	comp_elem->total_time = 0;
+
+	if (unlikely(alloc_ums_context(&comp_elem->entry_ctx))) {
+		kfree(ref);
+		id_registry_release(&complist->session->compelems, elem_id);
+		return -ENOMEM;
+	}
+
+	gen_ums_context(current, &comp_elem->entry_ctx);
+
+	/* serialized with deinit_complist */
+	spin_lock(&complist->compelems_lock);
+
+	if (unlikely(complist->dead)) {
+		spin_unlock(&complist->compelems_lock);
+		free_ums_context(&comp_elem->entry_ctx);
+		kfree(ref);
+		id_registry_release(&complist->session->compelems, elem_id);
+		return -ENOENT;
+	}
+
+	list_add(&comp_elem->complist_head, &complist->compelems);
+	spin_unlock(&complist->compelems_lock);
+
+	/* dropped by free_compelem */
+	id_ref_get(complist_ref);
+	id_ref_init(elem_id, comp_elem, ref, free_compelem);
+
+	/* the slot is reserved, the store fails only if the node is gone */
+	if (unlikely(id_registry_add(&complist->session->compelems, ref))) {
+		spin_lock(&complist->compelems_lock);
+		list_del(&comp_elem->complist_head);
+		spin_unlock(&complist->compelems_lock);
+		id_ref_put(complist_ref);
+		free_ums_context(&comp_elem->entry_ctx);
+		kfree(ref);
+		id_registry_release(&complist->session->compelems, elem_id);
+		return -ENOMEM;
+	}
+
 	/* procfs initialization */
 	ums_proc_genidfile(comp_elem->id, complist->proc_dir, 
 			   &ums_compelem_proc_ops, comp_elem, 
@@ -1032,6 +2137,9 @@ static int new_compelement(ums_compelem_id elem_id,
  * - actual state of the completion element: running/idle
  * - actual total active time of the completion element (in nanoseconds)
  * - scheduler that is executing the completion element
+ * - priority of the completion element (UMS_PRIO_*)
+ * - absolute deadline of the completion element (0 if none)
+ * - CPU where the element last ran and number of migrations
  *
  *   
  * @return length copied to user, -EFAULT if an error occured
@@ -1065,6 +2173,29 @@ static ssize_t compelem_proc_read(struct file *file,
 
 	len += sprintf(buf + len, "runner=%d\n", compelem->host_id);
 
+	if (len > count || len < 0)
+		return -EFAULT;
+
+	len += sprintf(buf + len, "priority=%d\n", READ_ONCE(compelem->prio));
+
+	if (len > count || len < 0)
+		return -EFAULT;
+
+	len += sprintf(buf + len, "deadline=%llu\n",
+		       READ_ONCE(compelem->deadline));
+
+	if (len > count || len < 0)
+		return -EFAULT;
+
+	len += sprintf(buf + len, "last_cpu=%d\n",
+		       READ_ONCE(compelem->last_cpu));
+
+	if (len > count || len < 0)
+		return -EFAULT;
+
+	len += sprintf(buf + len, "migrations=%u\n",
+		       READ_ONCE(compelem->n_migrations));
+
 	if (len > count || len < 0)
 		return -EFAULT;
 
@@ -1076,37 +2207,893 @@ static ssize_t compelem_proc_read(struct file *file,
         return len;
 }
 
+/**
+ * @brief proc_ops completion list info read function
+ *
+ * The information passed to the user are:
+ * - policy of the completion list
+ * - number of ready elements that are not reserved yet
+ * - number of deadlines missed by its elements
+ * - number of dispatches and migrations of its current elements, summed
+ *   here so that the dispatch path does not share any counter
+ *
+ * @return length copied to user, -EFAULT if an error occured
+*/
+static ssize_t complist_proc_read(struct file *file,
+				  char __user *ubuf,
+				  size_t count,
+				  loff_t *ppos)
+{
+	struct ums_complist *complist;
+	struct ums_compelem *compelem;
+	u64 dispatches = 0, migrations = 0;
+	char buf[512];
+	int len = 0;
+
+	if (*ppos > 0)
+		return 0;
+
+	complist = PDE_DATA(file_inode(file));
+
+	if (! complist)
+		return -EFAULT;
+
+	spin_lock(&complist->compelems_lock);
+
+	list_for_each_entry(compelem, &complist->compelems, complist_head) {
+		dispatches += READ_ONCE(compelem->n_switch);
+		migrations += READ_ONCE(compelem->n_migrations);
+	}
+
+	spin_unlock(&complist->compelems_lock);
+
+	len += sprintf(buf, "policy=%s\n", READ_ONCE(complist->ops)->name);
+
+	if (len > count || len < 0)
+		return -EFAULT;
+
+	len += sprintf(buf + len, "kernel_dispatch=%d\n",
+		       !! (READ_ONCE(complist->policy_flags) &
+			   UMS_POLICY_F_KERNEL_DISPATCH));
+
+	if (len > count || len < 0)
+		return -EFAULT;
+
+	len += sprintf(buf + len, "ready=%d\n", complist_nr_ready(complist));
+
+	if (len > count || len < 0)
+		return -EFAULT;
+
+	len += sprintf(buf + len, "deadline_misses=%lld\n",
+		       atomic64_read(&complist->deadline_misses));
+
+	if (len > count || len < 0)
+		return -EFAULT;
+
+	len += sprintf(buf + len, "dispatches=%llu\n", dispatches);
+
+	if (len > count || len < 0)
+		return -EFAULT;
+
+	len += sprintf(buf + len, "migrations=%llu\n", migrations);
+
+	if (len > count || len < 0)
+		return -EFAULT;
+
+	len += sprintf(buf + len, "spin_ns=%llu\n",
+		       READ_ONCE(complist->spin_ns));
+
+	if (len > count || len < 0)
+		return -EFAULT;
+
+	len += sprintf(buf + len, "arrival_gap_ns=%llu\n",
+		       READ_ONCE(complist->arrival_gap));
+
+	if (len > count || len < 0)
+		return -EFAULT;
+
+	len += sprintf(buf + len, "spin_hits=%lld\n",
+		       atomic64_read(&complist->spin_hits));
+
+	if (len > count || len < 0)
+		return -EFAULT;
+
+	len += sprintf(buf + len, "spin_misses=%lld\n",
+		       atomic64_read(&complist->spin_misses));
+
+	if (len > count || len < 0)
+		return -EFAULT;
+
+	len += sprintf(buf + len, "time_slice_ns=%llu\n",
+		       READ_ONCE(complist->time_slice));
+
+	if (len > count || len < 0)
+		return -EFAULT;
+
+	if (copy_to_user(ubuf, buf, len))
+		return -EFAULT;
+
+	*ppos = len;
+
+	return len;
+}
+
 /**
  * @brief Try to reserve an ums_compelem from a ums_complist in a reserve list
  *
  * @param[in] complist: completion list that will retrieve the compelem
  * @param[out] compelem: ref to the compelem that will be returned to 
+ *
+ * If the completion list has a ready ring the function claims from the
+ * ring first, unless there are ready elements of UMS_PRIO_HIGH (they never
+ * go to the ring). A sleeping caller is counted in nr_waiters under the
+ * ready_lock, so that from that point on new ready elements go to the
+ * ready shards and wake it up.
+ *
+ * Otherwise the policy of the list picks the element (see
+ * ums_policy_ops.pick_next). If it finds none and do_sleep is set, the
+ * caller spins for a while (see idle_spin) and then sleeps on ready_wait,
+ * picking again at each wake up.
+ *
+ * @return 0 if no error occurs (compelem is NULL if there is no ready
+ *	element and do_sleep is not set), -EINTR if a signal arrived
 */
 static int reserve_compelem(struct ums_complist *complist,
 			    struct ums_compelem **compelem,
 			    struct list_head *reserve_head,
 			    int do_sleep)
 {
+	const struct ums_policy_ops *ops = READ_ONCE(complist->ops);
+	struct ums_ready_ring *ring = READ_ONCE(complist->ready_ring);
+	int waiting = 0, wait_res = 0;
+
 	*compelem = NULL;
 
-	if (do_sleep) {
-		int down_res = down_interruptible(&complist->elem_sem);
+	if (ring) {
+		spin_lock(&complist->ready_lock);
 
+		if (cpumask_empty(complist->ready_cpus[UMS_PRIO_HIGH]))
+			*compelem = ready_ring_claim(complist->session, ring);
 
-		if (down_res)
-			return down_res;
-	}	
-	else {
-		if (down_trylock(&complist->elem_sem))
+		if (! *compelem && do_sleep) {
+			complist->nr_waiters++;
+			waiting = 1;
+		}
+
+		spin_unlock(&complist->ready_lock);
+
+		if (*compelem) {
+			__set_reserved(*compelem, reserve_head);
 			return 0;
+		}
 	}
 
-	if (! kfifo_out_spinlocked(&complist->ready_queue, compelem, 
-				   sizeof(struct ums_compelem*),
-				   &complist->ready_lock))
-		return -EFAULT;
+	*compelem = ops->pick_next(complist);
+
+	if (! *compelem && do_sleep) {
+		*compelem = idle_spin(complist);
+
+		/* exclusive: each new element wakes up one reserver */
+		if (! *compelem)
+			wait_res = wait_event_interruptible_exclusive(
+				complist->ready_wait,
+				(*compelem = ops->pick_next(complist)) != NULL);
+	}
+
+	if (waiting) {
+		spin_lock(&complist->ready_lock);
+		complist->nr_waiters--;
+		spin_unlock(&complist->ready_lock);
+	}
+
+	if (wait_res)
+		return -EINTR;
+
+	if (*compelem)
+		__set_reserved(*compelem, reserve_head);
+
+	return 0;
+}
+
+/**
+ * @brief Publish a ready element in the ready ring
+ *
+ * @param[in] ring: ready ring of the completion list
+ * @param[in] compelem: ready completion element
+ *
+ * @note The caller must hold the ready_lock of the completion list
+ *
+ * @return 0 if the element was published, -ENOSPC if the ring is full
+*/
+static int ready_ring_publish(struct ums_ready_ring *ring,
+			      struct ums_compelem *compelem)
+{
+	u32 head = READ_ONCE(ring->hdr->head);
+
+	/* a corrupted head (ahead of tail) is treated as a full ring */
+	if (ring->tail - head >= ring->entries)
+		return -ENOSPC;
+
+	WRITE_ONCE(compelem->ring_ready, 1);
+	WRITE_ONCE(ring->ids[ring->tail & (ring->entries - 1)], compelem->id);
+
+	ring->tail++;
+
+	/* publish the id before the tail */
+	smp_store_release(&ring->hdr->tail, ring->tail);
+
+	return 0;
+}
+
+/**
+ * @brief Claim the first element of the ready ring from the kernel
+ *
+ * @param[in] session: session that owns the completion list
+ * @param[in] ring: ready ring of the completion list
+ *
+ * The kernel competes with the user space consumers on hdr->head, exactly
+ * like them. An element that was already executed (UMS_EXEC_F_CLAIMED)
+ * without being claimed is skipped.
+ *
+ * @note The caller must hold the ready_lock of the completion list
+ *
+ * @return the claimed element, NULL if the ring is empty
+*/
+static struct ums_compelem *ready_ring_claim(struct ums_session *session,
+					     struct ums_ready_ring *ring)
+{
+	struct ums_compelem *compelem;
+	struct id_ref *ref;
+	ums_compelem_id id;
+	int claimed;
+	u32 head;
+
+	for (;;) {
+		head = READ_ONCE(ring->hdr->head);
+
+		if (head == ring->tail || ring->tail - head > ring->entries)
+			return NULL;
+
+		id = READ_ONCE(ring->ids[head & (ring->entries - 1)]);
+
+		if (cmpxchg(&ring->hdr->head, head, head + 1) != head)
+			continue;
+
+		if (compelem_get(session, id, &ref))
+			continue;
+
+		compelem = ref->data;
+		claimed = xchg(&compelem->ring_ready, 0);
+
+		/* a claimed element is not removed until it is executed */
+		id_ref_put(ref);
+
+		if (claimed)
+			return compelem;
+	}
+}
+
+/**
+ * @brief Lock two ready shards (possibly the same one)
+ *
+ * The shards are locked in address order.
+ *
+ * @sa ready_shards_unlock
+*/
+static void ready_shards_lock(struct ums_ready_shard *a,
+			      struct ums_ready_shard *b)
+{
+	if (a == b) {
+		spin_lock(&a->lock);
+		return;
+	}
+
+	if (a > b)
+		swap(a, b);
+
+	spin_lock(&a->lock);
+	spin_lock_nested(&b->lock, SINGLE_DEPTH_NESTING);
+}
+
+/**
+ * @brief Unlock two ready shards locked by ready_shards_lock
+*/
+static void ready_shards_unlock(struct ums_ready_shard *a,
+				struct ums_ready_shard *b)
+{
+	spin_unlock(&a->lock);
+
+	if (a != b)
+		spin_unlock(&b->lock);
+}
+
+/**
+ * @brief Pop an element from the ready shards
+ *
+ * @param[in] complist: completion list
+ * @param[in] first_cpu: CPU of the first shard to try
+ *
+ * The levels are tried from the highest priority. In each level only the
+ * shards in its ready_cpus mask are tried, the one of first_cpu first and
+ * then the others are stolen from in CPU order. ums_compelem_switch and
+ * ums_compelem_set_prio might move an element while the shards are scanned:
+ * the scan is repeated at most READY_POP_RETRIES times while some mask is
+ * not empty.
+ *
+ * @note It never sleeps, it is also called as wait condition (see
+ *	reserve_compelem)
+ *
+ * @return the element removed from its shard, NULL if none was found
+*/
+static struct ums_compelem *ready_shards_pop(struct ums_complist *complist,
+					     int first_cpu)
+{
+	struct ums_ready_shard *shard;
+	struct ums_compelem *compelem;
+	int cpu, prio, retry, seen;
+
+	for (retry = 0; retry < READY_POP_RETRIES; retry++) {
+		seen = 0;
+
+		for (prio = 0; prio < UMS_PRIO_LEVELS; prio++) {
+			for_each_cpu_wrap(cpu, complist->ready_cpus[prio],
+					  first_cpu) {
+				shard = per_cpu_ptr(complist->shards, cpu);
+				seen = 1;
+
+				spin_lock(&shard->lock);
+
+				compelem = list_first_entry_or_null(
+						&shard->queue[prio],
+						struct ums_compelem,
+						ready_node);
+				if (compelem) {
+					list_del_init(&compelem->ready_node);
+					compelem->shard = NULL;
+					shard_dequeued(complist, shard, prio);
+				}
+
+				spin_unlock(&shard->lock);
+
+				if (compelem)
+					return compelem;
+			}
+		}
+
+		if (! seen)
+			break;
+
+		cpu_relax();
+	}
+
+	return NULL;
+}
+
+/**
+ * @brief Account an element queued in a level of a ready shard
+ *
+ * @param[in] complist: completion list of the shard
+ * @param[in] shard: locked shard, the element is already in its queue
+ * @param[in] prio: level of the element
+ *
+ * Only the first element of the level writes the shared mask.
+*/
+static void shard_queued(struct ums_complist *complist,
+			 struct ums_ready_shard *shard,
+			 int prio)
+{
+	WRITE_ONCE(shard->nr_ready, shard->nr_ready + 1);
+
+	if (! cpumask_test_cpu(shard->cpu, complist->ready_cpus[prio]))
+		cpumask_set_cpu(shard->cpu, complist->ready_cpus[prio]);
+}
+
+/**
+ * @brief Account an element removed from a level of a ready shard
+ *
+ * @param[in] complist: completion list of the shard
+ * @param[in] shard: locked shard, the element is already out of its queue
+ * @param[in] prio: level of the element
+ *
+ * The last element of the level clears the bit of the shard.
+*/
+static void shard_dequeued(struct ums_complist *complist,
+			   struct ums_ready_shard *shard,
+			   int prio)
+{
+	WRITE_ONCE(shard->nr_ready, shard->nr_ready - 1);
+
+	if (list_empty(&shard->queue[prio]))
+		cpumask_clear_cpu(shard->cpu, complist->ready_cpus[prio]);
+}
+
+/**
+ * @brief Check (without locks) that a completion list has ready elements
+ *
+ * @param[in] complist: completion list
+ *
+ * @return non-zero if a shard or the EDF tree has elements
+*/
+static int complist_has_ready(struct ums_complist *complist)
+{
+	int prio;
+
+	for (prio = 0; prio < UMS_PRIO_LEVELS; prio++) {
+		if (! cpumask_empty(complist->ready_cpus[prio]))
+			return 1;
+	}
+
+	return READ_ONCE(complist->edf_nr) != 0;
+}
+
+/**
+ * @brief Number of ready elements of a completion list (slow path)
+ *
+ * @param[in] complist: completion list
+ *
+ * The counters of all the shards are summed without locks, the result is
+ * only a snapshot.
+ *
+ * @return the number of elements in the shards and in the EDF tree
+*/
+static int complist_nr_ready(struct ums_complist *complist)
+{
+	int cpu, res = READ_ONCE(complist->edf_nr);
+
+	for_each_possible_cpu(cpu)
+		res += READ_ONCE(per_cpu_ptr(complist->shards, cpu)->nr_ready);
+
+	return res;
+}
+
+/**
+ * @brief Queue a ready element in the shard of the CPU it last ran on
+ *
+ * The element that never ran goes to the shard of the current CPU. A
+ * worker pops from its own shard first, so the element tends to run again
+ * where its cache lines are warm.
+ *
+ * @param[in] complist: completion list
+ * @param[in] compelem: ready element
+ * @param[in] head: queue it at the head of its level instead of the tail
+*/
+static void ready_shards_push(struct ums_complist *complist,
+			      struct ums_compelem *compelem,
+			      int head)
+{
+	struct ums_ready_shard *shard;
+	int prio = READ_ONCE(compelem->prio);
+	int cpu = READ_ONCE(compelem->last_cpu);
+
+	/* any shard is correct, the last one keeps the element warm */
+	if (cpu >= 0)
+		shard = per_cpu_ptr(complist->shards, cpu);
+	else
+		shard = raw_cpu_ptr(complist->shards);
+
+	spin_lock(&shard->lock);
+
+	if (head)
+		list_add(&compelem->ready_node, &shard->queue[prio]);
+	else
+		list_add_tail(&compelem->ready_node, &shard->queue[prio]);
+
+	compelem->shard = shard;
+	compelem->ready_prio = prio;
+	shard_queued(complist, shard, prio);
+	spin_unlock(&shard->lock);
+}
+
+/**
+ * @brief ums_policy_ops.enqueue of UMS_POLICY_FIFO and UMS_POLICY_RR
+*/
+static void shards_enqueue_tail(struct ums_complist *complist,
+				struct ums_compelem *compelem)
+{
+	ready_shards_push(complist, compelem, 0);
+}
+
+/**
+ * @brief ums_policy_ops.enqueue of UMS_POLICY_LIFO
+*/
+static void shards_enqueue_head(struct ums_complist *complist,
+				struct ums_compelem *compelem)
+{
+	ready_shards_push(complist, compelem, 1);
+}
+
+/**
+ * @brief ums_policy_ops.pick_next of the policies that prefer the shard of
+ * the current CPU
+*/
+static struct ums_compelem *shards_pick_local(struct ums_complist *complist)
+{
+	return ready_shards_pop(complist, raw_smp_processor_id());
+}
+
+/**
+ * @brief ums_policy_ops.pick_next of UMS_POLICY_RR
+ *
+ * Every pick starts from the shard after the one of the previous pick.
+*/
+static struct ums_compelem *shards_pick_rr(struct ums_complist *complist)
+{
+	unsigned int first;
+
+	first = (unsigned int)atomic_inc_return(&complist->rr_cursor) %
+		nr_cpu_ids;
+
+	return ready_shards_pop(complist, first);
+}
+
+/**
+ * @brief ums_policy_ops.swap of the policies based on the ready shards
+ *
+ * @param[in] complist: completion list of both the elements
+ * @param[in] from: running element, it becomes ready
+ * @param[in] to: ready element, it is taken out of its shard
+ *
+ * from goes to the tail of its level in the shard of the current CPU, under
+ * the same locks that remove to.
+ *
+ * @return 0 if everything is OK, -EAGAIN if to is not ready anymore
+*/
+static int shards_swap(struct ums_complist *complist,
+		       struct ums_compelem *from,
+		       struct ums_compelem *to)
+{
+	struct ums_ready_shard *to_shard, *local;
+	int from_prio;
+
+	to_shard = READ_ONCE(to->shard);
+
+	if (! to_shard)
+		return -EAGAIN;
+
+	local = raw_cpu_ptr(complist->shards);
+	from_prio = READ_ONCE(from->prio);
+
+	ready_shards_lock(to_shard, local);
+
+	if (to->shard != to_shard) {
+		ready_shards_unlock(to_shard, local);
+		return -EAGAIN;
+	}
+
+	list_del_init(&to->ready_node);
+	to->shard = NULL;
+	shard_dequeued(complist, to_shard, to->ready_prio);
+	list_add_tail(&from->ready_node, &local->queue[from_prio]);
+	from->shard = local;
+	from->ready_prio = from_prio;
+	shard_queued(complist, local, from_prio);
+
+	ready_shards_unlock(to_shard, local);
+
+	return 0;
+}
+
+/**
+ * @brief ums_policy_ops.enqueue of UMS_POLICY_EDF
+ *
+ * The element is inserted in the EDF tree by its deadline.
+*/
+static void edf_enqueue(struct ums_complist *complist,
+			struct ums_compelem *compelem)
+{
+	spin_lock(&complist->edf_lock);
+	rb_add_cached(&compelem->edf_node, &complist->edf_root, edf_less);
+	WRITE_ONCE(complist->edf_nr, complist->edf_nr + 1);
+	spin_unlock(&complist->edf_lock);
+}
+
+/**
+ * @brief Pop the element with the earliest deadline from the EDF tree
+ *
+ * @param[in] complist: completion list in UMS_POLICY_EDF
+ *
+ * ums_policy_ops.pick_next of UMS_POLICY_EDF.
+ *
+ * @return the element removed from the tree, NULL if the tree is empty
+*/
+static struct ums_compelem *edf_pop(struct ums_complist *complist)
+{
+	struct rb_node *node;
+
+	if (! READ_ONCE(complist->edf_nr))
+		return NULL;
+
+	spin_lock(&complist->edf_lock);
+
+	node = rb_first_cached(&complist->edf_root);
+
+	if (node) {
+		rb_erase_cached(node, &complist->edf_root);
+		RB_CLEAR_NODE(node);
+		WRITE_ONCE(complist->edf_nr, complist->edf_nr - 1);
+	}
+
+	spin_unlock(&complist->edf_lock);
+
+	return node ? rb_entry(node, struct ums_compelem, edf_node) : NULL;
+}
+
+/**
+ * @brief ums_policy_ops.swap of UMS_POLICY_EDF
+ *
+ * from is inserted in the EDF tree by its deadline, under the same lock
+ * that removes to.
+ *
+ * @return 0 if everything is OK, -EAGAIN if to is not ready anymore
+*/
+static int edf_swap(struct ums_complist *complist,
+		    struct ums_compelem *from,
+		    struct ums_compelem *to)
+{
+	spin_lock(&complist->edf_lock);
+
+	if (RB_EMPTY_NODE(&to->edf_node)) {
+		spin_unlock(&complist->edf_lock);
+		return -EAGAIN;
+	}
+
+	rb_erase_cached(&to->edf_node, &complist->edf_root);
+	RB_CLEAR_NODE(&to->edf_node);
+	rb_add_cached(&from->edf_node, &complist->edf_root, edf_less);
+
+	spin_unlock(&complist->edf_lock);
+
+	return 0;
+}
+
+/**
+ * @brief Order of the EDF tree, the equal deadlines are kept FIFO
+ *
+ * @sa __edf_key
+*/
+static bool edf_less(struct rb_node *a, const struct rb_node *b)
+{
+	return __edf_key(rb_entry(a, struct ums_compelem, edf_node)) <
+	       __edf_key(rb_entry(b, struct ums_compelem, edf_node));
+}
+
+/**
+ * @brief Record the CPU that runs a completion element
+ *
+ * @param[in] compelem: completion element dispatched by current
+ *
+ * The workers are pinned, so the current CPU is the one of the worker. A
+ * dispatch on a CPU other than the last one is counted as a migration.
+*/
+static void track_cpu(struct ums_compelem *compelem)
+{
+	int cpu = raw_smp_processor_id();
+
+	if (compelem->last_cpu != cpu) {
+		if (compelem->last_cpu >= 0)
+			compelem->n_migrations++;
+
+		WRITE_ONCE(compelem->last_cpu, cpu);
+	}
+}
+
+/**
+ * @brief Update the average gap between the ready elements of a list
+ *
+ * @param[in] complist: list where an element becomes ready
+ *
+ * Exponential moving average with weight 1/8. A gap longer than
+ * UMS_IDLE_SPIN_MAX_NS counts as UMS_IDLE_SPIN_MAX_NS: it only tells that
+ * spinning is useless, and the average recovers quickly after an idle
+ * period. The updates are racy, a lost sample does not matter.
+*/
+static void track_arrival(struct ums_complist *complist)
+{
+	u64 now = ktime_get_ns();
+	u64 last = atomic64_xchg(&complist->last_arrival, now);
+	u64 gap = READ_ONCE(complist->arrival_gap);
+
+	if (! last || now <= last)
+		return;
+
+	gap = gap - (gap >> 3) +
+	      (min_t(u64, now - last, UMS_IDLE_SPIN_MAX_NS) >> 3);
+
+	WRITE_ONCE(complist->arrival_gap, gap);
+}
+
+/**
+ * @brief Spin on the ready elements of a list before sleeping
+ *
+ * @param[in] complist: list with no ready element
+ *
+ * The caller spins for twice the average gap between two ready elements,
+ * at most spin_ns. If the elements arrive less often than spin_ns (or no
+ * element arrived yet) the caller sleeps at once. The spin stops early if
+ * current must reschedule or has a pending signal.
+ *
+ * @return the element picked by the policy of the list, NULL if the caller
+ *	must sleep
+*/
+static struct ums_compelem *idle_spin(struct ums_complist *complist)
+{
+	const struct ums_policy_ops *ops = READ_ONCE(complist->ops);
+	struct ums_compelem *compelem;
+	u64 budget = READ_ONCE(complist->spin_ns);
+	u64 gap = READ_ONCE(complist->arrival_gap);
+	u64 end;
+
+	if (! budget || ! gap || gap > budget)
+		return NULL;
+
+	end = ktime_get_ns() + min(2 * gap, budget);
+
+	do {
+		/* the shards are locked only once something is ready */
+		if (complist_has_ready(complist)) {
+			compelem = ops->pick_next(complist);
+
+			if (compelem) {
+				atomic64_inc(&complist->spin_hits);
+				return compelem;
+			}
+		}
+
+		cpu_relax();
+	} while (! need_resched() && ! signal_pending(current) &&
+		 ktime_get_ns() < end);
+
+	atomic64_inc(&complist->spin_misses);
+
+	return NULL;
+}
+
+/**
+ * @brief Count the miss of the deadline of a completion element
+ *
+ * @param[in] compelem: completion element being dispatched or queued again
+ * @param[in] now: current time in ns
+ *
+ * A deadline is counted once in its completion list, the first time the
+ * element is dispatched or queued after it.
+*/
+static void check_deadline(struct ums_compelem *compelem, u64 now)
+{
+	u64 deadline = READ_ONCE(compelem->deadline);
+
+	if (deadline && now > deadline &&
+	    ! xchg(&compelem->deadline_missed, 1))
+		atomic64_inc(&compelem->complist->deadline_misses);
+}
+
+/**
+ * @brief Free the ready ring of a completion list
+ *
+ * The user mappings keep their own reference to the pages.
+*/
+static void ready_ring_free(struct ums_ready_ring *ring)
+{
+	if (! ring)
+		return;
+
+	vfree(ring->mem);
+	kfree(ring);
+}
+
+/**
+ * @brief Register the compelement in complist as ready
+ *
+ * @param complist: completion list in which compelem get registered as ready
+ * @param compelem: completion elem to be marked as ready
+ * @param yielded: compelem gave up its worker (see ums_policy_ops.on_yield)
+ *
+ * This function register the completion element inside the complist. It
+ * hands the completion element to the policy of the list (enqueue or
+ * on_yield), then it wakes up a reserver.
+ *
+ * This mechanism is the dual of the reservation mechanism that lets the
+ * policy remove the element (pick_next) and sleeps while there is none.
+ *
+ * If the policy allows the ready ring, the element has UMS_PRIO_NORMAL,
+ * the completion list has a ready ring, no thread is blocked on ready_wait
+ * and the ring has free entries, the element is published in the ring
+ * instead.
+ *
+ * @return void
+ *
+ * @note This function does not check that a compelem is inserted twice, 
+ *	that is a responsability of the developer.
+ * @sa ums_compelem_add
+ * @sa ums_compelem_store_reg
+ * @sa ums_complist
+ * @sa ums_compelem
+*/
+static void __register_compelem(struct ums_complist *complist,
+				struct ums_compelem *compelem,
+				int yielded)
+{
+	const struct ums_policy_ops *ops = READ_ONCE(complist->ops);
+
+	if (ops->ready_ring && READ_ONCE(compelem->prio) == UMS_PRIO_NORMAL &&
+	    READ_ONCE(complist->ready_ring)) {
+		spin_lock(&complist->ready_lock);
+
+		if (! complist->nr_waiters &&
+		    ! ready_ring_publish(complist->ready_ring, compelem)) {
+			spin_unlock(&complist->ready_lock);
+
+			/* no reserver sleeps: only the pollers can wait */
+			if (wq_has_sleeper(&complist->ready_wait))
+				wake_up(&complist->ready_wait);
+
+			return;
+		}
+
+		spin_unlock(&complist->ready_lock);
+	}
+
+	if (yielded && ops->on_yield)
+		ops->on_yield(complist, compelem);
+	else
+		ops->enqueue(complist, compelem);
+
+	if (READ_ONCE(complist->spin_ns))
+		track_arrival(complist);
+
+	/* wq_has_sleeper orders the enqueue with the check of the waiters */
+	if (wq_has_sleeper(&complist->ready_wait))
+		wake_up(&complist->ready_wait);
+}
+
+/**
+ * @brief poll of the completion list file descriptor
+ *
+ * The pollers wait on ready_wait with the reservers, a new ready element
+ * wakes them up (see __register_compelem).
+ *
+ * @return EPOLLIN if the list has ready elements, EPOLLHUP if it has been
+ *	removed
+*/
+static __poll_t complist_fd_poll(struct file *file, poll_table *wait)
+{
+	struct ums_complist_file *cfile = file->private_data;
+	struct ums_complist *complist = cfile->ref->data;
+	struct ums_ready_ring *ring;
+	__poll_t mask = 0;
+
+	poll_wait(file, &complist->ready_wait, wait);
+
+	/* pairs with wq_has_sleeper in __register_compelem */
+	smp_mb();
+
+	if (complist_has_ready(complist))
+		mask |= EPOLLIN | EPOLLRDNORM;
+
+	ring = READ_ONCE(complist->ready_ring);
+
+	/* racy read of the shared header: a false positive only costs a
+	 * failed dequeue */
+	if (ring && READ_ONCE(ring->hdr->head) !=
+		    smp_load_acquire(&ring->hdr->tail))
+		mask |= EPOLLIN | EPOLLRDNORM;
+
+	if (READ_ONCE(complist->dead))
+		mask |= EPOLLHUP;
+
+	return mask;
+}
+
+/**
+ * @brief Release the completion list file when its last reference is
+ * dropped
+*/
+static int complist_fd_release(struct inode *inode, struct file *file)
+{
+	struct ums_complist_file *cfile = file->private_data;
 
-	__set_reserved(*compelem, reserve_head);
+	id_ref_put(cfile->ref);
+	fput(cfile->dev_file);
+	kfree(cfile);
 
 	return 0;
 }
@@ -5,17 +5,16 @@
  * Contains the publicly accessible function prototypes of the sub-module
  * complist.
  *
- * To enable the module:
+ * The completion lists and elements belong to a session (see
+ * ums_session.h), which calls:
  * @code
- * ums_complist_init();
- * ums_complist_proc_int(ums_entry);
+ * ums_complist_session_init(session);
+ * ...
+ * ums_complist_session_deinit(session);
  * @endcode
  *
- * To disable the module:
- * @code
- * ums_complist_proc_deinit();
- * ums_complist_deinit();
- * @endcode
+ * Every function below takes the session as first parameter, it is omitted
+ * in the examples.
  *
  * To create a new completion list:
  * @code
@@ -51,10 +50,32 @@
  * KERNEL SPACE CODE:
  *
  * @code
- * ums_compelem_add(complist, &id, &user_buff);
+ * ums_compelem_add(complist, &id, UMS_PRIO_NORMAL, 0, &user_buff);
  * // stay frozen until the completion element gets destroyed
  * @endcode
  *
+ * To change the priority of a completion element:
+ * @code
+ * ums_compelem_set_prio(id, UMS_PRIO_HIGH);
+ * @endcode
+ *
+ * To hand out the ready elements by deadline (before adding elements):
+ * @code
+ * ums_complist_set_policy(complist, UMS_POLICY_EDF, 0);
+ * ...
+ * ums_compelem_set_deadline(id, ktime_get_ns() + period);
+ * @endcode
+ *
+ * To let the idle reservers spin for at most 50us before sleeping:
+ * @code
+ * ums_complist_set_idle(complist, 50000);
+ * @endcode
+ *
+ * To preempt the elements that run for more than 1ms:
+ * @code
+ * ums_complist_set_time_slice(complist, 1000000);
+ * @endcode
+ *
  * To remove a completion element:
  *
  * First of all a completion element should be removed only by himself at the
@@ -69,8 +90,9 @@
  * int id = ..;
  * int n_res = ..;
  * int size;
- * int *buff = kmalloc(sizeof(int) * n_res, GFP_KERNEL);
- * ums_complist_reseve(id, n_res, buff, &size);
+ * int buff[N_RES];
+ * LIST_HEAD(reserved);
+ * ums_complist_reseve(id, n_res, &reserved, buff, &size);
  * ...
  * ...
  * ...
@@ -86,6 +108,11 @@
  * ums_compelem_store_reg(elem);
  * @endcode
  *
+ * To pass the CPU from the running element to a ready one of the same list:
+ * @code
+ * ums_compelem_switch(running_elem, ready_elem, host);
+ * @endcode
+ *
  * @sa ums_complist.c
  * @sa ums_complist_internal.h
 */
@@ -103,43 +130,98 @@ typedef int ums_complist_id;
 typedef int ums_compelem_id;
 #include "ums_scheduler.h"
 #include "ums_proc.h"
+#include "ums_device.h"
 #include <linux/list.h>
 
 extern struct proc_dir_entry *ums_proc_dir;
 
-/* TODO: move in C or internal file */
-#define UMS_COMPLIST_HASH_BITS 8
-#define UMS_COMPELEM_HASH_BITS 8
+struct ums_session;
 
-int ums_complist_add(ums_complist_id *result);
+struct file;
 
-int ums_complist_exists(ums_complist_id comp_id);
+int ums_complist_add(struct ums_session *session, ums_complist_id *result);
 
-int ums_complist_reserve(ums_complist_id comp_id,
+int ums_complist_reserve(struct ums_session *session,
+			 ums_complist_id comp_id,
 			 int to_reserve,
+			 struct list_head *reserve_head,
 			 ums_compelem_id *ret_array,
-			 int *size);
+			 int *size,
+			 int do_sleep);
+
+int ums_complist_fd(struct file *dev_file, ums_complist_id comp_id);
+
+int ums_complist_wait(struct ums_session *session,
+		      ums_complist_id id,
+		      s64 timeout_ns);
+
+int ums_complist_ready_ring_setup(struct ums_session *session,
+				  struct ums_ready_ring_args *args);
+
+int ums_complist_ready_ring_mmap(struct ums_session *session,
+				 ums_complist_id comp_id,
+				 struct vm_area_struct *vma);
 
-int ums_compelem_add(ums_compelem_id* result,
+int ums_compelem_add(struct ums_session *session,
+		     ums_compelem_id* result,
 		     ums_complist_id list_id,
+		     int prio,
+		     u64 deadline,
 		     void * __user user_data);
 
-int ums_complist_add_scheduler(ums_complist_id id, 
+int ums_complist_add_scheduler(struct ums_session *session,
+			       ums_complist_id id, 
 			       ums_sched_id sched_id);
 
-int ums_compelem_remove(ums_compelem_id id);
+int ums_compelem_remove(struct ums_session *session, ums_compelem_id id);
+
+int ums_compelem_set_prio(struct ums_session *session,
+			  ums_compelem_id id,
+			  int prio);
+
+int ums_compelem_set_deadline(struct ums_session *session,
+			      ums_compelem_id id,
+			      u64 deadline);
+
+int ums_complist_set_policy(struct ums_session *session,
+			    ums_complist_id id,
+			    unsigned int policy,
+			    unsigned int flags);
+
+int ums_complist_set_idle(struct ums_session *session,
+			  ums_complist_id id,
+			  u64 spin_ns);
+
+int ums_complist_set_time_slice(struct ums_session *session,
+				ums_complist_id id,
+				u64 slice_ns);
+
+u64 ums_compelem_time_slice(struct ums_session *session,
+			    ums_compelem_id id);
+
+int ums_complist_dispatch(struct ums_session *session,
+			  ums_complist_id comp_id,
+			  struct list_head *reserve_head,
+			  ums_compelem_id *id);
 
-int ums_compelem_store_reg(ums_compelem_id compelem_id);
+int ums_compelem_store_reg(struct ums_session *session,
+			   ums_compelem_id compelem_id);
 
-int ums_compelem_exec(ums_compelem_id compelem_id,
-		      ums_sched_id host_id);
+int ums_compelem_park(struct ums_session *session,
+		      ums_compelem_id compelem_id);
 
-int ums_complist_init(void);
+int ums_compelem_exec(struct ums_session *session,
+		      ums_compelem_id compelem_id,
+		      ums_sched_id host_id,
+		      unsigned int flags);
 
-int ums_complist_proc_init(struct proc_dir_entry *ums_dir);
+int ums_compelem_switch(struct ums_session *session,
+			ums_compelem_id from_id,
+			ums_compelem_id to_id,
+			ums_sched_id host_id);
 
-void ums_complist_deinit(void);
+int ums_complist_session_init(struct ums_session *session);
 
-void ums_complist_proc_deinit(void);
+void ums_complist_session_deinit(struct ums_session *session);
 
 #endif /* __UMS_COMPLIST_H__ */
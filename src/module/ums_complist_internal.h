@@ -13,15 +13,129 @@
 #ifndef __UMS_COMPLIST_INTERNAL_H__
 #define __UMS_COMPLIST_INTERNAL_H__
 
-#include <linux/kfifo.h>
 #include <linux/list.h>
-#include <linux/hashtable.h>
 #include <linux/proc_fs.h>
 #include <linux/spinlock.h>
+#include <linux/percpu.h>
+#include <linux/wait.h>
+#include <linux/atomic.h>
+#include <linux/cache.h>
+#include <linux/rbtree.h>
+#include <linux/cpumask.h>
 
 #include "ums_complist.h"
 #include "ums_scheduler.h"
 #include "ums_context_switch.h"
+#include "ums_device.h"
+
+/**
+ * @struct ums_ready_ring
+ *
+ * @brief Ready ring of a completion list shared with user space
+ *
+ * The module is the only producer (under ready_lock), the consumers are the
+ * scheduler threads (compare and swap on hdr->head).
+ *
+ * @sa UMS_REQUEST_READY_RING_SETUP
+*/
+struct ums_ready_ring {
+	/** vmalloc_user memory mapped in user space */
+	void *mem;
+	/** size of mem */
+	size_t size;
+	/** shared header */
+	struct ums_ready_ring_hdr *hdr;
+	/** shared array of ready element identifiers */
+	__s32 *ids;
+	/** number of entries (power of 2) */
+	u32 entries;
+	/** private copy of the tail, user space cannot corrupt it */
+	u32 tail;
+};
+
+/**
+ * @struct ums_complist_file
+ *
+ * @brief Private data of a completion list file descriptor
+ *
+ * @sa UMS_REQUEST_COMPLIST_FD
+*/
+struct ums_complist_file {
+	/** device file, it keeps the session alive */
+	struct file *dev_file;
+	/** reference of the completion list, it keeps ready_wait alive */
+	struct id_ref *ref;
+};
+
+/**
+ * @struct ums_ready_shard
+ *
+ * @brief Per-CPU part of the ready queue of a completion list
+ *
+ * An element becomes ready in the shard of the CPU it last ran on (or of
+ * the CPU that registers it, if it never ran), in the queue of its
+ * priority level. A reserving worker pops from the highest
+ * level that has ready elements, from its own shard first and then stealing
+ * from the shards of the other CPUs.
+ *
+ * @sa reserve_compelem
+ * @sa __register_compelem
+*/
+struct ums_ready_shard {
+	/** lock of queue and of ums_compelem.shard of its elements */
+	spinlock_t lock;
+	/** ready elements (ums_compelem.ready_node), one queue for each
+	 * priority level */
+	struct list_head queue[UMS_PRIO_LEVELS];
+	/** number of elements in queue, written under lock. Only the slow
+	 * paths sum them (see complist_nr_ready) */
+	unsigned int nr_ready;
+	/** CPU of the shard, its bit in ums_complist.ready_cpus */
+	int cpu;
+} ____cacheline_aligned_in_smp;
+
+struct ums_complist;
+struct ums_compelem;
+
+/**
+ * @struct ums_policy_ops
+ *
+ * @brief Pick-next policy of a completion list (UMS_POLICY_*)
+ *
+ * The policy owns the ready set of the list. ready_wait and the ready ring
+ * are handled by the caller: enqueue and on_yield only store the element,
+ * pick_next returns NULL if it finds no element (the reserver then spins or
+ * sleeps on ready_wait).
+ *
+ * @sa ums_policies
+*/
+struct ums_policy_ops {
+	/** name shown in the info proc file */
+	const char *name;
+
+	/** store an element that becomes ready (registration, release of a
+	 * reservation) */
+	void (*enqueue)(struct ums_complist *complist,
+			struct ums_compelem *compelem);
+
+	/** store an element that gave up its worker (yield, exec of another
+	 * element), NULL to use enqueue */
+	void (*on_yield)(struct ums_complist *complist,
+			 struct ums_compelem *compelem);
+
+	/** remove and return the next element to run */
+	struct ums_compelem *(*pick_next)(struct ums_complist *complist);
+
+	/** put the running element from in the place of the ready element
+	 * to (ums_compelem_switch), -EAGAIN if to is not ready anymore */
+	int (*swap)(struct ums_complist *complist,
+		    struct ums_compelem *from,
+		    struct ums_compelem *to);
+
+	/** 1 if the UMS_PRIO_NORMAL elements can be published in the ready
+	 * ring, i.e. the policy is FIFO within a priority level */
+	int ready_ring;
+};
 
 /**
  * @struct ums_complist
@@ -29,7 +143,7 @@
  * @brief Structure that defines the logical entity of completion list
  *
  * @var scheduler_lock: lock of the list of schedulers
- * @var elem_sem: semaphore used as async counter of ready_queue
+ * @var ready_cpus: shards with ready elements, for each priority level
  * @var proc_dir: completion list proc directory entry
  *
  * This structure is the logical list of completion elements. Its duties are
@@ -39,26 +153,96 @@
  * have finished.
 */
 struct ums_complist {
-	/** unique identifier, created with atomic_t var to ensure 
-	 * that it has no duplicates */
+	/** unique identifier in the session, reserved with
+	 * id_registry_reserve (index and generation) */
 	ums_complist_id id;
 
-	/** list used for hash_add/del operations of the hashtable */
-	struct hlist_node list;
+	/** Per-CPU ready queues that store the completion elements
+	 *  (ums_compelem) that are neither in execution nor reserved. They
+	 *  are intrusive lists (ums_compelem.ready_node) so that a ready
+	 *  element can be removed from the middle (see ums_compelem_switch) */
+	struct ums_ready_shard __percpu *shards;
 
-	/** This queue is used to store the completion lists (ums_compelem)
-	 *  that are neither in execution nor reserved */
-	struct kfifo ready_queue;
+	/** For each priority level, the CPUs whose shard has elements in
+	 * that level. A bit is changed under the lock of its shard, only when
+	 * the level becomes (non-)empty: the reservers scan these shards only
+	 * and no counter is shared by the enqueue and pick paths */
+	cpumask_var_t ready_cpus[UMS_PRIO_LEVELS];
 
-	/** the lock for the ready queue. This lock is used during
-	 * kfifo_in_spinlocked and kfifo_out_spinlocked */
+	/** policy (ums_policies entry), changed only while the list has no
+	 * elements (under compelems_lock) */
+	const struct ums_policy_ops *ops;
+
+	/** UMS_POLICY_F_* flags, changed with ops */
+	unsigned int policy_flags;
+
+	/** first shard tried by the next pick of UMS_POLICY_RR */
+	atomic_t rr_cursor;
+
+	/** Ready elements of a UMS_POLICY_EDF list ordered by deadline
+	 * (ums_compelem.edf_node), used instead of the shards */
+	struct rb_root_cached edf_root;
+
+	/** lock of edf_root and of ums_compelem.deadline */
+	spinlock_t edf_lock;
+
+	/** number of elements in edf_root, written under edf_lock */
+	unsigned int edf_nr;
+
+	/** number of deadlines missed by the elements of the list */
+	atomic64_t deadline_misses;
+
+	/** Reservers waiting for a ready element */
+	wait_queue_head_t ready_wait;
+
+	/** Threads waiting for the removal of the list, i.e. for the end of
+	 * its last element (see ums_complist_wait) */
+	wait_queue_head_t drain_wait;
+
+	/** maximum spin of a reserver before sleeping on ready_wait in ns,
+	 * 0 to always sleep (see idle_spin) */
+	u64 spin_ns;
+
+	/** time of the last element that became ready in ns, 0 if none */
+	atomic64_t last_arrival;
+
+	/** moving average of the gap between two ready elements in ns, at
+	 * most UMS_IDLE_SPIN_MAX_NS (see track_arrival) */
+	u64 arrival_gap;
+
+	/** reservers that got an element while spinning */
+	atomic64_t spin_hits;
+
+	/** reservers that spun and then slept */
+	atomic64_t spin_misses;
+
+	/** time slice of the elements in ns, 0 if they are never preempted
+	 * (see ums_compelem_time_slice) */
+	u64 time_slice;
+
+	/** lock of the ready ring producer and of nr_waiters */
 	spinlock_t ready_lock;
 
+	/** optional ready ring, NULL unless UMS_REQUEST_READY_RING_SETUP
+	 * was called. It is set once, with cmpxchg */
+	struct ums_ready_ring *ready_ring;
+
+	/** number of threads blocked on ready_wait (protected by ready_lock).
+	 * While it is not zero the ready elements skip the ready ring */
+	int nr_waiters;
+
+	/** set by deinit_complist (under compelems_lock): the users that
+	 * still hold a reference must not add elements nor schedulers */
+	int dead;
+
 	/**
 	 * Memory map used for all the elements of the completion list
 	*/
 	struct mm_struct *mm;
 
+	/** session that owns the completion list and its elements */
+	struct ums_session *session;
+
 	/** list of completion elements pointers (ums_compelem*) that are owned
 	 * and managed by this completion list. */
 	struct list_head compelems;
@@ -76,12 +260,11 @@ struct ums_complist {
 	/** Lock to access to the schedulers list in isolation */
 	spinlock_t schedulers_lock;
 
-	/** Semaphore used to reserve the kfifo elements and block callers if
-	 * there are no available completion elements */
-	struct semaphore elem_sem;
-
 	/* procfs directory */
 	struct proc_dir_entry *proc_dir;
+
+	/** procfs file with the policy and the stats of the list */
+	struct proc_dir_entry *proc_info_file;
 };
 
 /**
@@ -97,8 +280,8 @@ struct ums_complist {
  * thread itself.
 */
 struct ums_compelem {
-	/** unique identifier, created with atomic_t var to ensure 
-	 * that it has no duplicates */
+	/** unique identifier in the session, reserved with
+	 * id_registry_reserve (index and generation) */
 	ums_compelem_id id;
 
 	/* The scheduler that is currently hosting the execution of compelem */
@@ -107,8 +290,44 @@ struct ums_compelem {
 	/** parent completion list that manage this completion element */
 	struct ums_complist *complist;
 
-	/** list entry for the compelem hash */
-	struct hlist_node list;
+	/** reference of complist, it keeps the list allocated as long as the
+	 * element (see free_compelem) */
+	struct id_ref *complist_ref;
+
+	/** entry of the queue of a ready shard, empty if the element is not
+	 * ready (i.e. it is either reserved or running) */
+	struct list_head ready_node;
+
+	/** shard that holds ready_node, NULL if none. Written under the lock
+	 * of the shard */
+	struct ums_ready_shard *shard;
+
+	/** priority (UMS_PRIO_*) used the next time the element becomes
+	 * ready */
+	int prio;
+
+	/** priority level of the queue that holds ready_node. Written under
+	 * the lock of the shard */
+	int ready_prio;
+
+	/** absolute deadline in ns, 0 if none (see UMS_POLICY_EDF) */
+	u64 deadline;
+
+	/** 1 if the miss of deadline has already been counted */
+	int deadline_missed;
+
+	/** node of ums_complist.edf_root, empty (RB_CLEAR_NODE) if the
+	 * element is not ready in an EDF list */
+	struct rb_node edf_node;
+
+	/** 1 if the element is published in the ready ring, cleared (xchg) by
+	 * the one that claims it */
+	int ring_ready;
+
+	/** 1 if the element has been parked in user space (see
+	 * UMS_EXEC_F_PARKED): its entry_ctx is stale and it is resumed by
+	 * user space. Cleared when the module resumes it again */
+	int parked;
 	
 	/** entry for the completion list, list of completion elements */
 	struct list_head complist_head;
@@ -148,6 +367,13 @@ struct ums_compelem {
 	 * been executed by the completion element */
 	unsigned int n_switch;
 
+	/** CPU of the worker that ran the element the last time, -1 if it
+	 * never ran. The element becomes ready in the shard of this CPU */
+	int last_cpu;
+
+	/** Number of dispatches on a CPU different from last_cpu */
+	unsigned int n_migrations;
+
 	/** procfs file that will contain the infos and stats of the compelem */
 	struct proc_dir_entry *proc_file;
 };
@@ -4,12 +4,24 @@
  * @brief This file contains the definition of context switch struct and procedures
  *
  * This header file defines macros and structures to perform context switch
- * using user mode scheduling. To generate the context it is sufficient
- * to call gen_ums_context, to switch to the new context use put_ums_context,
- * to update the context when returned from user space use get_ums_context.
+ * using user mode scheduling. The FPU area of a context is allocated with
+ * alloc_ums_context and freed with free_ums_context. To generate the context
+ * it is sufficient to call gen_ums_context, to switch to the new context use
+ * put_ums_context, to update the context when returned from user space use
+ * get_ums_context.
+ *
+ * The FPU/vector state is saved with the XSAVE infrastructure of the kernel
+ * (XSAVEOPT/XSAVES when available) and loaded back only on the return to
+ * user mode. The extended components (AVX, AVX-512, ...) are copied only
+ * if the context uses them, see ums_fpu_save.
+ *
+ * The FPU helpers use the x86 FPU internals (asm/fpu/internal.h): they were
+ * renamed in 5.14 and made private to the core kernel in 5.16, so the module
+ * supports Linux 5.6 (proc_ops) to 5.15.
  *
  * @code
  *	// process 1
+ *	alloc_ums_context(&my_struct->ctx);
  *	spin_lock(&my_struct->lock);
  *	gen_ums_context(current, &my_struct->ctx);
  *	spin_unlock(&my_struct->lock);
@@ -38,10 +50,27 @@
 #ifndef __UMS_CONTEXT_SWITCH_H__
 #define __UMS_CONTEXT_SWITCH_H__
 
+#include <linux/version.h>
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 6, 0) || \
+	LINUX_VERSION_CODE >= KERNEL_VERSION(5, 16, 0)
+#error "the ums module supports Linux 5.6 to 5.15"
+#endif
+
 #include <linux/ptrace.h>
 #include <asm/processor.h>
 #include <asm/fpu/internal.h>
+#include <asm/fpu/api.h>
 #include <linux/sched/task_stack.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+
+/**
+ * @brief Size of the FPU area that every context saves: the legacy
+ * (FXSAVE) area and the XSAVE header
+*/
+#define UMS_FPU_LEGACY_SIZE \
+	(sizeof(struct fxregs_state) + sizeof(struct xstate_header))
 
 /**
  * @struct ums_context 
@@ -49,7 +78,9 @@
  *
  * @var pt_regs: value of the general registers of the task.
  *
- * @var fpu_regs: value of the register for floating point operations.
+ * @var fpu_state: saved FPU/vector registers of the task.
+ *
+ * @var fpu_size: valid bytes of fpu_state.
  *
  * The ums_context struct is a structure in charge of storing information
  * of a task that can be executed by another `host` task through a UMS switch
@@ -63,14 +94,113 @@ struct ums_context {
 	struct pt_regs pt_regs;
 
 	/**
-	 * @fpu_regs: Value of the registers for floating point operations
+	 * @fpu_state: Value of the registers for floating point operations
 	 *
-	 * This registers contains the state of floating point operations of
-	 * when the task was interrupted
+	 * Copy of the FPU area of the task (fpu_kernel_xstate_size bytes, in
+	 * the format of the kernel) when the task was interrupted
 	*/
-	struct fpu fpu_regs;
+	union fpregs_state *fpu_state;
+
+	/**
+	 * @fpu_size: Bytes of fpu_state written by the last save
+	 *
+	 * Either UMS_FPU_LEGACY_SIZE, when the extended components are in
+	 * their init state, or fpu_kernel_xstate_size
+	*/
+	unsigned int fpu_size;
 };
 
+/**
+ * @brief Allocate the FPU area of a context
+ *
+ * @param[out] ctx: the context, must be freed with free_ums_context
+ *
+ * @return 0 if no error occured, -ENOMEM otherwise
+*/
+static inline int alloc_ums_context(struct ums_context *ctx)
+{
+	ctx->fpu_state = kzalloc(fpu_kernel_xstate_size, GFP_KERNEL);
+	ctx->fpu_size = 0;
+
+	return ctx->fpu_state ? 0 : -ENOMEM;
+}
+
+/**
+ * @brief Free the FPU area of a context (NULL is allowed)
+*/
+static inline void free_ums_context(struct ums_context *ctx)
+{
+	kfree(ctx->fpu_state);
+	ctx->fpu_state = NULL;
+}
+
+/**
+ * @brief Save the FPU/vector registers of current in a context
+ *
+ * @param[out] ctx: the context
+ *
+ * The user registers are still live unless current was scheduled out since
+ * it entered the kernel (TIF_NEED_FPU_LOAD): they are saved in the FPU area
+ * of current with XSAVEOPT/XSAVES, which skip the unmodified components.
+ * Then only the legacy area and the XSAVE header are copied in ctx, unless
+ * the header (XSTATE_BV) tells that the extended components are in use.
+*/
+static inline void ums_fpu_save(struct ums_context *ctx)
+{
+	struct fpu *fpu = &current->thread.fpu;
+
+	fpregs_lock();
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 14, 0)
+	/* it reloads the registers itself if FNSAVE reset them */
+	if (! test_thread_flag(TIF_NEED_FPU_LOAD))
+		save_fpregs_to_fpstate(fpu);
+#else
+	/* as fpu__save: the registers are reloaded if XSAVE reset them */
+	if (! test_thread_flag(TIF_NEED_FPU_LOAD) &&
+	    ! copy_fpregs_to_fpstate(fpu))
+		copy_kernel_to_fpregs(&fpu->state);
+#endif
+
+	if (use_xsave() &&
+	    ! (fpu->state.xsave.header.xfeatures & ~XFEATURE_MASK_FPSSE))
+		ctx->fpu_size = UMS_FPU_LEGACY_SIZE;
+	else
+		ctx->fpu_size = fpu_kernel_xstate_size;
+
+	memcpy(ctx->fpu_state, &fpu->state, ctx->fpu_size);
+
+	fpregs_unlock();
+}
+
+/**
+ * @brief Set the FPU/vector registers of current from a context
+ *
+ * @param[in] ctx: the context
+ *
+ * The context is copied in the FPU area of current and the registers are
+ * invalidated: they are loaded (XRSTOR/XRSTORS) only on the return to user
+ * mode, once even if several switches happen in between. The components
+ * that are not in the XSTATE_BV of ctx are not copied, XRSTOR puts them in
+ * their init state without reading them.
+*/
+static inline void ums_fpu_restore(struct ums_context *ctx)
+{
+	struct fpu *fpu = &current->thread.fpu;
+
+	if (unlikely(! ctx->fpu_size))
+		return;
+
+	fpregs_lock();
+
+	memcpy(&fpu->state, ctx->fpu_state, ctx->fpu_size);
+
+	__fpu_invalidate_fpregs_state(fpu);
+	set_thread_flag(TIF_NEED_FPU_LOAD);
+
+	fpregs_unlock();
+}
+
 /**
  * @brief generate from a task a context suitable for UMS switch
  *
@@ -80,9 +210,10 @@ struct ums_context {
  *
  * @return does not return values
  *
- * Takes the pt_regs from the task and initialize fpu_regs to 0
+ * Takes the pt_regs and the FPU registers from the task
  *
- * @note This macro assumes that res has been allocated in memory
+ * @note This macro assumes that res has been allocated with
+ *	alloc_ums_context and that task is current
  *
  * @sa get_ums_context
  * @sa put_ums_context
@@ -91,8 +222,7 @@ struct ums_context {
 	do {								\
 		memcpy(&(res)->pt_regs, task_pt_regs(task),		\
 		       sizeof(struct pt_regs));				\
-		memset(&(res)->fpu_regs, 0, sizeof(struct fpu));	\
-		copy_fxregs_to_kernel(&(res)->fpu_regs);		\
+		ums_fpu_save(res);					\
 	} while (0)
 
 /**
@@ -103,9 +233,10 @@ struct ums_context {
  *
  * @return does not return values
  *
- * Takes the pt_regs and the fpu_regs from the task
+ * Takes the pt_regs and the FPU registers from the task
  *
- * @note This macro assumes that ctx has been allocated in memory
+ * @note This macro assumes that ctx has been allocated with
+ *	alloc_ums_context and that task is current
  *
  * @sa ums_context
  * @sa gen_ums_context
@@ -115,7 +246,7 @@ struct ums_context {
 	do {								\
 		memcpy(&(ctx)->pt_regs, task_pt_regs(task),		\
 		       sizeof(struct pt_regs));				\
-		copy_kernel_to_fxregs(&(ctx)->fpu_regs.state.fxsave);	\
+		ums_fpu_save(ctx);					\
 	} while (0)
 
 /**
@@ -130,7 +261,7 @@ struct ums_context {
  * state. When the thread will return with user space it will execute 
  * the context ctx.
  *
- * @note Has side effects on task
+ * @note Has side effects on task, which must be current
  *
  * @warning using this macro with inconsistent context may cause internal errors
  * @sa ums_context
@@ -141,7 +272,7 @@ struct ums_context {
 	do {								\
 		memcpy(task_pt_regs(task), &(ctx)->pt_regs,		\
 		       sizeof(struct pt_regs));				\
-		copy_fxregs_to_kernel(&(ctx)->fpu_regs);		\
+		ums_fpu_restore(ctx);					\
 	} while (0)
 
 /**
@@ -16,32 +16,47 @@
 #include <linux/miscdevice.h>
 #include <linux/sched.h>
 #include <linux/slab.h>
-#include <asm/uaccess.h> /* for put_user */
+#include <linux/mm.h>
+#include <linux/uaccess.h> /* for put_user */
+#include <linux/string.h>
 
 #include "ums_device.h"
 #include "ums_device_internal.h"
 #include "ums_scheduler.h"
 #include "ums_complist.h"
 #include "ums_proc.h"
+#include "ums_ring.h"
+#include "ums_session.h"
+
+#define CREATE_TRACE_POINTS
+#include "ums_trace.h"
 
 
 MODULE_LICENSE("GPL");
 
 MODULE_AUTHOR("Alberto Bombardelli");
 
+static int device_open(struct inode *inode, struct file *file);
+
+static int device_release(struct inode *inode, struct file *file);
+
 static long device_ioctl(struct file *file, unsigned int request, unsigned long data);
 
+static int device_mmap(struct file *file, struct vm_area_struct *vma);
+
 #define SUCCESS 0
-#define FAILURE -1
 #define DEVICE_NAME "usermodscheddev"
 #define MODULE_NAME_LOG "umsdev: "
-#define DEQUEUE_ELEM_MAX 512
 
 /*
  * Global variables are declared as static, so are global within the file.
  */
 static struct file_operations fops = {
-	.unlocked_ioctl = device_ioctl};
+	.owner = THIS_MODULE,
+	.open = device_open,
+	.release = device_release,
+	.unlocked_ioctl = device_ioctl,
+	.mmap = device_mmap};
 
 static struct miscdevice mdev = {
 	.minor = 0,
@@ -77,30 +92,8 @@ int init_module(void)
 	if (ret) {
 		printk(KERN_ALERT MODULE_NAME_LOG
 		       "Initialization of sub-module ums_sched failed!\n");
-		return ret;
-	}
-
-	ret = ums_sched_proc_init(ums_proc_root());
-
-	if (ret) {
-		printk(KERN_ALERT MODULE_NAME_LOG
-		       "Initialization of sub-module ums_sched_proc failed!\n");
-		return ret;
-	}
-
-	ret = ums_complist_init();
-
-	if (ret) {
-		printk(KERN_ALERT MODULE_NAME_LOG
-		       "Initialization of sub-module ums_complist failed!\n");
-		return ret;
-	}
-
-	ret = ums_complist_proc_init(ums_proc_root());
-
-	if (ret) {
-		printk(KERN_ALERT MODULE_NAME_LOG
-		       "Initialization of sub-module ums_sched_proc failed!\n");
+		ums_proc_deinit();
+		misc_deregister(&mdev);
 		return ret;
 	}
 
@@ -117,9 +110,6 @@ void cleanup_module(void)
 	/*
 	* Unregister the device
 	*/
-	ums_complist_proc_deinit();
-	ums_complist_deinit();
-	ums_sched_proc_deinit();
 	ums_sched_deinit();
 	ums_proc_deinit();
 	misc_deregister(&mdev);
@@ -127,67 +117,167 @@ void cleanup_module(void)
 	printk(KERN_DEBUG MODULE_NAME_LOG "exit\n");
 }
 
+/**
+ * @brief Create the session of a new open file
+ *
+ * @sa ums_session
+*/
+static int device_open(struct inode *inode, struct file *file)
+{
+	struct ums_session *session;
+
+	session = ums_session_create();
+
+	if (! session)
+		return -ENOMEM;
+
+	file->private_data = session;
+
+	return SUCCESS;
+}
+
+/**
+ * @brief Destroy the session when the last file reference is dropped
+ *
+ * The mappings and the rings of the session hold a reference to the file,
+ * so they are already gone.
+*/
+static int device_release(struct inode *inode, struct file *file)
+{
+	ums_session_destroy(file->private_data);
+	file->private_data = NULL;
+
+	return SUCCESS;
+}
+
+/**
+ * @brief Fill the capabilities of the module
+ *
+ * @param[out] caps: capabilities to fill
+*/
+static void ums_get_caps(struct ums_caps *caps)
+{
+	memset(caps, 0, sizeof(struct ums_caps));
+
+	caps->abi_version = UMS_ABI_VERSION;
+	caps->caps = UMS_CAP_RING | UMS_CAP_SWITCH_TO | UMS_CAP_TRACEPOINTS |
+		     UMS_CAP_WORKER_PAGE | UMS_CAP_READY_RING |
+		     UMS_CAP_PARKED_EXEC | UMS_CAP_BLOCK_NOTIFY |
+		     UMS_CAP_PRIORITY | UMS_CAP_EDF | UMS_CAP_POLICY_OPS |
+		     UMS_CAP_SCHED_CPUS | UMS_CAP_IDLE_SPIN |
+		     UMS_CAP_TIME_SLICE | UMS_CAP_COMPLIST_FD |
+		     UMS_CAP_WAIT_TIMEOUT;
+	caps->dequeue_max = UMS_DEQUEUE_MAX;
+	caps->ring_max_entries = UMS_RING_MAX_ENTRIES;
+}
+
 /**
  * @brief ioctl function to enable comunication between user and kernel space
  *
  * This function carries the requests that arrive from userspace and pass them
- * to the correct modules
+ * to the correct modules.
+ * Every request has a fixed-size argument struct (see ums_device.h) which
+ * is copied on the stack, so no request allocates memory in this function.
+ *
+ * The identifiers are resolved in the session of the file (see
+ * ums_session.h).
  *
  * For details look at the modules and at the device codes in ums_device.h.
  *
+ * @return 0 (or the new file descriptor for UMS_REQUEST_RING_SETUP and
+ *	UMS_REQUEST_COMPLIST_FD) on success, -errno otherwise
+ *
  * @sa ums_device.h
+ * @sa device_ioctl
 */
-static long device_ioctl(struct file *file, unsigned int request, unsigned long data)
+static long __device_ioctl(struct file *file, unsigned int request, unsigned long data)
 {
-	printk(KERN_DEBUG MODULE_NAME_LOG
-	       "device_ioctl: pid->%d, path=%s, request=%u\n", current->pid,
-	       file->f_path.dentry->d_iname, request);
+	struct ums_session *session = file->private_data;
+	void __user *argp = (void __user *)data;
 
 	switch (request) {
-	case UMS_REQUEST_ENTER_UMS_SCHEDULING:
+	case UMS_REQUEST_GET_CAPS:
 	{
-		int err = 0;
-		int result = 0;
-		/* in case of a single parameter, we can get it directly from data */
-		ums_complist_id *in_buf, complist;
+		struct ums_caps caps;
 
-		in_buf = kmalloc(sizeof(ums_complist_id), GFP_KERNEL);
+		ums_get_caps(&caps);
 
-		if (copy_from_user(in_buf, (void*)data, sizeof(int)))
-			return FAILURE;
+		if (copy_to_user(argp, &caps, sizeof(caps)))
+			return -EFAULT;
+	}
+	break;
 
-		complist = *in_buf;
+	case UMS_REQUEST_ENTER_UMS_SCHEDULING:
+	{
+		int err;
+		struct ums_sched_args args;
 
-		kfree(in_buf);
+		if (copy_from_user(&args, argp, sizeof(args)))
+			return -EFAULT;
 
-		err = ums_sched_add(complist, &result);
+		err = ums_sched_add(session, args.complist_id, NULL, 0,
+				    &args.sched_id);
 
-		/* TODO: Use better errors */
 		if (err)
-			return FAILURE;
+			return err;
 			
-		if (copy_to_user((void*)data, &result, sizeof(int))) {
-			printk(KERN_ERR MODULE_NAME_LOG "ums_sched id copy_to_user failed!");
-			return FAILURE;
-		}
+		if (copy_to_user(argp, &args, sizeof(args)))
+			return -EFAULT;
+	}
+	break;
 
-		printk(KERN_INFO MODULE_NAME_LOG "ums_sched id copied to user\n");
+	case UMS_REQUEST_ENTER_UMS_SCHEDULING_CPUS:
+	{
+		int err;
+		struct ums_sched_cpus_args args;
+
+		if (copy_from_user(&args, argp, sizeof(args)))
+			return -EFAULT;
+
+		if (args.resv)
+			return -EINVAL;
+
+		err = ums_sched_add(session, args.complist_id,
+				    u64_to_user_ptr(args.cpus), args.cpus_size,
+				    &args.sched_id);
+
+		if (err)
+			return err;
+
+		if (copy_to_user(argp, &args, sizeof(args)))
+			return -EFAULT;
 	}
 	break;
 
 	case UMS_REQUEST_WAIT_UMS_SCHEDULER:
 	{
-		int err = 0;
-		ums_complist_id id = (ums_complist_id)data;
+		struct ums_sched_args args;
 
-		err = ums_sched_wait(id);
+		if (copy_from_user(&args, argp, sizeof(args)))
+			return -EFAULT;
 
-		if (err)
-			return FAILURE;
+		return ums_sched_wait(session, args.sched_id, -1);
+	}
+	break;
+
+	case UMS_REQUEST_WAIT:
+	{
+		struct ums_wait_args args;
 
-		printk(KERN_INFO MODULE_NAME_LOG "scheduler %d ended.\n", id);
+		if (copy_from_user(&args, argp, sizeof(args)))
+			return -EFAULT;
+
+		if (args.flags & ~UMS_WAIT_F_COMPLIST)
+			return -EINVAL;
+
+		if (args.flags & UMS_WAIT_F_COMPLIST)
+			return ums_complist_wait(session, args.id,
+						 args.timeout_ns);
+
+		return ums_sched_wait(session, args.id, args.timeout_ns);
 	}
 	break;
+
 	/* Required parameters:
 	 * ums_sched_id
 	 * task_struct (from current)
@@ -195,175 +285,326 @@ static long device_ioctl(struct file *file, unsigned int request, unsigned long
 	*/
 	case UMS_REQUEST_REGISTER_SCHEDULER_THREAD:
 	{
-		int err;
-		ums_sched_id* in_buf;
-
-		in_buf = kmalloc(sizeof(ums_sched_id), GFP_KERNEL);
-
-		if (copy_from_user(in_buf, (void*)data, sizeof(ums_sched_id))) {
-			kfree(in_buf);
-			printk("Failed copy_from_user\n");
-			return FAILURE;
-		}
-
-		printk(KERN_INFO MODULE_NAME_LOG "calling ums_sched_register_sched_thread.\n");
-		err = ums_sched_register_sched_thread(*in_buf);
-
-		if (err) {
-			printk(KERN_ERR MODULE_NAME_LOG "ums_sched_register_sched_thread failed\n");
-			kfree(in_buf);
-			return FAILURE;
-		}
-		
-		printk(KERN_INFO MODULE_NAME_LOG 
-		       "ums_sched %d, created new thread for cpu %d\n",
-		       *in_buf, get_cpu());
-
-		kfree(in_buf);
+		struct ums_sched_args args;
+
+		if (copy_from_user(&args, argp, sizeof(args)))
+			return -EFAULT;
+
+		return ums_sched_register_sched_thread(session, args.sched_id);
 	}
 	break;
 
 	case UMS_REQUEST_EXEC:
 	{
-		int err = 0;
+		struct ums_exec_args args;
 
-		printk(KERN_DEBUG MODULE_NAME_LOG "Calling exec\n");
+		if (copy_from_user(&args, argp, sizeof(args)))
+			return -EFAULT;
 
-		err = ums_sched_exec((ums_compelem_id)data);
+		if (args.flags & ~(UMS_EXEC_F_CLAIMED | UMS_EXEC_F_PARKED))
+			return -EINVAL;
 
-		if (err)
-			return FAILURE;
+		return ums_sched_exec(args.compelem_id, args.flags, 0);
+	}
+	break;
+
+	case UMS_REQUEST_EXEC_BUDGET:
+	{
+		struct ums_exec_budget_args args;
+
+		if (copy_from_user(&args, argp, sizeof(args)))
+			return -EFAULT;
+
+		if (args.flags & ~(UMS_EXEC_F_CLAIMED | UMS_EXEC_F_PARKED))
+			return -EINVAL;
+
+		return ums_sched_exec(args.compelem_id, args.flags,
+				      args.budget_ns);
 	}
 	break;
 
 	case UMS_REQUEST_YIELD:
+		return ums_sched_yield();
+
+	case UMS_REQUEST_PREEMPT_YIELD:
+		return ums_sched_preempt_yield();
+
+	case UMS_REQUEST_STANDBY:
 	{
-		printk(KERN_DEBUG MODULE_NAME_LOG "Calling yield\n");
+		struct ums_sched_args args;
+
+		if (copy_from_user(&args, argp, sizeof(args)))
+			return -EFAULT;
 
-		if (ums_sched_yield()) {
-			printk(KERN_ERR MODULE_NAME_LOG "yield failed!\n");
-			return FAILURE;
-		}
+		return ums_sched_standby(session, args.sched_id);
 	}
 	break;
 
-	case UMS_REQUEST_NEW_COMPLETION_LIST:
+	case UMS_REQUEST_BLOCKED_PARK:
+		return ums_sched_blocked_park(session);
+
+	case UMS_REQUEST_SWITCH_TO:
 	{
-		int err = 0;
-		int result = 0;
+		struct ums_exec_args args;
 
-		printk(KERN_DEBUG MODULE_NAME_LOG "Calling ums_complist_add...\n");
+		if (copy_from_user(&args, argp, sizeof(args)))
+			return -EFAULT;
 
-		err = ums_complist_add(&result);
+		if (args.flags)
+			return -EINVAL;
 
-		/* TODO: Use better errors */
-		if (err) {
-			printk(KERN_ERR MODULE_NAME_LOG "Error %d in ums_complist_add\n", err);
-			return FAILURE;
-		}
+		return ums_sched_switch_to(args.compelem_id);
+	}
+	break;
+
+	case UMS_REQUEST_NEW_COMPLETION_LIST:
+	{
+		int err;
+		struct ums_complist_args args = { 0 };
 
-		printk(KERN_INFO MODULE_NAME_LOG "ums completion list entry %d created.\n", result);
+		err = ums_complist_add(session, &args.complist_id);
 
-		if (copy_to_user((void*)data, &result, sizeof(int))) {
-			printk(KERN_ERR MODULE_NAME_LOG "copy_to_user failed!\n");
-			return FAILURE;
-		}
-		printk(KERN_INFO MODULE_NAME_LOG "ums_completion_list id copied to user\n");
+		if (err)
+			return err;
 
+		if (copy_to_user(argp, &args, sizeof(args)))
+			return -EFAULT;
 	}
 	break;
 
 	case UMS_REQUEST_REGISTER_COMPLETION_ELEM:
 	{
-		int err = 0;
-		int result = 0;
-		int *in_buf;
+		struct ums_compelem_args args;
+		struct ums_compelem_args __user *uargs = argp;
+		ums_compelem_id result;
 
+		if (copy_from_user(&args, argp, sizeof(args)))
+			return -EFAULT;
 
-		in_buf = kmalloc(sizeof(int), GFP_KERNEL);
+		/* the new id is copied to the user before sleeping */
+		return ums_compelem_add(session, &result, args.complist_id,
+					UMS_PRIO_NORMAL, 0,
+					&uargs->compelem_id);
+	}
+	break;
 
-		if (copy_from_user(in_buf, (void*)data, sizeof(int)))
-			return FAILURE;
+	case UMS_REQUEST_REGISTER_COMPLETION_ELEM_PRIO:
+	{
+		struct ums_compelem_prio_args args;
+		struct ums_compelem_prio_args __user *uargs = argp;
+		ums_compelem_id result;
 
+		if (copy_from_user(&args, argp, sizeof(args)))
+			return -EFAULT;
 
-		printk(KERN_DEBUG MODULE_NAME_LOG "Calling ums_compelem_add...\n");
-		err = ums_compelem_add(&result, *in_buf, (void *)data);
+		if (args.resv)
+			return -EINVAL;
 
-		kfree(in_buf);
-		if (err) {
-			printk(KERN_ERR MODULE_NAME_LOG "ums_compelem_add failed!\n");
-			return FAILURE;
-		}
+		return ums_compelem_add(session, &result, args.complist_id,
+					args.prio, args.deadline,
+					&uargs->compelem_id);
+	}
+	break;
 
-		printk(KERN_INFO MODULE_NAME_LOG "ums completion elem entry %d created.\n", result);
+	case UMS_REQUEST_SET_PRIORITY:
+	{
+		struct ums_compelem_prio_args args;
+
+		if (copy_from_user(&args, argp, sizeof(args)))
+			return -EFAULT;
+
+		if (args.resv)
+			return -EINVAL;
 
+		return ums_compelem_set_prio(session, args.compelem_id,
+					     args.prio);
 	}
 	break;
 
-	case UMS_REQUEST_REMOVE_COMPLETION_ELEM:
+	case UMS_REQUEST_SET_DEADLINE:
 	{
-		int err = 0;
+		struct ums_compelem_prio_args args;
 
-		printk(KERN_DEBUG MODULE_NAME_LOG "Calling ums_compelem_remove\n...");
+		if (copy_from_user(&args, argp, sizeof(args)))
+			return -EFAULT;
 
-		/* TODO: do not use params */
-		err = ums_compelem_remove((int)data);
+		if (args.resv)
+			return -EINVAL;
 
-		if (err)
-			return FAILURE;
+		return ums_compelem_set_deadline(session, args.compelem_id,
+						 args.deadline);
+	}
+	break;
+
+	case UMS_REQUEST_SET_COMPLIST_POLICY:
+	{
+		struct ums_complist_policy_args args;
+
+		if (copy_from_user(&args, argp, sizeof(args)))
+			return -EFAULT;
+
+		if (args.resv)
+			return -EINVAL;
 
-		printk(KERN_INFO MODULE_NAME_LOG "ums completion elem entry %d removed.\n",
-		       (int)data);
+		return ums_complist_set_policy(session, args.complist_id,
+					       args.policy, args.flags);
 	}
 	break;
 
-	case UMS_REQUEST_DEQUEUE_COMPLETION_LIST:
+	case UMS_REQUEST_SET_COMPLIST_IDLE:
 	{
-		int err = 0;
-		int num_elems, ret_size;
-		ums_complist_id comp_id, *ret_array;
+		struct ums_complist_idle_args args;
 
-		if (copy_from_user(&num_elems, (void*)data, sizeof(int)))
-			goto ums_dequeue_fail;
+		if (copy_from_user(&args, argp, sizeof(args)))
+			return -EFAULT;
 
-		if (num_elems < 0 || num_elems > DEQUEUE_ELEM_MAX)
-			goto ums_dequeue_fail;
-		
-		ret_array = kmalloc(sizeof(int) * (num_elems + 1), GFP_KERNEL);
+		if (args.resv)
+			return -EINVAL;
 
-		ums_sched_complist_by_current(&comp_id);
+		return ums_complist_set_idle(session, args.complist_id,
+					     args.spin_ns);
+	}
+	break;
+
+	case UMS_REQUEST_SET_TIME_SLICE:
+	{
+		struct ums_complist_slice_args args;
 
-		err = ums_complist_reserve(comp_id, num_elems,
-					   ret_array, &ret_size);
+		if (copy_from_user(&args, argp, sizeof(args)))
+			return -EFAULT;
 
-		*(ret_array + ret_size) = *ret_array;
-		*ret_array = ret_size;
+		if (args.resv)
+			return -EINVAL;
+
+		return ums_complist_set_time_slice(session, args.complist_id,
+						   args.slice_ns);
+	}
+	break;
+
+	case UMS_REQUEST_REMOVE_COMPLETION_ELEM:
+	{
+		struct ums_compelem_args args;
+
+		if (copy_from_user(&args, argp, sizeof(args)))
+			return -EFAULT;
+
+		return ums_compelem_remove(session, args.compelem_id);
+	}
+	break;
+
+	case UMS_REQUEST_DEQUEUE_COMPLETION_LIST:
+	case UMS_REQUEST_TRY_DEQUEUE_COMPLETION_LIST:
+	{
+		int err, size;
+		struct ums_dequeue_args args;
+		ums_compelem_id elems[UMS_DEQUEUE_MAX];
+
+		if (copy_from_user(&args, argp, sizeof(args)))
+			return -EFAULT;
+
+		if (! args.max_elements)
+			return -EINVAL;
+
+		args.max_elements = min_t(u32, args.max_elements, UMS_DEQUEUE_MAX);
+
+		err = ums_sched_dequeue(args.max_elements, elems, &size,
+					request == UMS_REQUEST_DEQUEUE_COMPLETION_LIST);
 
 		if (err)
-			goto ums_dequeue_fail;
+			return err;
 
-		if (copy_to_user((void*) data, ret_array,
-			         sizeof(int)*(ret_size+1))) {
-			goto ums_dequeue_fail;
-		}
+		args.count = size;
 
-		/* break means success in this case */
-		goto ums_dequeue_end;
+		if (copy_to_user(u64_to_user_ptr(args.elements), elems,
+				 sizeof(ums_compelem_id) * size))
+			return -EFAULT;
 
-ums_dequeue_fail:
-		err = FAILURE;
+		if (put_user(args.count,
+			     &((struct ums_dequeue_args __user *)argp)->count))
+			return -EFAULT;
+	}
+	break;
 
-ums_dequeue_end:
-		if (ret_array)
-			kfree(ret_array);
+	case UMS_REQUEST_READY_RING_SETUP:
+	{
+		int err;
+		struct ums_ready_ring_args args;
+
+		if (copy_from_user(&args, argp, sizeof(args)))
+			return -EFAULT;
+
+		err = ums_complist_ready_ring_setup(session, &args);
 
 		if (err)
-			return FAILURE;
+			return err;
+
+		if (copy_to_user(argp, &args, sizeof(args)))
+			return -EFAULT;
+	}
+	break;
+
+	case UMS_REQUEST_RING_SETUP:
+		/* the params are copied back before the fd is installed */
+		return ums_ring_create(file, argp);
+	break;
+
+	case UMS_REQUEST_COMPLIST_FD:
+	{
+		struct ums_complist_args args;
+
+		if (copy_from_user(&args, argp, sizeof(args)))
+			return -EFAULT;
+
+		if (args.resv)
+			return -EINVAL;
+
+		return ums_complist_fd(file, args.complist_id);
 	}
 	break;
 
-	default: return FAILURE;
+	default: return -ENOTTY;
 	}
 
 	return SUCCESS;
 }
+
+/**
+ * @brief ioctl function of the device
+ *
+ * The request runs with the block notifier of current disarmed, see
+ * ums_sched_kernel_enter.
+ *
+ * @sa __device_ioctl
+*/
+static long device_ioctl(struct file *file, unsigned int request, unsigned long data)
+{
+	long res;
+
+	ums_sched_kernel_enter();
+	res = __device_ioctl(file, request, data);
+	ums_sched_kernel_exit();
+
+	return res;
+}
+
+/**
+ * @brief mmap function of the device, it dispatches on the offset
+ *
+ * @sa UMS_MMAP_WORKER_PAGE
+ * @sa UMS_MMAP_READY_RING
+*/
+static int device_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct ums_session *session = file->private_data;
+	u64 offset = (u64)vma->vm_pgoff << PAGE_SHIFT;
+
+	if (offset == UMS_MMAP_WORKER_PAGE)
+		return ums_sched_worker_mmap(vma);
+
+	/* the ready rings use the upper 32 bits for the complist id */
+	if (! lower_32_bits(offset))
+		return ums_complist_ready_ring_mmap(session,
+						    upper_32_bits(offset), vma);
+
+	return -EINVAL;
+}
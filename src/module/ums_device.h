@@ -6,73 +6,468 @@
  * @brief Public header of the module
  *
  * This header contains the requests and it is public also for user-space
- * programs
+ * programs.
+ *
+ * Every request is a proper ioctl encoding (_IO/_IOR/_IOW/_IOWR) of a
+ * fixed-size argument struct, so the module copies the arguments on its
+ * stack with a single copy_from_user. The requests return 0 (or a non
+ * negative value when documented) on success and -errno otherwise, i.e.
+ * ioctl returns -1 and sets errno.
+ *
+ * The ABI is versioned: user space should check UMS_REQUEST_GET_CAPS before
+ * using optional features. New features add new capabilities and new
+ * requests, the existing request encodings never change.
 */
 #ifndef __UMS_DEVICE_H__
 #define __UMS_DEVICE_H__
 
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
 /**
- * @brief Request for registering an new scheduler
+ * @brief Version of the ioctl ABI described in this file
+*/
+#define UMS_ABI_VERSION 1
+
+/**
+ * @brief ioctl type of the ums requests
+*/
+#define UMS_IOCTL_MAGIC 'u'
+
+/**
+ * @brief Maximum number of elements reserved by a single dequeue request
+*/
+#define UMS_DEQUEUE_MAX 64
+
+/** @brief The submission/completion ring is available */
+#define UMS_CAP_RING (1U << 0)
+
+/** @brief UMS_REQUEST_SWITCH_TO is available */
+#define UMS_CAP_SWITCH_TO (1U << 1)
+
+/** @brief The module exposes the `ums` tracepoints */
+#define UMS_CAP_TRACEPOINTS (1U << 2)
+
+/** @brief The worker control page can be mapped (UMS_MMAP_WORKER_PAGE) */
+#define UMS_CAP_WORKER_PAGE (1U << 3)
+
+/** @brief Completion lists can publish a ready ring (UMS_MMAP_READY_RING) */
+#define UMS_CAP_READY_RING (1U << 4)
+
+/** @brief The exec request accepts UMS_EXEC_F_PARKED */
+#define UMS_CAP_PARKED_EXEC (1U << 5)
+
+/** @brief Blocked completion elements are notified (UMS_REQUEST_STANDBY) */
+#define UMS_CAP_BLOCK_NOTIFY (1U << 6)
+
+/** @brief Completion elements have a priority (UMS_REQUEST_SET_PRIORITY) */
+#define UMS_CAP_PRIORITY (1U << 7)
+
+/** @brief Priority of the latency-critical completion elements */
+#define UMS_PRIO_HIGH 0
+
+/** @brief Default priority of the completion elements */
+#define UMS_PRIO_NORMAL 1
+
+/** @brief Priority of the background completion elements */
+#define UMS_PRIO_BACKGROUND 2
+
+/**
+ * @brief Number of priority levels, a lower value is a higher priority
+ *
+ * A completion list always hands out a ready element of the highest
+ * priority level that has ready elements.
+*/
+#define UMS_PRIO_LEVELS 3
+
+/** @brief Completion lists can schedule by deadline (UMS_POLICY_EDF) */
+#define UMS_CAP_EDF (1U << 8)
+
+/**
+ * @brief Default policy of a completion list: the ready elements are handed
+ * out by priority level, FIFO within a level
+*/
+#define UMS_POLICY_FIFO 0
+
+/**
+ * @brief Earliest deadline first: the ready elements are handed out by
+ * deadline, the ones without a deadline go last (FIFO among equal
+ * deadlines). The priorities are ignored.
+*/
+#define UMS_POLICY_EDF 1
+
+/**
+ * @brief Last in first out: the most recently ready elements are handed out
+ * first, an element that yields goes after the others of its level
+*/
+#define UMS_POLICY_LIFO 2
+
+/**
+ * @brief Round robin: FIFO within a level, but every pick starts from the
+ * queue of a different CPU, so the elements made ready on all the CPUs are
+ * served in turn (the other policies serve the local CPU first)
+*/
+#define UMS_POLICY_RR 3
+
+/** @brief Number of completion list policies */
+#define UMS_POLICY_COUNT 4
+
+/**
+ * @brief The yield of an element switches directly to the next ready
+ * element picked by the policy: the entry point runs only when no element
+ * is ready
+*/
+#define UMS_POLICY_F_KERNEL_DISPATCH (1U << 0)
+
+/** @brief UMS_POLICY_LIFO, UMS_POLICY_RR and kernel dispatch are available */
+#define UMS_CAP_POLICY_OPS (1U << 9)
+
+/** @brief Schedulers can run on a subset of the CPUs
+ * (UMS_REQUEST_ENTER_UMS_SCHEDULING_CPUS) */
+#define UMS_CAP_SCHED_CPUS (1U << 10)
+
+/** @brief Idle reservers spin before sleeping
+ * (UMS_REQUEST_SET_COMPLIST_IDLE) */
+#define UMS_CAP_IDLE_SPIN (1U << 11)
+
+/** @brief Completion elements can be preempted at the end of a time slice
+ * (UMS_REQUEST_SET_TIME_SLICE, UMS_REQUEST_EXEC_BUDGET) */
+#define UMS_CAP_TIME_SLICE (1U << 12)
+
+/** @brief Completion lists can be polled (UMS_REQUEST_COMPLIST_FD) and
+ * dequeued without sleeping (UMS_REQUEST_TRY_DEQUEUE_COMPLETION_LIST) */
+#define UMS_CAP_COMPLIST_FD (1U << 13)
+
+/** @brief Schedulers and completion lists can be waited with a timeout
+ * (UMS_REQUEST_WAIT) */
+#define UMS_CAP_WAIT_TIMEOUT (1U << 14)
+
+/** @brief The identifier of ums_wait_args is a completion list */
+#define UMS_WAIT_F_COMPLIST (1U << 0)
+
+/** @brief Spin budget of a new completion list in ns */
+#define UMS_IDLE_SPIN_DEFAULT_NS 20000ULL
+
+/** @brief Maximum spin budget in ns */
+#define UMS_IDLE_SPIN_MAX_NS 1000000ULL
+
+/**
+ * @brief Positive result of the exec request when the executed completion
+ * element blocked in the kernel
  *
- * The ioctl call creates a new scheduler (without worker threads) and
- * then return through the buffer its identifier. It requires as input
- * parameter the pointer to an existing completion list.
+ * @sa UMS_REQUEST_STANDBY
+*/
+#define UMS_EXEC_BLOCKED 1
+
+/**
+ * @brief Signal sent to a scheduler thread that blocked in a completion
+ * element when it wakes up
+ *
+ * The handler must call UMS_REQUEST_BLOCKED_PARK.
+ *
+ * @sa UMS_REQUEST_STANDBY
+*/
+#define UMS_SIGNAL_BLOCKED 40
+
+/**
+ * @brief Signal sent to a scheduler thread whose completion element used up
+ * its time slice
+ *
+ * The handler must call UMS_REQUEST_PREEMPT_YIELD. It must not block the
+ * signal while it runs (SA_NODEFER): the entry point inherits the signal
+ * mask of the handler.
+ *
+ * @sa UMS_REQUEST_SET_TIME_SLICE
+*/
+#define UMS_SIGNAL_PREEMPT 41
+
+/**
+ * @brief Maximum number of entries of a ready ring
+*/
+#define UMS_READY_RING_MAX_ENTRIES 65536
+
+/**
+ * @brief The executed element was claimed from the ready ring
+ *
+ * @sa ums_exec_args
+ * @sa UMS_REQUEST_READY_RING_SETUP
+*/
+#define UMS_EXEC_F_CLAIMED (1U << 0)
+
+/**
+ * @brief The completion element last executed by the calling scheduler
+ * thread was parked in user space
  *
- * @note assumes user buffer at list sizeof(int)
+ * User space libraries may switch between the completion elements of a
+ * list without the module (all of them share the same mm): a yielding
+ * element saves its registers in user memory and jumps back to the entry
+ * point. Its registers in the module are then stale, so the next exec of
+ * the scheduler thread carries this flag and the module detaches the
+ * element without storing the registers. A parked element is no longer
+ * executed by the module, it can only be resumed by user space.
+ *
+ * @sa ums_exec_args
+*/
+#define UMS_EXEC_F_PARKED (1U << 1)
+
+/**
+ * @struct ums_caps
+ *
+ * @brief Result of UMS_REQUEST_GET_CAPS
+*/
+struct ums_caps {
+	/** UMS_ABI_VERSION of the module */
+	__u32 abi_version;
+	/** UMS_CAP_* bits */
+	__u32 caps;
+	/** maximum number of elements of a single dequeue request */
+	__u32 dequeue_max;
+	/** maximum number of submission entries of a ring */
+	__u32 ring_max_entries;
+};
+
+/**
+ * @struct ums_sched_args
+ *
+ * @brief Argument of the scheduler requests
+*/
+struct ums_sched_args {
+	/** completion list linked to the scheduler */
+	__s32 complist_id;
+	/** scheduler identifier */
+	__s32 sched_id;
+};
+
+/**
+ * @struct ums_sched_cpus_args
+ *
+ * @brief Argument of UMS_REQUEST_ENTER_UMS_SCHEDULING_CPUS
+*/
+struct ums_sched_cpus_args {
+	/** completion list linked to the scheduler */
+	__s32 complist_id;
+	/** out: scheduler identifier */
+	__s32 sched_id;
+	/** user pointer to the CPU bitmap (e.g. a cpu_set_t), 0 for the
+	 * affinity of the caller */
+	__u64 cpus;
+	/** size in bytes of the bitmap */
+	__u32 cpus_size;
+	__u32 resv;
+};
+
+/**
+ * @struct ums_wait_args
+ *
+ * @brief Argument of UMS_REQUEST_WAIT
+*/
+struct ums_wait_args {
+	/** scheduler, or completion list with UMS_WAIT_F_COMPLIST */
+	__s32 id;
+	/** UMS_WAIT_F_* flags */
+	__u32 flags;
+	/** maximum wait in ns, negative to wait forever */
+	__s64 timeout_ns;
+};
+
+/**
+ * @struct ums_complist_args
+ *
+ * @brief Argument of the completion list requests
+*/
+struct ums_complist_args {
+	/** completion list identifier */
+	__s32 complist_id;
+	__u32 resv;
+};
+
+/**
+ * @struct ums_complist_policy_args
+ *
+ * @brief Argument of UMS_REQUEST_SET_COMPLIST_POLICY
+*/
+struct ums_complist_policy_args {
+	/** completion list identifier */
+	__s32 complist_id;
+	/** one of the UMS_POLICY_* values */
+	__u32 policy;
+	/** UMS_POLICY_F_* flags */
+	__u32 flags;
+	__u32 resv;
+};
+
+/**
+ * @struct ums_complist_idle_args
+ *
+ * @brief Argument of UMS_REQUEST_SET_COMPLIST_IDLE
+*/
+struct ums_complist_idle_args {
+	/** completion list identifier */
+	__s32 complist_id;
+	__u32 resv;
+	/** spin budget in ns (at most UMS_IDLE_SPIN_MAX_NS), 0 to always
+	 * sleep */
+	__u64 spin_ns;
+};
+
+/**
+ * @struct ums_complist_slice_args
+ *
+ * @brief Argument of UMS_REQUEST_SET_TIME_SLICE
+*/
+struct ums_complist_slice_args {
+	/** completion list identifier */
+	__s32 complist_id;
+	__u32 resv;
+	/** time slice in ns, 0 for none */
+	__u64 slice_ns;
+};
+
+/**
+ * @struct ums_compelem_args
+ *
+ * @brief Argument of the completion element requests
+*/
+struct ums_compelem_args {
+	/** completion list that owns the element */
+	__s32 complist_id;
+	/** completion element identifier */
+	__s32 compelem_id;
+};
+
+/**
+ * @struct ums_compelem_prio_args
+ *
+ * @brief Argument of the completion element priority requests
+ *
+ * @sa UMS_REQUEST_REGISTER_COMPLETION_ELEM_PRIO
+ * @sa UMS_REQUEST_SET_PRIORITY
+*/
+struct ums_compelem_prio_args {
+	/** completion list that owns the element */
+	__s32 complist_id;
+	/** completion element identifier */
+	__s32 compelem_id;
+	/** one of the UMS_PRIO_* values */
+	__s32 prio;
+	__u32 resv;
+	/** absolute deadline in ns (CLOCK_MONOTONIC), 0 for none. Used by
+	 * the UMS_POLICY_EDF completion lists */
+	__u64 deadline;
+};
+
+/**
+ * @struct ums_exec_args
+ *
+ * @brief Argument of the requests that switch to a completion element
+*/
+struct ums_exec_args {
+	/** completion element to execute */
+	__s32 compelem_id;
+	/** UMS_EXEC_F_* flags (exec only, must be 0 for switch to) */
+	__u32 flags;
+};
+
+/**
+ * @struct ums_exec_budget_args
+ *
+ * @brief Argument of UMS_REQUEST_EXEC_BUDGET
+*/
+struct ums_exec_budget_args {
+	/** completion element to execute */
+	__s32 compelem_id;
+	/** UMS_EXEC_F_* flags */
+	__u32 flags;
+	/** time slice of this execution in ns, 0 for the one of the list */
+	__u64 budget_ns;
+};
+
+/**
+ * @struct ums_dequeue_args
+ *
+ * @brief Argument of UMS_REQUEST_DEQUEUE_COMPLETION_LIST
+*/
+struct ums_dequeue_args {
+	/** in: maximum number of elements (at most UMS_DEQUEUE_MAX) */
+	__u32 max_elements;
+	/** out: number of reserved elements */
+	__u32 count;
+	/** in: user pointer to an array of max_elements __s32 */
+	__u64 elements;
+};
+
+/**
+ * @brief Get the ABI version and the capabilities of the module
+ *
+ * @sa ums_caps
+*/
+#define UMS_REQUEST_GET_CAPS \
+	_IOR(UMS_IOCTL_MAGIC, 0, struct ums_caps)
+
+/**
+ * @brief Request for registering an new scheduler
+ *
+ * The ioctl call creates a new scheduler (without worker threads) linked to
+ * the existing completion list complist_id and then returns its identifier
+ * in sched_id. The scheduler has a worker for each CPU of the affinity of
+ * the caller.
  *
  * @note Expect the same thread group id of the completion list
 */
-#define UMS_REQUEST_ENTER_UMS_SCHEDULING 1
+#define UMS_REQUEST_ENTER_UMS_SCHEDULING \
+	_IOWR(UMS_IOCTL_MAGIC, 1, struct ums_sched_args)
 
 /**
  * @brief Register a new scheduler thread for a ums scheduler
  *
  * This ioctl call register the current thread as the scheduler thread for the
- * CPU i (current CPU).
+ * CPU i (current CPU) of the scheduler sched_id.
  *
  * @warning This call assumes that the thread is register ONLY for one CPU
- *
- * @note Expect to get a direct value of the scheduler id (not the pointer to it)
 */
-#define UMS_REQUEST_REGISTER_SCHEDULER_THREAD 3
+#define UMS_REQUEST_REGISTER_SCHEDULER_THREAD \
+	_IOW(UMS_IOCTL_MAGIC, 3, struct ums_sched_args)
 
 /**
  * @brief Register a new completion list. 
  *
  * The ioctl call creates a new empty completion list and
- * then return through the buffer its identifier
- *
- * @note assume user buffer at list sizeof(int)
+ * then return its identifier in complist_id
 */
-#define UMS_REQUEST_NEW_COMPLETION_LIST 4
+#define UMS_REQUEST_NEW_COMPLETION_LIST \
+	_IOR(UMS_IOCTL_MAGIC, 4, struct ums_complist_args)
 
 /**
  * @brief Register a new completion element using current 
  *
- * The ioctl call creates a new completion element to by attached to its complist
- * (specified in the buffer), then triggers copy_to_user to store the compelem
- * id (that will be used by a switched scheduler thread) and then block
+ * The ioctl call creates a new completion element to by attached to the
+ * completion list complist_id, stores the compelem id in compelem_id
+ * (that will be used by a switched scheduler thread) and then block
  * until the deletion of the completion element is performed.
  *
- * @note assume user buffer at list sizeof(int)
- *
  * @note Freeze the calling thread until the delete is called
  *
  * @note Expect the same tgid of the completion list
 */
-#define UMS_REQUEST_REGISTER_COMPLETION_ELEM 5
+#define UMS_REQUEST_REGISTER_COMPLETION_ELEM \
+	_IOWR(UMS_IOCTL_MAGIC, 5, struct ums_compelem_args)
 
 /**
- * @brief Remove a completion element freeing its original thread
+ * @brief Remove the completion element compelem_id freeing its original thread
  *
  * @note Can be called only by the current executor (i.e. it must be in the
  * codeflow of the completion list)
- *
- * @note pass the completion element directly as an integer value (not pointer)
 */
-#define UMS_REQUEST_REMOVE_COMPLETION_ELEM 7
+#define UMS_REQUEST_REMOVE_COMPLETION_ELEM \
+	_IOW(UMS_IOCTL_MAGIC, 7, struct ums_compelem_args)
 
-#define UMS_REQUEST_WAIT_UMS_SCHEDULER 8
+/**
+ * @brief Block the caller until the scheduler sched_id gets destroyed
+ *
+ * Same as UMS_REQUEST_WAIT without timeout.
+*/
+#define UMS_REQUEST_WAIT_UMS_SCHEDULER \
+	_IOW(UMS_IOCTL_MAGIC, 8, struct ums_sched_args)
 
 /**
  * @brief Yields a work and return to the scheduler thread previous status
@@ -83,48 +478,475 @@
  * thread interrupted its execution at line x to switch to a worker, then
  * he will return to line x.
 */
-#define UMS_REQUEST_YIELD 9
+#define UMS_REQUEST_YIELD \
+	_IO(UMS_IOCTL_MAGIC, 9)
 
 /**
- * @brief Execute a completion element
+ * @brief Execute the completion element compelem_id
  * 
  * @note The thread must have already registered it
  *
- * @note pass directly the int value of the compelem to be executed
+ * @note Returns UMS_EXEC_BLOCKED in the entry point when the element blocked
+ *	and a standby thread took over (see UMS_REQUEST_STANDBY).
 */
-#define UMS_REQUEST_EXEC 10
+#define UMS_REQUEST_EXEC \
+	_IOW(UMS_IOCTL_MAGIC, 10, struct ums_exec_args)
 
 /**
- * @brief Dequeue a completion list with at-most n elements
+ * @brief Dequeue a completion list with at-most max_elements elements
  *
- * To trigger the dequeue the user must specify the number of elements that
- * he wants (in the buffer), obviously the memory that the request expect from
- * the user buffer is (n + 1) integers.
+ * The reserved element identifiers are copied in the user array elements
+ * and their number in count.
  *
- * A setup to prepare the call is the following:
  * @code
- * int num = 10;
- * int *buff;
+ * ums_compelem_id elems[8];
+ * struct ums_dequeue_args args = {
+ *	.max_elements = 8,
+ *	.elements = (__u64)(uintptr_t)elems,
+ * };
  *
- * buff = malloc(sizeof(int) * (num + 1));
+ * ioctl(fd, UMS_REQUEST_DEQUEUE_COMPLETION_LIST, &args);
+ * @endcode
  *
- * if (buff)
- *	ioctl(fd, UMS_REQUEST_DEQUEUE_COMPLETION_LIST, buff);
+ * This call has the al least one semantic, which means that count is always 
+ * >= 1 (for obvious reasons also <= max_elements). max_elements is bounded
+ * by UMS_DEQUEUE_MAX.
+*/
+#define UMS_REQUEST_DEQUEUE_COMPLETION_LIST \
+	_IOWR(UMS_IOCTL_MAGIC, 11, struct ums_dequeue_args)
+
+/**
+ * @brief Pass from the running completion element to a ready one
+ *
+ * The running completion element is stored and put back in the ready queue
+ * while the target element compelem_id is executed, without returning to the
+ * scheduler thread context.
+ *
+ * @note Can be called only by a running completion element
+ *
+ * @note The target must be a ready element of the same completion list
+*/
+#define UMS_REQUEST_SWITCH_TO \
+	_IOW(UMS_IOCTL_MAGIC, 13, struct ums_exec_args)
+
+/**
+ * @struct ums_ready_ring_args
+ *
+ * @brief Argument of UMS_REQUEST_READY_RING_SETUP
+*/
+struct ums_ready_ring_args {
+	/** in: completion list that publishes the ring */
+	__s32 complist_id;
+	/** in: requested entries, out: entries (power of 2) */
+	__u32 entries;
+	/** out: offset of the id array in the mapped memory */
+	__u32 ids_off;
+	/** out: size of the memory to map */
+	__u32 ring_size;
+};
+
+/**
+ * @struct ums_ready_ring_hdr
+ *
+ * @brief Header of the ready ring of a completion list
+ *
+ * The module appends the ready completion elements (ids) at tail, the
+ * scheduler threads claim them by moving head forward with a compare and
+ * swap, then they execute the claimed element with UMS_EXEC_F_CLAIMED:
+ *
+ * @code
+ * do {
+ *	head = load_acquire(&hdr->head);
+ *	if (head == load_acquire(&hdr->tail))
+ *		break;		// empty: fall back to the dequeue request
+ *	id = ids[head & hdr->mask];
+ * } while (! cas(&hdr->head, head, head + 1));
+ * @endcode
+*/
+struct ums_ready_ring_hdr {
+	/** next entry to claim, moved by the consumers */
+	__u32 head;
+	/** next entry to publish, moved by the module only */
+	__u32 tail;
+	/** entries - 1 */
+	__u32 mask;
+	/** number of entries */
+	__u32 entries;
+};
+
+/**
+ * @brief Publish the ready elements of a completion list in a ring
+ *
+ * The ring is mapped with UMS_MMAP_READY_RING(complist_id) by any thread of
+ * the process that owns the completion list. A ready element is published
+ * in the ring when it has free entries and no scheduler thread is blocked
+ * on the dequeue request; otherwise it follows the usual dequeue path.
+ * Hence when the ring is empty the threads must fall back to
+ * UMS_REQUEST_DEQUEUE_COMPLETION_LIST.
+ *
+ * @note The ring can be set up once per completion list
+ *
+ * @sa ums_ready_ring_hdr
+*/
+#define UMS_REQUEST_READY_RING_SETUP \
+	_IOWR(UMS_IOCTL_MAGIC, 15, struct ums_ready_ring_args)
+
+/**
+ * @brief Register the calling thread as standby of a scheduler thread
+ *
+ * The calling thread must be pinned to the CPU of the scheduler thread. It
+ * sleeps until the scheduler thread blocks in the kernel while it runs a
+ * completion element: then it takes over the scheduler thread, i.e. it
+ * returns to the entry point from the last exec with UMS_EXEC_BLOCKED.
+ *
+ * The thread that blocked receives UMS_SIGNAL_BLOCKED when it wakes up: its
+ * handler calls UMS_REQUEST_BLOCKED_PARK, which puts the completion element
+ * back in the ready queue of its list (it resumes in the handler) and makes
+ * the thread a standby itself.
+ *
+ * @note The signal handler must be installed before any standby thread
+ *	is registered.
+*/
+#define UMS_REQUEST_STANDBY \
+	_IOW(UMS_IOCTL_MAGIC, 16, struct ums_sched_args)
+
+/**
+ * @brief Park the blocked completion element and become a standby
+ *
+ * @sa UMS_REQUEST_STANDBY
+*/
+#define UMS_REQUEST_BLOCKED_PARK \
+	_IO(UMS_IOCTL_MAGIC, 17)
+
+/**
+ * @brief Register a new completion element with priority prio
+ *
+ * Same as UMS_REQUEST_REGISTER_COMPLETION_ELEM (which uses UMS_PRIO_NORMAL).
+*/
+#define UMS_REQUEST_REGISTER_COMPLETION_ELEM_PRIO \
+	_IOWR(UMS_IOCTL_MAGIC, 18, struct ums_compelem_prio_args)
+
+/**
+ * @brief Change the priority of the completion element compelem_id
+ *
+ * The caller must share the memory map of the completion list. A ready
+ * element is moved to the new priority level right away, otherwise the
+ * priority applies from the next time it becomes ready (complist_id is
+ * ignored).
+*/
+#define UMS_REQUEST_SET_PRIORITY \
+	_IOW(UMS_IOCTL_MAGIC, 19, struct ums_compelem_prio_args)
+
+/**
+ * @brief Set the policy of the completion list complist_id
+ *
+ * The policy (and its UMS_POLICY_F_* flags) can be changed only while the
+ * completion list has no elements, i.e. right after
+ * UMS_REQUEST_NEW_COMPLETION_LIST.
+*/
+#define UMS_REQUEST_SET_COMPLIST_POLICY \
+	_IOW(UMS_IOCTL_MAGIC, 20, struct ums_complist_policy_args)
+
+/**
+ * @brief Change the deadline of the completion element compelem_id
+ *
+ * A running element usually sets the deadline of its next job and then
+ * yields: it is queued again by the new deadline. The deadline misses are
+ * counted in the `info` proc file of the completion list (complist_id and
+ * prio are ignored).
+*/
+#define UMS_REQUEST_SET_DEADLINE \
+	_IOW(UMS_IOCTL_MAGIC, 21, struct ums_compelem_prio_args)
+
+/**
+ * @brief Register a new scheduler with workers only on the CPUs in cpus
+ *
+ * Same as UMS_REQUEST_ENTER_UMS_SCHEDULING. The CPUs that are not possible
+ * are ignored, a scheduler thread can register only on a CPU of the set
+ * (-EINVAL otherwise).
+*/
+#define UMS_REQUEST_ENTER_UMS_SCHEDULING_CPUS \
+	_IOWR(UMS_IOCTL_MAGIC, 22, struct ums_sched_cpus_args)
+
+/**
+ * @brief Set the spin budget of the idle reservers of complist_id
+ *
+ * A dequeue that finds no ready element spins for a while before sleeping.
+ * The spin lasts twice the average gap between two ready elements, at most
+ * spin_ns, and it is skipped when the elements arrive less often than
+ * that. The budget can be changed at any time.
+*/
+#define UMS_REQUEST_SET_COMPLIST_IDLE \
+	_IOW(UMS_IOCTL_MAGIC, 23, struct ums_complist_idle_args)
+
+/**
+ * @brief Set the time slice of the elements of complist_id
+ *
+ * An element that runs for longer than the slice without leaving its
+ * scheduler thread gets UMS_SIGNAL_PREEMPT, whose handler yields it. The
+ * new slice is used from the next execution of each element.
+*/
+#define UMS_REQUEST_SET_TIME_SLICE \
+	_IOW(UMS_IOCTL_MAGIC, 24, struct ums_complist_slice_args)
+
+/**
+ * @brief Yield the running element if its time slice expired
+ *
+ * Called by the UMS_SIGNAL_PREEMPT handler. A late signal (the element
+ * already left the scheduler thread) is ignored and the handler returns.
+*/
+#define UMS_REQUEST_PREEMPT_YIELD \
+	_IO(UMS_IOCTL_MAGIC, 25)
+
+/**
+ * @brief Execute a completion element with its own time slice
+ *
+ * Same as UMS_REQUEST_EXEC, the element is preempted after budget_ns.
+*/
+#define UMS_REQUEST_EXEC_BUDGET \
+	_IOW(UMS_IOCTL_MAGIC, 26, struct ums_exec_budget_args)
+
+/**
+ * @brief Create a file descriptor to poll the completion list complist_id
+ *
+ * The ioctl call returns a new file descriptor that supports only poll,
+ * select and epoll: it is readable (EPOLLIN) while the completion list has
+ * ready elements, in the ready queue or in the ready ring, and it reports
+ * EPOLLHUP once the completion list is removed. The entry point can wait on
+ * it together with its other descriptors and then reserve the elements with
+ * UMS_REQUEST_TRY_DEQUEUE_COMPLETION_LIST.
+ *
+ * @code
+ * struct ums_complist_args args = { .complist_id = id };
+ *
+ * poll_fd = ioctl(fd, UMS_REQUEST_COMPLIST_FD, &args);
  * @endcode
+*/
+#define UMS_REQUEST_COMPLIST_FD \
+	_IOW(UMS_IOCTL_MAGIC, 27, struct ums_complist_args)
+
+/**
+ * @brief Same as UMS_REQUEST_DEQUEUE_COMPLETION_LIST without sleeping
  *
- * The resulting array as the following structure
+ * The call fails with -EAGAIN if the completion list has no ready element.
+*/
+#define UMS_REQUEST_TRY_DEQUEUE_COMPLETION_LIST \
+	_IOWR(UMS_IOCTL_MAGIC, 28, struct ums_dequeue_args)
+
+/**
+ * @brief Block the caller until a scheduler or a completion list is removed
  *
- * len | el1 | el2 | el3 | el_{n-1} | el0
+ * A scheduler is removed with its completion list, a completion list when
+ * its last element ends. Any number of threads can wait for the same
+ * object. The call fails with -ETIMEDOUT once timeout_ns expires (0 only
+ * checks), with -ENOENT if the object does not exist anymore.
+*/
+#define UMS_REQUEST_WAIT \
+	_IOW(UMS_IOCTL_MAGIC, 29, struct ums_wait_args)
+
+/**
+ * @brief mmap offset of the worker control page on the device file
  *
- * the first element is at res+len.
+ * A registered scheduler thread maps its own control page (read-only,
+ * one page) with:
  *
+ * @code
+ * page = mmap(NULL, getpagesize(), PROT_READ, MAP_SHARED, fd,
+ *	       UMS_MMAP_WORKER_PAGE);
+ * @endcode
  *
- * This call has the al least one semantic, which means that len is always 
- * >= 1 (for obvious reasons also <= n)
+ * @sa ums_worker_page
+*/
+#define UMS_MMAP_WORKER_PAGE 0x0ULL
+
+/**
+ * @brief mmap offset of the ready ring of a completion list
+ *
+ * @sa UMS_REQUEST_READY_RING_SETUP
+*/
+#define UMS_MMAP_READY_RING(complist_id) ((__u64)(complist_id) << 32)
+
+/**
+ * @struct ums_worker_page
+ *
+ * @brief Control page of a scheduler thread shared with user space
+ *
+ * The page is written only by the kernel on behalf of its scheduler thread
+ * (registration, exec, yield, switch). Readers use seq as a sequence
+ * counter: an odd value means that an update is in progress, a value that
+ * changed during the read means that the read must be retried.
+*/
+struct ums_worker_page {
+	/** sequence counter of the updates */
+	__u32 seq;
+	/** running completion element, 0 if the entry point is running */
+	__s32 current_elem;
+	/** completion list linked to the scheduler */
+	__s32 complist_id;
+	/** scheduler that owns the worker */
+	__s32 sched_id;
+	/** number of switches performed by the worker */
+	__u64 n_switch;
+	/** duration of the last switch in ns */
+	__u64 switch_time;
+};
+
+/**
+ * @brief Maximum number of submission entries of a ring
+*/
+#define UMS_RING_MAX_ENTRIES 4096
+
+/**
+ * @brief Maximum number of elements reserved by a single dequeue entry
+*/
+#define UMS_RING_DEQUEUE_MAX 32
+
+/** @brief No operation, posts a completion with res 0 */
+#define UMS_RING_OP_NOP 0
+
+/** @brief Same as UMS_REQUEST_EXEC, id is the compelem to execute */
+#define UMS_RING_OP_EXEC 1
+
+/** @brief Same as UMS_REQUEST_YIELD */
+#define UMS_RING_OP_YIELD 2
+
+/**
+ * @brief Same as UMS_REQUEST_DEQUEUE_COMPLETION_LIST, len is the maximum
+ * number of elements
+ *
+ * One completion is posted for each reserved element with the compelem id
+ * in res. All of them but the last one have UMS_CQE_F_MORE set. It never
+ * waits: if no element is ready a single completion with -EAGAIN is posted.
+*/
+#define UMS_RING_OP_DEQUEUE 3
+
+/** @brief Same as UMS_REQUEST_REMOVE_COMPLETION_ELEM, id is the compelem */
+#define UMS_RING_OP_REMOVE_COMPLETION_ELEM 4
+
+/** @brief Same as UMS_REQUEST_SWITCH_TO, id is the target compelem */
+#define UMS_RING_OP_SWITCH_TO 5
+
+/**
+ * @brief Execute the first element reserved by the previous dequeue entry
+ * of the same batch (the id field is ignored)
+*/
+#define UMS_SQE_F_LINK_DEQUEUE (1U << 0)
+
+/**
+ * @brief More completions of the same request follow this one
+*/
+#define UMS_CQE_F_MORE (1U << 0)
+
+/**
+ * @struct ums_sqe
+ *
+ * @brief Submission queue entry
+*/
+struct ums_sqe {
+	/** one of the UMS_RING_OP_* values */
+	__u32 opcode;
+	/** UMS_SQE_F_* flags */
+	__u32 flags;
+	/** compelem identifier (exec, remove) */
+	__s32 id;
+	/** number of elements (dequeue) */
+	__u32 len;
+	/** value copied untouched in the completion */
+	__u64 user_data;
+};
+
+/**
+ * @struct ums_cqe
+ *
+ * @brief Completion queue entry
+*/
+struct ums_cqe {
+	/** user_data of the submission entry */
+	__u64 user_data;
+	/** result of the request: 0 (or an id) on success, -errno otherwise */
+	__s32 res;
+	/** UMS_CQE_F_* flags */
+	__u32 flags;
+};
+
+/**
+ * @struct ums_ring_hdr
+ *
+ * @brief Header of the shared ring memory
+ *
+ * The submission queue is produced by user space (sq_tail) and consumed by
+ * the module (sq_head), the completion queue is produced by the module
+ * (cq_tail) and consumed by user space (cq_head).
+*/
+struct ums_ring_hdr {
+	__u32 sq_head;
+	__u32 sq_tail;
+	__u32 sq_mask;
+	__u32 sq_entries;
+	__u32 cq_head;
+	__u32 cq_tail;
+	__u32 cq_mask;
+	__u32 cq_entries;
+	/** completions dropped because the completion queue was full */
+	__u32 cq_overflow;
+	__u32 resv;
+};
+
+/**
+ * @struct ums_ring_params
+ *
+ * @brief Parameters of UMS_REQUEST_RING_SETUP
+*/
+struct ums_ring_params {
+	/** in: number of submission entries (rounded to a power of 2) */
+	__u32 sq_entries;
+	/** out: number of completion entries */
+	__u32 cq_entries;
+	/** out: offset of the submission entries in the ring memory */
+	__u32 sq_off;
+	/** out: offset of the completion entries in the ring memory */
+	__u32 cq_off;
+	/** out: size of the ring memory to be mapped */
+	__u32 ring_size;
+	/** out: ring file descriptor */
+	__s32 fd;
+};
+
+/**
+ * @brief Create a submission/completion ring for the calling thread
+ *
+ * The ioctl call creates a new ring (see struct ums_ring_params) and returns
+ * a new file descriptor that owns it. The ring memory is mapped by calling
+ * mmap on the returned descriptor with length ring_size and offset 0.
+ *
+ * Requests are queued in the submission queue (struct ums_sqe) and consumed
+ * by the module with a single UMS_RING_REQUEST_ENTER call on the ring file
+ * descriptor. Each consumed request posts at least one completion
+ * (struct ums_cqe) in the completion queue.
+ *
+ * @code
+ * struct ums_ring_params p = { .sq_entries = 16 };
+ *
+ * ring_fd = ioctl(fd, UMS_REQUEST_RING_SETUP, &p);
+ * mem = mmap(NULL, p.ring_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+ *	      ring_fd, 0);
+ * @endcode
+ *
+ * @note A ring must be driven by a single scheduler thread: exec and yield
+ *	requests switch the context of the thread that enters the ring.
+*/
+#define UMS_REQUEST_RING_SETUP \
+	_IOWR(UMS_IOCTL_MAGIC, 12, struct ums_ring_params)
+
+/**
+ * @brief Consume at-most n submission queue entries (ring fd request)
  *
- * @warning Check the memory, not following the correct indication might cause
- *	several problems to your own system.
+ * Pass directly the number of entries to consume (the argument is a value,
+ * not a pointer). The call returns the number of consumed entries. A request that switches context (exec, yield)
+ * always terminates the batch: in that case the call returns to the new
+ * context and the return value belongs to it.
 */
-#define UMS_REQUEST_DEQUEUE_COMPLETION_LIST 11
+#define UMS_RING_REQUEST_ENTER \
+	_IO(UMS_IOCTL_MAGIC, 14)
 
 #endif /* __UMS_DEVICE_H__ */
@@ -0,0 +1,418 @@
+/**
+ * @author Alberto Bombardelli
+ *
+ * @file ums_ring.c
+ *
+ * @brief Implementation file of the ring sub-module
+ *
+ * This file contains the creation of the submission/completion rings, their
+ * file operations and the dispatch of the submitted requests to the scheduler
+ * and completion list sub-modules.
+ *
+ * @sa ums_ring.h
+ * @sa ums_ring_internal.h
+*/
+#include "ums_ring.h"
+#include "ums_ring_internal.h"
+#include "ums_scheduler.h"
+#include "ums_complist.h"
+
+#include <linux/anon_inodes.h>
+#include <linux/fs.h>
+#include <linux/file.h>
+#include <linux/uaccess.h>
+#include <linux/log2.h>
+#include <linux/mm.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+
+/**
+ * @brief name of the anonymous inode of the ring files
+*/
+#define UMS_RING_NAME "[ums_ring]"
+
+/**
+ * @brief alignment of the ring sections inside the shared memory
+*/
+#define UMS_RING_ALIGN 64
+
+static int ums_ring_mmap(struct file *file, struct vm_area_struct *vma);
+
+static long ums_ring_ioctl(struct file *file, unsigned int request,
+			   unsigned long data);
+
+static int ums_ring_release(struct inode *inode, struct file *file);
+
+/**
+ * @brief file operations of the ring file descriptor
+ *
+ * @sa ums_ring_create
+*/
+static const struct file_operations ums_ring_fops = {
+	.owner = THIS_MODULE,
+	.mmap = ums_ring_mmap,
+	.unlocked_ioctl = ums_ring_ioctl,
+	.release = ums_ring_release,
+};
+
+/**
+ * @brief Post a new completion
+ *
+ * @param[in] ring: ring that receives the completion
+ * @param[in] user_data: user_data of the submission entry
+ * @param[in] res: result of the request
+ * @param[in] flags: UMS_CQE_F_* flags
+ *
+ * @return 0 if the completion was posted, -EOVERFLOW if the completion
+ *	queue is full (the overflow counter is incremented)
+*/
+static int ring_post_cqe(struct ums_ring *ring, u64 user_data, s32 res,
+			 u32 flags)
+{
+	struct ums_cqe *cqe;
+	unsigned int head;
+
+	head = smp_load_acquire(&ring->hdr->cq_head);
+
+	if (ring->cq_tail - head >= ring->cq_entries) {
+		WRITE_ONCE(ring->hdr->cq_overflow, ring->hdr->cq_overflow + 1);
+		return -EOVERFLOW;
+	}
+
+	cqe = &ring->cqes[ring->cq_tail & (ring->cq_entries - 1)];
+
+	WRITE_ONCE(cqe->user_data, user_data);
+	WRITE_ONCE(cqe->res, res);
+	WRITE_ONCE(cqe->flags, flags);
+
+	ring->cq_tail++;
+
+	/* publish the entry before the tail */
+	smp_store_release(&ring->hdr->cq_tail, ring->cq_tail);
+
+	return 0;
+}
+
+/**
+ * @brief Free completion entries of the ring
+*/
+static unsigned int ring_cq_space(struct ums_ring *ring)
+{
+	return ring->cq_entries -
+		(ring->cq_tail - smp_load_acquire(&ring->hdr->cq_head));
+}
+
+/**
+ * @brief Consume a dequeue submission entry
+ *
+ * Reserve at most sqe->len elements (bounded by UMS_RING_DEQUEUE_MAX and by
+ * the free completion entries) and post one completion for each of them.
+ *
+ * The dequeue never sleeps: the ring lock is held and a waiting submitter
+ * would stall every other user of the ring. If no element is ready -EAGAIN
+ * is posted.
+*/
+static void ring_do_dequeue(struct ums_ring *ring,
+			    struct ums_sqe *sqe,
+			    struct ums_ring_batch *batch)
+{
+	ums_compelem_id elems[UMS_RING_DEQUEUE_MAX];
+	unsigned int len;
+	int i, size, res;
+
+	len = min_t(unsigned int, sqe->len, UMS_RING_DEQUEUE_MAX);
+	len = min(len, ring_cq_space(ring));
+
+	if (! len) {
+		ring_post_cqe(ring, sqe->user_data, -EINVAL, 0);
+		return;
+	}
+
+	res = ums_sched_dequeue(len, elems, &size, 0);
+
+	if (res || size <= 0) {
+		ring_post_cqe(ring, sqe->user_data, res ? res : -EAGAIN, 0);
+		return;
+	}
+
+	batch->dequeued = elems[0];
+
+	for (i = 0; i < size; i++)
+		ring_post_cqe(ring, sqe->user_data, elems[i],
+			      i + 1 < size ? UMS_CQE_F_MORE : 0);
+}
+
+/**
+ * @brief Dispatch a submission entry to the correct sub-module
+ *
+ * @param[in] ring: ring that owns the entry
+ * @param[in] sqe: private copy of the submission entry
+ * @param[in, out] batch: state of the current kernel entry
+*/
+static void ring_dispatch(struct ums_ring *ring,
+			  struct ums_sqe *sqe,
+			  struct ums_ring_batch *batch)
+{
+	int res;
+
+	switch (sqe->opcode) {
+	case UMS_RING_OP_NOP:
+		ring_post_cqe(ring, sqe->user_data, 0, 0);
+	break;
+
+	case UMS_RING_OP_EXEC:
+	{
+		ums_compelem_id id = sqe->id;
+
+		if (sqe->flags & UMS_SQE_F_LINK_DEQUEUE)
+			id = batch->dequeued;
+
+		if (! id) {
+			ring_post_cqe(ring, sqe->user_data, -EINVAL, 0);
+			break;
+		}
+
+		/* the completion is posted before returning to the
+		 * compelem context */
+		res = ums_sched_exec(id, 0, 0);
+
+		ring_post_cqe(ring, sqe->user_data, res, 0);
+
+		if (! res)
+			batch->switched = 1;
+	}
+	break;
+
+	case UMS_RING_OP_YIELD:
+		res = ums_sched_yield();
+
+		ring_post_cqe(ring, sqe->user_data, res, 0);
+
+		if (! res)
+			batch->switched = 1;
+	break;
+
+	case UMS_RING_OP_SWITCH_TO:
+		res = ums_sched_switch_to(sqe->id);
+
+		ring_post_cqe(ring, sqe->user_data, res, 0);
+
+		if (! res)
+			batch->switched = 1;
+	break;
+
+	case UMS_RING_OP_DEQUEUE:
+		ring_do_dequeue(ring, sqe, batch);
+	break;
+
+	case UMS_RING_OP_REMOVE_COMPLETION_ELEM:
+		res = ums_compelem_remove(ring->session, sqe->id);
+		ring_post_cqe(ring, sqe->user_data, res, 0);
+	break;
+
+	default:
+		ring_post_cqe(ring, sqe->user_data, -EINVAL, 0);
+	}
+}
+
+/**
+ * @brief Consume the submitted entries of a ring
+ *
+ * @param[in] ring: ring to consume
+ * @param[in] to_submit: maximum number of entries to consume
+ *
+ * The entries are consumed in order until either to_submit entries were
+ * consumed, the submission queue is empty or an entry switched context.
+ *
+ * @return number of consumed entries, 0 if the context was switched
+*/
+static long ums_ring_enter(struct ums_ring *ring, unsigned int to_submit)
+{
+	struct ums_ring_batch batch = { 0 };
+	unsigned int tail, consumed = 0;
+
+	mutex_lock(&ring->lock);
+
+	tail = smp_load_acquire(&ring->hdr->sq_tail);
+
+	while (consumed < to_submit && ring->sq_head != tail) {
+		struct ums_sqe sqe;
+
+		if (! ring_cq_space(ring))
+			break;
+
+		/* private copy: user space might change the entry meanwhile */
+		memcpy(&sqe, &ring->sqes[ring->sq_head & (ring->sq_entries - 1)],
+		       sizeof(sqe));
+
+		ring->sq_head++;
+		consumed++;
+
+		ring_dispatch(ring, &sqe, &batch);
+
+		if (batch.switched)
+			break;
+	}
+
+	smp_store_release(&ring->hdr->sq_head, ring->sq_head);
+
+	mutex_unlock(&ring->lock);
+
+	return batch.switched ? 0 : consumed;
+}
+
+/**
+ * @brief Create a new ring and its file descriptor
+ *
+ * @param[in] dev_file: device file, the ring keeps its session alive
+ * @param[in, out] uparams: user parameters, the requested size, filled with
+ *	the layout of the shared memory and the new file descriptor
+ *
+ * The file descriptor is installed only once the parameters are copied
+ * back, so a fault does not leave an unknown descriptor open.
+ *
+ * @return the new file descriptor, negative error code otherwise
+*/
+int ums_ring_create(struct file *dev_file,
+		    struct ums_ring_params __user *uparams)
+{
+	struct ums_ring_params params;
+	struct ums_ring *ring;
+	struct file *file;
+	unsigned int sq_entries, cq_entries;
+	size_t sq_off, cq_off, size;
+	int fd;
+
+	if (copy_from_user(&params, uparams, sizeof(params)))
+		return -EFAULT;
+
+	if (! params.sq_entries || params.sq_entries > UMS_RING_MAX_ENTRIES)
+		return -EINVAL;
+
+	sq_entries = roundup_pow_of_two(params.sq_entries);
+	/* a single dequeue might post several completions */
+	cq_entries = 2 * sq_entries;
+
+	sq_off = ALIGN(sizeof(struct ums_ring_hdr), UMS_RING_ALIGN);
+	cq_off = ALIGN(sq_off + sq_entries * sizeof(struct ums_sqe),
+		       UMS_RING_ALIGN);
+	size = PAGE_ALIGN(cq_off + cq_entries * sizeof(struct ums_cqe));
+
+	ring = kzalloc(sizeof(struct ums_ring), GFP_KERNEL);
+
+	if (unlikely(! ring))
+		return -ENOMEM;
+
+	ring->mem = vmalloc_user(size);
+
+	if (unlikely(! ring->mem)) {
+		kfree(ring);
+		return -ENOMEM;
+	}
+
+	ring->size = size;
+	ring->hdr = ring->mem;
+	ring->sqes = ring->mem + sq_off;
+	ring->cqes = ring->mem + cq_off;
+	ring->sq_entries = sq_entries;
+	ring->cq_entries = cq_entries;
+	mutex_init(&ring->lock);
+	ring->dev_file = get_file(dev_file);
+	ring->session = dev_file->private_data;
+
+	ring->hdr->sq_entries = sq_entries;
+	ring->hdr->sq_mask = sq_entries - 1;
+	ring->hdr->cq_entries = cq_entries;
+	ring->hdr->cq_mask = cq_entries - 1;
+
+	fd = get_unused_fd_flags(O_RDWR | O_CLOEXEC);
+
+	if (fd < 0)
+		goto ring_create_free;
+
+	file = anon_inode_getfile(UMS_RING_NAME, &ums_ring_fops, ring,
+				  O_RDWR | O_CLOEXEC);
+
+	if (IS_ERR(file)) {
+		put_unused_fd(fd);
+		fd = PTR_ERR(file);
+		goto ring_create_free;
+	}
+
+	params.sq_entries = sq_entries;
+	params.cq_entries = cq_entries;
+	params.sq_off = sq_off;
+	params.cq_off = cq_off;
+	params.ring_size = size;
+	params.fd = fd;
+
+	if (copy_to_user(uparams, &params, sizeof(params))) {
+		put_unused_fd(fd);
+		/* ums_ring_release frees the ring */
+		fput(file);
+		return -EFAULT;
+	}
+
+	fd_install(fd, file);
+
+	return fd;
+
+ring_create_free:
+	fput(ring->dev_file);
+	vfree(ring->mem);
+	kfree(ring);
+	return fd;
+}
+
+/**
+ * @brief Map the ring memory in user space
+*/
+static int ums_ring_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct ums_ring *ring = file->private_data;
+
+	if (vma->vm_pgoff ||
+	    vma->vm_end - vma->vm_start > ring->size)
+		return -EINVAL;
+
+	return remap_vmalloc_range(vma, ring->mem, 0);
+}
+
+/**
+ * @brief ioctl of the ring file descriptor
+ *
+ * The block notifier of current is disarmed meanwhile (the ring mutex is
+ * not a block), see ums_sched_kernel_enter.
+ *
+ * @sa UMS_RING_REQUEST_ENTER
+*/
+static long ums_ring_ioctl(struct file *file, unsigned int request,
+			   unsigned long data)
+{
+	struct ums_ring *ring = file->private_data;
+	long res;
+
+	switch (request) {
+	case UMS_RING_REQUEST_ENTER:
+		ums_sched_kernel_enter();
+		res = ums_ring_enter(ring, (unsigned int)data);
+		ums_sched_kernel_exit();
+		return res;
+
+	default: return -ENOTTY;
+	}
+}
+
+/**
+ * @brief Release the ring when its last file reference is dropped
+*/
+static int ums_ring_release(struct inode *inode, struct file *file)
+{
+	struct ums_ring *ring = file->private_data;
+
+	fput(ring->dev_file);
+	vfree(ring->mem);
+	kfree(ring);
+
+	return 0;
+}
@@ -0,0 +1,35 @@
+/**
+ * @author Alberto Bombardelli
+ *
+ * @file ums_ring.h
+ *
+ * @brief Public header of the ums ring sub-module
+ *
+ * The ring sub-module implements a shared memory submission/completion ring
+ * that permits to a scheduler thread to queue several requests (e.g. a
+ * dequeue followed by an exec) and to let the module consume them with a
+ * single kernel entry.
+ *
+ * To create a new ring:
+ * @code
+ * // uparams: user struct ums_ring_params, copied in and back
+ * fd = ums_ring_create(dev_file, uparams);
+ * @endcode
+ *
+ * The ring is then driven through its own file descriptor (mmap and
+ * UMS_RING_REQUEST_ENTER), see ums_device.h.
+ *
+ * @sa ums_ring.c
+ * @sa ums_ring_internal.h
+*/
+#ifndef __UMS_RING_H__
+#define __UMS_RING_H__
+
+#include "ums_device.h"
+
+#include <linux/fs.h>
+
+int ums_ring_create(struct file *dev_file,
+		    struct ums_ring_params __user *uparams);
+
+#endif /* __UMS_RING_H__ */
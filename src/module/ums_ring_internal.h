@@ -0,0 +1,79 @@
+/**
+ * @author Alberto Bombardelli
+ *
+ * @file ums_ring_internal.h
+ *
+ * @brief Internal data structures of the ring sub-module
+ *
+ * @sa ums_ring.c
+ * @sa ums_ring.h
+*/
+#ifndef __UMS_RING_INTERNAL_H__
+#define __UMS_RING_INTERNAL_H__
+
+#include <linux/mutex.h>
+
+#include "ums_ring.h"
+#include "ums_complist.h"
+
+/**
+ * @struct ums_ring
+ *
+ * @brief Kernel side of a submission/completion ring
+ *
+ * The shared memory is writable by user space, hence the module never
+ * trusts the sizes and the indexes it owns (sq_head and cq_tail) from the
+ * header: it keeps a private copy of them.
+*/
+struct ums_ring {
+	/** vmalloc'd memory shared with user space */
+	void *mem;
+
+	/** size of mem (page aligned) */
+	size_t size;
+
+	/** header at the beginning of mem */
+	struct ums_ring_hdr *hdr;
+
+	/** submission entries (inside mem) */
+	struct ums_sqe *sqes;
+
+	/** completion entries (inside mem) */
+	struct ums_cqe *cqes;
+
+	/** number of submission entries, power of 2 */
+	unsigned int sq_entries;
+
+	/** number of completion entries, power of 2 */
+	unsigned int cq_entries;
+
+	/** private copy of the submission queue head */
+	unsigned int sq_head;
+
+	/** private copy of the completion queue tail */
+	unsigned int cq_tail;
+
+	/** serialize the consumers of the ring */
+	struct mutex lock;
+
+	/** device file that created the ring, a reference is held */
+	struct file *dev_file;
+
+	/** session of dev_file */
+	struct ums_session *session;
+};
+
+/**
+ * @struct ums_ring_batch
+ *
+ * @brief State shared by the entries consumed in the same kernel entry
+*/
+struct ums_ring_batch {
+	/** first element reserved by the last dequeue (0 if none) */
+	ums_compelem_id dequeued;
+
+	/** set when an entry switched the context of current */
+	int switched;
+};
+
+#endif /* __UMS_RING_INTERNAL_H__ */
@@ -13,16 +13,25 @@
 #include "ums_scheduler_internal.h"
 #include "ums_complist.h"
 #include "ums_context_switch.h"
-#include "id_rwlock.h"
+#include "id_ref.h"
 #include "ums_proc.h"
+#include "ums_trace.h"
+#include "ums_session.h"
 
 #include <linux/slab.h>
+#include <linux/module.h>
+#include <linux/profile.h>
 #include <linux/percpu.h>
 #include <linux/sched.h>
 #include <linux/sched/signal.h>
-#include <linux/hashtable.h>
+#include <linux/sched/task.h>
 #include <linux/list.h>
 #include <linux/timekeeping.h>
+#include <linux/mm.h>
+#include <linux/preempt.h>
+#include <linux/irq_work.h>
+#include <linux/spinlock.h>
+#include <linux/hrtimer.h>
 
 /**
  * @brief get the currently running worker
@@ -49,39 +58,40 @@
 */
 #define SCHEDULER_DIR_NAME "schedulers"
 
-/**
- * @brief Safe hashtable for ums_scheduler
- *
- * The hash table map ums_sched_id to id_rwlock* 
- * where data is a pointer to ums_scheduler
- *
- * @sa ums_sched_add
- * @sa ums_sched_remove
-*/
-static DEFINE_HASHRWLOCK(ums_sched_hash, UMS_SCHED_HASH_BITS);
+static ssize_t sched_worker_proc_read(struct file *file,
+				      char __user *ubuf, 
+				      size_t count,
+				      loff_t *ppos);
 
-/** 
- * @brief Hash table to get a worker by its pid
- *
- * Given the thread pid, returns the corresponding worker
+static void ums_block_sched_in(struct preempt_notifier *notifier, int cpu);
+
+static void ums_block_sched_out(struct preempt_notifier *notifier,
+				struct task_struct *next);
+
+static int ums_task_exit(struct notifier_block *nb,
+			 unsigned long val,
+			 void *data);
+
+/**
+ * @brief Preempt operations of the block notifiers
  *
- * @sa ums_sched_register_sched_thread
+ * @sa ums_block_notifier
 */
-static DEFINE_HASHTABLE(ums_sched_worker_hash, UMS_SCHED_HASH_BITS);
+static struct preempt_ops ums_block_ops =
+{
+	.sched_in = ums_block_sched_in,
+	.sched_out = ums_block_sched_out,
+};
 
 /**
- * @brief Atomic variable to get a new scheduler id
+ * @brief Task exit notifier, it frees the block notifier of the task
  *
- * @sa ums_sched_add
- * @sa ums_complist_counter
- * @sa ums_compelem_counter
+ * @sa ums_task_exit
 */
-static atomic_t ums_sched_counter = ATOMIC_INIT(0);
-
-static ssize_t sched_worker_proc_read(struct file *file,
-				      char __user *ubuf, 
-				      size_t count,
-				      loff_t *ppos);
+static struct notifier_block ums_task_exit_nb =
+{
+	.notifier_call = ums_task_exit,
+};
 
 /**
  * @brief scheduler worker legal operation for proc files
@@ -97,55 +107,122 @@ static struct proc_ops ums_sched_worker_proc_ops =
 	.proc_read = sched_worker_proc_read,
 };
 
+static int init_ums_scheduler(struct ums_session *session,
+			      struct ums_scheduler* sched, 
+			      ums_sched_id id,
+			      ums_complist_id comp_id,
+			      const void __user *cpus,
+			      unsigned int cpus_size);
+
+static void deinit_ums_scheduler(struct ums_scheduler* sched);
+
+static void free_ums_scheduler(void *data);
+
+static void free_sched_workers(struct ums_scheduler *sched);
+
+static void get_worker_by_current(struct ums_sched_worker **worker);
+
+static void worker_page_publish(struct ums_sched_worker *worker);
+
+static struct ums_block_notifier *get_block_notifier(void);
+
+static struct ums_block_notifier *
+block_notifier_register(struct ums_sched_worker *worker,
+			struct id_ref *sched_ref);
+
+static void block_notifier_set_worker(struct ums_block_notifier *bn,
+				      struct ums_sched_worker *worker,
+				      struct id_ref *sched_ref);
+
+static void block_notifier_unregister(struct ums_block_notifier *bn);
+
+static void worker_handover(struct irq_work *work);
+
+static int standby_wait(struct ums_block_notifier *bn);
+
+static void slice_start(struct ums_sched_worker *worker, u64 budget);
+
+static void slice_stop(struct ums_sched_worker *worker);
+
+static enum hrtimer_restart slice_expired(struct hrtimer *timer);
+
 /**
- * @brief schedulers proc top level directory `schedulers`
+ * @brief Find a scheduler of a session and take a reference to it
  *
- * This is the entry of the proc directory /proc/ums/schedulers
+ * @param[in] session: session that owns the scheduler
+ * @param[in] sched_id: scheduler identifier
+ * @param[out] ref: id_ref of the scheduler (release it with id_ref_put)
  *
- * @sa ums_scheduler_proc_init
- * @sa ums_scheduler_proc_deinit
+ * The scheduler stays allocated until the reference is dropped, but it can
+ * be removed concurrently (see ums_scheduler.dead).
+ *
+ * @return 0 if the scheduler was found, -ENOENT if it does not exist or it
+ *	is being removed
 */
-static struct proc_dir_entry *ums_scheduler_dir_entry = NULL;
-
-static void init_ums_scheduler(struct ums_scheduler* sched, 
-			       ums_sched_id id,
-			       ums_complist_id comp_id);
+static int sched_get(struct ums_session *session,
+		     ums_sched_id sched_id,
+		     struct id_ref **ref)
+{
+	id_registry_find(&session->scheds, sched_id, ref);
 
-static void deinit_ums_scheduler(struct ums_scheduler* sched);
+	if (! *ref)
+		return -ENOENT;
 
-static void get_worker_by_current(struct ums_sched_worker **worker);
+	return 0;
+}
 
 /**
  * @brief Add a new scheduler without registering his workers
  *
+ * @param[in] session: session that owns the scheduler
  * @param[in] comp_list_id: completion list which will be linked to this scheduler
+ * @param[in] cpus: user CPU bitmap of the workers, NULL for the affinity of
+ *	current
+ * @param[in] cpus_size: size of cpus in bytes
  * @param[out] identifier: identifier of the new created scheduler
  *
  * This function creates a new scheduler safely and it then calls 
  * `ums_complist_add_scheduler` to link the scheduler to the completion list.
- * @return 0 if no error occured, non-zero otherwise
+ * @return 0 if no error occured, -errno otherwise
 */
-int ums_sched_add(ums_complist_id comp_list_id, ums_sched_id* identifier)
+int ums_sched_add(struct ums_session *session,
+		  ums_complist_id comp_list_id,
+		  const void __user *cpus,
+		  unsigned int cpus_size,
+		  ums_sched_id* identifier)
 {
 	struct ums_scheduler* ums_sched = NULL;
+	int res;
 
-	*identifier = atomic_inc_return(&ums_sched_counter);
+	res = id_registry_reserve(&session->scheds, identifier);
+
+	if (unlikely(res))
+		return res;
 
 	ums_sched = (struct ums_scheduler*) kmalloc(sizeof(struct ums_scheduler), GFP_KERNEL);
 
-	if (unlikely(! ums_sched))
-		return -EFAULT;
+	if (unlikely(! ums_sched)) {
+		id_registry_release(&session->scheds, *identifier);
+		return -ENOMEM;
+	}
+
+	res = init_ums_scheduler(session, ums_sched, *identifier, comp_list_id,
+				 cpus, cpus_size);
 
-	init_ums_scheduler(ums_sched, *identifier, comp_list_id);
+	if (unlikely(res)) {
+		id_registry_release(&session->scheds, *identifier);
+		return res;
+	}
 	
 	/* This function has 2 important goals:
 	 * check if complist with `comp_list_id` exists
 	 * append the current scheduler entry in the list 
 	*/
-	if (ums_complist_add_scheduler(comp_list_id, ums_sched->id)) {
-		printk(KERN_DEBUG "complist_add_scheduler failed");
-		ums_sched_remove(ums_sched->id);
-		return -EFAULT;
+	res = ums_complist_add_scheduler(session, comp_list_id, ums_sched->id);
+
+	if (res) {
+		ums_sched_remove(session, ums_sched->id);
+		return res;
 	}
 
 	return 0;
@@ -154,82 +231,97 @@ int ums_sched_add(ums_complist_id comp_list_id, ums_sched_id* identifier)
 /**
  * @brief Register a new scheduler thread
  *
+ * @param session: session that owns the scheduler
  * @param sched_id: scheduler id which will own the worker
  *
  * This function register, create and initialized the ums_sched_worker struct.
  *
  * Creates the struct, generate the ums_context from current and register
- * the worker in both scheduler and worker hash.
+ * the worker in the scheduler and link it to the block notifier of current.
  *
  * @note This function ASSUMES that the thread will run ONLY on a specific
  *	cpu, to guarantee that the developer should use sched_set_affinity 
  *	accordingly before calling this function.
  *
- * @return 0 if everything is OK, non-zero if either an error occured or
- *	either the scheduler was not registered or another worker has
- *	been registered for that CPU.
+ * @return 0 if everything is OK, -ENOENT if the scheduler was not
+ *	registered or it is being removed, -EPERM if current does not share
+ *	the scheduler memory map, -EINVAL if the scheduler has no worker on
+ *	the CPU of current, -EBUSY if another worker has been registered for
+ *	that CPU, -ENOMEM if the block notifier of current cannot be
+ *	allocated.
 */
-int ums_sched_register_sched_thread(ums_sched_id sched_id)
+int ums_sched_register_sched_thread(struct ums_session *session,
+				    ums_sched_id sched_id)
 {
 	struct ums_sched_worker *worker = NULL;
+	struct ums_block_notifier *bn;
 	struct ums_scheduler* sched;
-	struct id_rwlock *lock;
+	struct id_ref *ref;
+	unsigned long flags;
 	int res = 0;
 
-	hashrwlock_find(ums_sched_hash, sched_id, &lock);
+	res = sched_get(session, sched_id, &ref);
 
-	if (! lock) {
-		res = -1;
-		goto register_thread_exit;
-	}
+	if (res)
+		return res;
 
-	if (! lock->data) {
-		res = -1;
-		goto register_thread_exit;
-	}
+	sched = ref->data;
 
-	if (! id_read_trylock(lock)) {
-		res = -1;
-		goto register_thread_exit;
+	if (current->mm != sched->mm) {
+		res = -EPERM;
+		goto register_thread_put;
 	}
 
-	sched = lock->data;
-
-	if (unlikely(! sched)) {
-		res = -1;
-		id_read_unlock(lock);
-		goto register_thread_exit;
-	}
+	/* the worker lives as long as the scheduler, only its choice needs
+	 * the CPU of current */
+	worker = get_worker(sched);
+	put_cpu_ptr(sched->workers);
 
-	if (current->mm != sched->mm) {
-		res = -1;
-		id_read_unlock(lock);
-		goto register_thread_exit;
+	if (! worker) {
+		res = -EINVAL;
+		goto register_thread_put;
 	}
 
-	worker = get_worker(sched);
+	/* serialized with the remove by standby_lock (see deinit) */
+	spin_lock_irqsave(&worker->standby_lock, flags);
 
+	if (READ_ONCE(sched->dead))
+		res = -ENOENT;
 	/* Error: already registered */
-	if (worker->worker) {
-		res = -2; 
-		id_read_unlock(lock);
-		goto register_thread_exit;
+	else if (worker->worker)
+		res = -EBUSY; 
+	else
+		worker->worker = current;
+
+	spin_unlock_irqrestore(&worker->standby_lock, flags);
+
+	if (res)
+		goto register_thread_put;
+
+	/* the notifier is also the link from current to its worker */
+	bn = block_notifier_register(worker, ref);
+
+	if (! bn) {
+		spin_lock_irqsave(&worker->standby_lock, flags);
+		WRITE_ONCE(worker->worker, NULL);
+		spin_unlock_irqrestore(&worker->standby_lock, flags);
+
+		res = -ENOMEM;
+		goto register_thread_put;
 	}
 
 	/* set cpu var to current. */
 	worker->owner = sched;
 	worker->complist_id = sched->comp_id;
-	worker->worker = current;
 	worker->n_switch = 0;
 	worker->switch_time = 0;
 
 	gen_ums_context(current, &worker->entry_ctx);
-	put_cpu_ptr(sched->workers);
+	worker_page_publish(worker);
 
-	hash_add_rcu(ums_sched_worker_hash, &worker->list, worker->worker->pid);
-
-	/* generate proc directory */
-	ums_proc_geniddir(get_cpu(), sched->proc_dir, &worker->proc_dir);
+	/* generate proc directory (the thread is pinned to its cpu) */
+	ums_proc_geniddir(raw_smp_processor_id(), sched->proc_dir,
+			  &worker->proc_dir);
 
 	/* create proc file */
 	worker->proc_info_file = proc_create_data(WORKER_INFO_FILE,
@@ -238,47 +330,57 @@ int ums_sched_register_sched_thread(ums_sched_id sched_id)
 						  &ums_sched_worker_proc_ops,
 						  worker);
 
-	id_read_unlock(lock);
-register_thread_exit:
+	trace_ums_sched_register(sched->comp_id, 0, sched->id);
+
+register_thread_put:
+	id_ref_put(ref);
 
 	return res;
 }
 
 /**
- * \todo Should I keep this function?
+ * @brief Wait for the removal of a scheduler
+ *
+ * @param[in] session: session that owns the scheduler
+ * @param[in] sched_id: scheduler to wait for
+ * @param[in] timeout_ns: maximum wait in ns, negative to wait forever
+ *
+ * Any number of threads can wait for the same scheduler. The reference
+ * keeps the scheduler allocated while current sleeps on end_wait.
+ *
+ * @return 0 if the scheduler has been removed, -ENOENT if it does not exist
+ *	(or it was already removed), -ETIMEDOUT if the timeout expired,
+ *	-EINTR if a signal arrived
 */
-int ums_sched_wait(ums_sched_id sched_id)
+int ums_sched_wait(struct ums_session *session,
+		   ums_sched_id sched_id,
+		   s64 timeout_ns)
 {
 	struct ums_scheduler *sched;
-	struct ums_sched_wait *wait;
-	struct id_rwlock *lock;
-
-	hashrwlock_find(ums_sched_hash, sched_id, &lock);
+	struct id_ref *ref;
+	int res;
 
-	if (! lock)
-		return -1;
+	res = sched_get(session, sched_id, &ref);
 
-	if (! lock->data)
-		return -1;
+	if (res)
+		return res;
 
-	if (! id_read_trylock(lock))
-		return -1;
+	sched = ref->data;
 
-	sched = lock->data;
-	wait = kmalloc(sizeof(struct ums_sched_wait), GFP_KERNEL);
-
-	if (! wait)
-		return -1;
-
-	wait->task = current;
-	list_add(&wait->list, &sched->wait_procs);
+	if (timeout_ns < 0)
+		res = wait_event_interruptible(sched->end_wait,
+					       READ_ONCE(sched->dead));
+	else
+		res = wait_event_interruptible_hrtimeout(sched->end_wait,
+							 READ_ONCE(sched->dead),
+							 ns_to_ktime(timeout_ns));
 
-	id_read_unlock(lock);
+	id_ref_put(ref);
 
-	set_current_state(TASK_INTERRUPTIBLE);
-	schedule();
+	if (res == -ETIME)
+		return -ETIMEDOUT;
 
-	return 0;
+	return res ? -EINTR : 0;
 }
 
 /**
@@ -288,37 +390,33 @@ int ums_sched_wait(ums_sched_id sched_id)
  * This function neither change completion list nor completion elements linked
  * with it.
  *
- * @note The id_rwlock does not get destroyed to prevent concurrent access
- *	to invalid memory regions. The kfree call of id_rwlock is performed
- *	by ums_sched_deinit
+ * @note The scheduler is removed from the registry and torn down at once,
+ *	its memory is freed only when the concurrent users drop their
+ *	reference (see free_ums_scheduler)
  *
  * @sa ums_scheduler
- * @sa id_rwlock.h
+ * @sa id_ref.h
  * @sa ums_sched_add
 */
-int ums_sched_remove(ums_sched_id id)
+int ums_sched_remove(struct ums_session *session, ums_sched_id id)
 {
-	struct id_rwlock *lock;
-	struct ums_scheduler *sched;
-
-	hashrwlock_find(ums_sched_hash, id, &lock);
+	struct id_ref *ref;
 
-	if (! lock)
-		return -1;
+	id_registry_find(&session->scheds, id, &ref);
 
-	if (!lock->data)
-		return -1;
+	if (! ref)
+		return -ENOENT;
 
-	id_write_lock(lock);
-       
-	sched = lock->data;
-	deinit_ums_scheduler(sched);
-	lock->data = NULL;
-	hashrwlock_remove(lock);
+	/* concurrent remove */
+	if (! id_ref_kill(ref)) {
+		id_ref_put(ref);
+		return -ENOENT;
+	}
 
-	id_write_unlock(lock);
+	deinit_ums_scheduler(ref->data);
 
-	kfree(sched);
+	id_registry_remove(&session->scheds, ref);
+	id_ref_put(ref);
 	
 	return 0;
 }
@@ -330,24 +428,29 @@ int ums_sched_remove(ums_sched_id id)
  * of the scheduler worker. It stores the completion element context and then
  * it put the worker context.
  *
+ * If the completion list is in kernel dispatch mode (see
+ * UMS_POLICY_F_KERNEL_DISPATCH) the next ready element picked by its policy
+ * is executed instead, the worker context is put only if none is ready.
+ *
  *
  * @note Calling this function from a worker context has no effect
  *
- * @return 0 if the switch succeed, non-zero if an error occured or the calling
- *	thread is not linked to an existing worker.
+ * @return 0 if the switch succeed, -EPERM if the calling thread is not
+ *	linked to an existing worker.
  *
  * @sa ums_sched_exec
 */
 int ums_sched_yield(void)
 {
 	u64 act_time;
+	ums_compelem_id next;
 	struct ums_sched_worker *worker;
 
 	get_worker_by_current(&worker);
 
 	if (! worker) {
 		/* This happens when the completion list that terminated calls yield */
-		return -1;
+		return -EPERM;
 	}
 
 	if (! worker->current_elem)
@@ -356,17 +459,41 @@ int ums_sched_yield(void)
 
 	act_time = ktime_get_ns();
 
+	trace_ums_yield(worker->complist_id, worker->current_elem,
+			worker->owner->id);
+
 	/* save compelem state */
-	ums_compelem_store_reg(worker->current_elem);
-	
+	ums_compelem_store_reg(worker->owner->session, worker->current_elem);
+
+	if (! ums_complist_dispatch(worker->owner->session,
+				    worker->complist_id, &worker->reserved,
+				    &next) &&
+	    ! ums_compelem_exec(worker->owner->session, next,
+				worker->owner->id, 0)) {
+		trace_ums_exec(worker->complist_id, next, worker->owner->id);
+
+		worker->current_elem = next;
+		worker->switch_time = ktime_get_ns() - act_time;
+		worker->n_switch++;
+
+		slice_start(worker, 0);
+		worker_page_publish(worker);
+
+		return 0;
+	}
+
 	/* set current to entry_point */
 	worker->current_elem = 0;
 
+	slice_stop(worker);
+
 	put_ums_context(current, &worker->entry_ctx);
 
 	worker->switch_time = ktime_get_ns() - act_time;
 	worker->n_switch++;
 
+	worker_page_publish(worker);
+
 	return 0;
 }
 
@@ -374,6 +501,13 @@ int ums_sched_yield(void)
  * @brief Execute a completion element by switching context
  *
  * @param[elem_id] Completion element to execute
+ * @param[in] flags: UMS_EXEC_F_* flags, see ums_compelem_exec
+ * @param[in] budget: time slice of this execution in ns, 0 for the one of
+ *	the completion list of the element
+ *
+ * With UMS_EXEC_F_PARKED the element that the worker was running has been
+ * parked in user space: it is detached with ums_compelem_park and the
+ * caller is considered the entry point.
  *
  * Execute the current worker with the completion element context. 
  * The function first store the actual context (if it was running another compelem
@@ -387,270 +521,793 @@ int ums_sched_yield(void)
  * @sa ums_sched_yield
  * @sa ums_compelem_exec
 */
-int ums_sched_exec(ums_compelem_id elem_id)
+int ums_sched_exec(ums_compelem_id elem_id, unsigned int flags, u64 budget)
 {
 	struct ums_sched_worker *worker;
+	ums_compelem_id prev_elem;
 	int res = 0;
 	u64 act_time;
-	printk(KERN_DEBUG "Calling exec on compelem: %d", elem_id);
 	get_worker_by_current(&worker);
 
 	if (unlikely(! worker))
-		return -1;
+		return -EPERM;
 
 	act_time = ktime_get_ns();
 
+	if ((flags & UMS_EXEC_F_PARKED) && worker->current_elem) {
+		/* a removed element is simply forgotten */
+		ums_compelem_park(worker->owner->session, worker->current_elem);
+		worker->current_elem = 0;
+	}
+
+	prev_elem = worker->current_elem;
+
 	/* if executed by a worker restore */
 	if (worker->current_elem)
-		ums_compelem_store_reg(worker->current_elem);
+		ums_compelem_store_reg(worker->owner->session,
+				       worker->current_elem);
 	else
 		get_ums_context(current, &worker->entry_ctx);
 
 	/* mark as the runner */
 	worker->current_elem = elem_id;
 
-	res = ums_compelem_exec(elem_id, worker->owner->id);
+	res = ums_compelem_exec(worker->owner->session, elem_id,
+				worker->owner->id, flags);
 
 	if (likely(! res)) {
 		worker->switch_time = ktime_get_ns() - act_time;
 		worker->n_switch++;
+
+		slice_start(worker, budget);
+
+		trace_ums_exec(worker->complist_id, elem_id, worker->owner->id);
 	}
+	else if (! prev_elem) {
+		/* the entry point keeps running (e.g. a lost ready ring claim) */
+		worker->current_elem = 0;
+	}
+
+	worker_page_publish(worker);
 
 	return res;
 }
 
 /**
- * @brief Get the completion element used by the current sched worker
+ * @brief Switch from the running completion element to another one
+ *
+ * @param[in] elem_id: ready completion element to execute
+ *
+ * Store the context of the running completion element and put the one of
+ * elem_id in a single step, without passing through the worker context
+ * (entry_point). The running element goes back to the ready queue.
  *
- * @param[out] res_id: resulting completion list identifier
+ * @note Calling this function from a worker context (no running element)
+ *	is an error: use ums_sched_exec instead.
  *
- * The completion element might be use to trigger a dequeue call
+ * @return 0 if the switch succeed, non-zero otherwise
  *
- * @return 0 if complist was found, non-zero otherwise
+ * @sa ums_compelem_switch
+ * @sa ums_sched_yield
 */
-int ums_sched_complist_by_current(ums_complist_id *res_id)
+int ums_sched_switch_to(ums_compelem_id elem_id)
 {
 	struct ums_sched_worker *worker;
+	u64 act_time;
+	int res;
 
 	get_worker_by_current(&worker);
 
-	if (! worker)
-		return -EFAULT;
+	if (unlikely(! worker))
+		return -EPERM;
 
-	get_ums_context(current, &worker->entry_ctx);
+	if (! worker->current_elem)
+		return -EPERM;
 
-	*res_id = worker->complist_id;
+	act_time = ktime_get_ns();
 
-	return ! *res_id;
-}
+	res = ums_compelem_switch(worker->owner->session, worker->current_elem,
+				  elem_id, worker->owner->id);
 
-/**
- * @brief Initialize ums scheduler sub-module
- *
- * Initialized the data structures work the schedulers and scheduler workers
- *
- * @return 0 if everything was initialized successfully
-*/
-int ums_sched_init(void)
-{
-	hashrwlock_init(ums_sched_hash);
-	hash_init(ums_sched_worker_hash);
-	id_rwlock_init_mod();
+	if (likely(! res)) {
+		trace_ums_switch_to(worker->complist_id, worker->current_elem,
+				    elem_id, worker->owner->id);
 
-	return 0;
-}
+		worker->current_elem = elem_id;
+		worker->switch_time = ktime_get_ns() - act_time;
+		worker->n_switch++;
 
-/**
- * @brief Initialize ums sched proc submodule
- *
- * @param[in] ums_dir: the parent directory
- *
- * Creates the new schedulers top-level proc
-*/
-int ums_sched_proc_init(struct proc_dir_entry *ums_dir)
-{
-	ums_scheduler_dir_entry = proc_mkdir(SCHEDULER_DIR_NAME, ums_dir);
+		slice_start(worker, 0);
+		worker_page_publish(worker);
+	}
 
-	return ! ums_scheduler_dir_entry;
+	return res;
 }
 
 /**
- * @brief Deinit the scheduler module
+ * @brief Yield the running element because its time slice expired
  *
- * Cleanup memory and destroy scheduler sub-module data.
+ * Called by the UMS_SIGNAL_PREEMPT handler, in the context of the element:
+ * the stored context is the one of the handler, the element resumes the
+ * interrupted code when the handler returns.
  *
- * @return void
+ * @return 0 if the element was yielded or the signal is stale (the element
+ *	that used up its slice is not running anymore), -EPERM if current is
+ *	not a sched worker
+ *
+ * @sa ums_sched_yield
 */
-void ums_sched_deinit(void)
+int ums_sched_preempt_yield(void)
 {
-	struct list_head *iter, *safe_iter;
-	struct id_rwlock *tmp_rwlock;
+	struct ums_sched_worker *worker;
+	ums_compelem_id elem_id;
+
+	get_worker_by_current(&worker);
+
+	if (! worker)
+		return -EPERM;
+
+	elem_id = xchg(&worker->preempt_elem, 0);
+
+	if (! elem_id || elem_id != worker->current_elem)
+		return 0;
+
+	trace_ums_preempt(worker->complist_id, elem_id, worker->owner->id);
 
-	id_rwlock_deinit_mod(iter, safe_iter, tmp_rwlock, deinit_ums_scheduler);
+	worker->n_preempt++;
+
+	return ums_sched_yield();
 }
 
 /**
- * @brief Deinit scheduler proc module
+ * @brief Reserve completion elements for the current sched worker
  *
- * Remove the schedulers directory 
+ * @param[in] to_reserve: maximum number of elements to reserve
+ * @param[out] ret_array: reserved elements
+ * @param[out] size: number of reserved elements
+ * @param[in] do_sleep: wait for the first element if none is ready
  *
- * @return void
+ * Reserve elements from the completion list linked to the worker of
+ * current, see ums_complist_reserve.
+ *
+ * @return 0 if no error occured, non-zero otherwise
+ *
+ * @sa ums_complist_reserve
 */
-void ums_sched_proc_deinit(void)
+int ums_sched_dequeue(int to_reserve,
+		      ums_compelem_id *ret_array,
+		      int *size,
+		      int do_sleep)
 {
-	ums_proc_delete(ums_scheduler_dir_entry);
-	ums_scheduler_dir_entry = NULL;
+	struct ums_sched_worker *worker;
+	int i, res;
+
+	*size = 0;
+
+	get_worker_by_current(&worker);
+
+	if (! worker)
+		return -EPERM;
+
+	get_ums_context(current, &worker->entry_ctx);
+
+	res = ums_complist_reserve(worker->owner->session,
+				   worker->complist_id, to_reserve,
+				   &worker->reserved, ret_array, size,
+				   do_sleep);
+
+	if (res)
+		return res;
+
+	for (i = 0; i < *size; i++)
+		trace_ums_reserve(worker->complist_id, ret_array[i],
+				  worker->owner->id);
+
+	return 0;
 }
 
 /**
- * @brief Initialize a new ums_scheduler
+ * @brief Register current as standby thread of a sched worker
  *
- * @param[in, out] sched: scheduler to be initialized
- * @param[in] id: new scheduler id
- * @param[in] comp_id: completion list linked to the scheduler
+ * @param[in] session: session that owns the scheduler
+ * @param[in] sched_id: scheduler that owns the worker
  *
- * Initialize the workers, set the data and the id_rwlock.
+ * Current must be pinned to the CPU of the worker. It sleeps until the worker
+ * task blocks while it runs a completion element, then it takes over the
+ * worker: it returns to the worker entry point (see UMS_REQUEST_STANDBY).
  *
- * @return void
+ * @return UMS_EXEC_BLOCKED in the entry point context, -ENOENT if the
+ *	scheduler was not registered or is being removed, -EPERM if current does not share the
+ *	scheduler memory map or is a worker, -ENOMEM if the notifier cannot be
+ *	allocated, -EINTR if a signal arrived before any takeover.
+ *
+ * @sa ums_sched_blocked_park
 */
-static void init_ums_scheduler(struct ums_scheduler* sched, 
-			       ums_sched_id id,
-			       ums_complist_id comp_id) 
+int ums_sched_standby(struct ums_session *session, ums_sched_id sched_id)
 {
-	int cpu;
-	struct id_rwlock *lock;
+	struct ums_sched_worker *worker, *cur_worker;
+	struct ums_block_notifier *bn;
+	struct ums_scheduler *sched;
+	struct id_ref *ref;
+	int res;
 
-	lock = kmalloc(sizeof(struct id_rwlock), GFP_KERNEL);
+	get_worker_by_current(&cur_worker);
 
-	id_rwlock_init(id, sched, lock);
+	if (cur_worker)
+		return -EPERM;
 
-	sched->id = id;
-	sched->comp_id = comp_id;
-	sched->mm = current->mm;
+	res = sched_get(session, sched_id, &ref);
 
-	if (! id_write_trylock(lock))
-		printk(KERN_ERR "Expecting lock to be free!\n");
+	if (res)
+		return res;
 
-	hashrwlock_add(ums_sched_hash, lock);
+	sched = ref->data;
 
-	sched->workers = alloc_percpu(struct ums_sched_worker*);
+	if (current->mm != sched->mm) {
+		id_ref_put(ref);
+		return -EPERM;
+	}
 
-	/* Init as NULL */
-	for_each_possible_cpu(cpu) {
-		struct ums_sched_worker *worker;
-		worker = kmalloc(sizeof(struct ums_sched_worker), GFP_KERNEL);
+	worker = get_worker(sched);
+	put_cpu_ptr(sched->workers);
 
-		worker->worker = NULL;
-		(*per_cpu_ptr(sched->workers, cpu)) = worker;
+	if (! worker) {
+		id_ref_put(ref);
+		return -EINVAL;
 	}
 
-	INIT_LIST_HEAD(&sched->wait_procs);
+	/* the notifier takes its own reference: it keeps the worker */
+	bn = block_notifier_register(worker, ref);
+
+	id_ref_put(ref);
 
-	ums_proc_geniddir(id, ums_scheduler_dir_entry, &sched->proc_dir);
+	if (! bn)
+		return -ENOMEM;
 
-	id_write_unlock(lock);
+	return standby_wait(bn);
 }
 
 /**
- * @brief Internal function to deinit ums_scheduler structure
+ * @brief Give back the completion element that blocked and become standby
  *
- * @param[in] sched: pointer to the scheduler
+ * Called by the UMS_SIGNAL_BLOCKED handler of a task that blocked while it
+ * was running a completion element. The element context (inside the
+ * handler) is stored and the element goes back to the ready queue, then
+ * current waits as standby of its worker.
  *
- * Set to invalid values the struct fields, send INT signal to workers
- * (that might be stuck in the complist semaphore), remove proc related
- * data and release waiting processes
+ * @param[in] session: session of the device file used by current
  *
- * @return void
+ * The notifier pins the scheduler only: the element is stored through
+ * session, which must be the one of the scheduler (the device file of the
+ * caller keeps it alive).
+ *
+ * @return UMS_EXEC_BLOCKED in the entry point context, -EPERM if current
+ *	did not block in a completion element or session does not own its
+ *	scheduler, -ENOENT if the scheduler is being removed, -EINTR if a
+ *	signal arrived before any takeover.
+ *
+ * @sa ums_sched_standby
 */
-static void deinit_ums_scheduler(struct ums_scheduler* sched)
+int ums_sched_blocked_park(struct ums_session *session)
 {
-	struct list_head *list_iter;
-	struct list_head *safe_temp;
-	int cpu;
-
-	sched->id = -1;
-	sched->comp_id = -1;
+	struct ums_block_notifier *bn;
+	struct ums_scheduler *sched;
+	ums_compelem_id elem_id;
 
-	/* kill all the workers */
-	for_each_possible_cpu(cpu) {
-		struct ums_sched_worker *worker = *per_cpu_ptr(sched->workers, cpu);
+	bn = get_block_notifier();
 
-		if (worker->worker)
-			send_sig(SIGINT, worker->worker, 0);
+	if (! bn || ! bn->blocked_elem || ! bn->sched_ref)
+		return -EPERM;
 
-		/* remove procfs data */
-		ums_proc_delete(worker->proc_info_file);
-		ums_proc_delete(worker->proc_dir);
+	sched = bn->sched_ref->data;
 
-		/* Remove worker from the hash */
-		hash_del_rcu(&worker->list);
-	}
+	/* its session might be gone, checked before any other field */
+	if (READ_ONCE(sched->dead))
+		return -ENOENT;
 
-	free_percpu(sched->workers);
+	if (sched->session != session)
+		return -EPERM;
 
-	list_for_each_safe(list_iter, safe_temp, &sched->wait_procs) {
-		struct ums_sched_wait *wait;
+	elem_id = bn->blocked_elem;
+	bn->blocked_elem = 0;
+	bn->signalled = 0;
 
-		wait = list_entry(list_iter, struct ums_sched_wait, list);
+	/* a removed element is simply forgotten */
+	ums_compelem_store_reg(session, elem_id);
 
-		wake_up_process(wait->task);
+	return standby_wait(bn);
+}
 
-		list_del(&wait->list);
+/**
+ * @brief Completion list of the sched worker hosted by current
+ *
+ * @return the completion list identifier, 0 if current is not a sched
+ *	worker
+*/
+ums_complist_id ums_sched_current_complist(void)
+{
+	struct ums_sched_worker *worker;
 
-		kfree(wait);
-	}
+	get_worker_by_current(&worker);
 
-	/* remove scheduler directory */
-	ums_proc_delete(sched->proc_dir);
+	return worker ? worker->complist_id : 0;
 }
 
 /**
- * @brief proc_ops sched worker read function
+ * @brief Map the control page of the current sched worker
  *
- * The scheduler worker proc read function is in charge of parsing the
- * worker data into a readable char buffer to be readed in userspace
+ * @param[in] vma: user mapping of exactly one page
  *
- * The information passed to the user:
- * - worker pid 
- * - worker thread state [in integer]
- * - number of switches
- * - completion list linked to it
- * - current completion element
- * - time required in the last switch
+ * The page is inserted read-only: the user can poll the worker state
+ * (see ums_worker_page) without any ioctl or procfs read.
+ *
+ * @return 0 if the page was mapped, -EPERM if current is not a sched
+ *	worker or the mapping is writable, -EINVAL if the size is not one
+ *	page, -ENOMEM if the worker has no page
+ *
+ * @sa worker_page_publish
 */
-static ssize_t sched_worker_proc_read(struct file *file,
-				      char __user *ubuf,
-				      size_t count,
-				      loff_t *ppos)
+int ums_sched_worker_mmap(struct vm_area_struct *vma)
 {
 	struct ums_sched_worker *worker;
-        char buf[512];
-        int len = 0;
 
-        if (*ppos > 0)
-                return 0;
-
-	worker = PDE_DATA(file_inode(file));
+	get_worker_by_current(&worker);
 
 	if (! worker)
-		return -EFAULT;
+		return -EPERM;
 
-	/* print pid: */
-	len += sprintf(buf + len, "pid=%d\n", worker->worker->pid);
+	if (! worker->page)
+		return -ENOMEM;
 
-	if (len > count || len < 0)
-		return -EFAULT;
+	if (vma->vm_end - vma->vm_start != PAGE_SIZE)
+		return -EINVAL;
 
-	/* print task_state */
-	len += sprintf(buf + len, "state=%u\n", task_state_index(worker->worker));
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
 
-	if (len > count || len < 0)
-		return -EFAULT;
+	vma->vm_flags &= ~VM_MAYWRITE;
 
-	/* print switches */
-	len += sprintf(buf + len, "n_switch=%u\n", worker->n_switch);
+	return vm_insert_page(vma, vma->vm_start, virt_to_page(worker->page));
+}
 
-	if (len > count || len < 0)
+/**
+ * @brief Stop the time slice of a completion element being removed
+ *
+ * @param[in] elem_id: removed completion element
+ *
+ * If current is the worker that runs elem_id, its slice timer is cancelled
+ * (a running callback is waited for): no UMS_SIGNAL_PREEMPT is sent for
+ * the removed element.
+*/
+void ums_sched_compelem_removed(ums_compelem_id elem_id)
+{
+	struct ums_sched_worker *worker;
+
+	get_worker_by_current(&worker);
+
+	if (! worker || worker->current_elem != elem_id)
+		return;
+
+	hrtimer_cancel(&worker->slice_timer);
+	WRITE_ONCE(worker->preempt_elem, 0);
+}
+
+/**
+ * @brief Enter the module from an ioctl of current
+ *
+ * The sleeps of a worker task inside the module (locks, allocations,
+ * standby) are not blocks of its completion element: the block notifier
+ * ignores them until ums_sched_kernel_exit.
+ *
+ * @sa ums_block_notifier.user_mode
+*/
+void ums_sched_kernel_enter(void)
+{
+	struct ums_block_notifier *bn = get_block_notifier();
+
+	if (! bn)
+		return;
+
+	WRITE_ONCE(bn->user_mode, 0);
+	/* only current runs its notifier: ordered before the request */
+	barrier();
+}
+
+/**
+ * @brief Leave the module and return to user mode
+ *
+ * Re-arm the block notifier of current, after the request has set
+ * worker->current_elem (see ums_sched_kernel_enter).
+*/
+void ums_sched_kernel_exit(void)
+{
+	struct ums_block_notifier *bn = get_block_notifier();
+
+	if (! bn)
+		return;
+
+	barrier();
+	WRITE_ONCE(bn->user_mode, 1);
+}
+
+/**
+ * @brief Initialize ums scheduler sub-module
+ *
+ * Initialized the data structures of the scheduler workers, the schedulers
+ * belong to the sessions. The task exit notifier frees the block notifiers.
+ *
+ * @return 0 if everything was initialized successfully, the error of
+ *	profile_event_register otherwise (CONFIG_PROFILING is required)
+*/
+int ums_sched_init(void)
+{
+	int res;
+
+	res = profile_event_register(PROFILE_TASK_EXIT, &ums_task_exit_nb);
+
+	if (res)
+		return res;
+
+	preempt_notifier_inc();
+
+	return 0;
+}
+
+/**
+ * @brief Initialize the schedulers of a session
+ *
+ * @param[in] session: new session
+ *
+ * Creates the schedulers proc directory of the session
+ *
+ * @return 0 if the directory was created, non-zero otherwise
+*/
+int ums_sched_session_init(struct ums_session *session)
+{
+	session->sched_dir = proc_mkdir(SCHEDULER_DIR_NAME, session->proc_dir);
+
+	return ! session->sched_dir;
+}
+
+/**
+ * @brief Destroy the schedulers of a session
+ *
+ * @param[in] session: session being released
+ *
+ * Deinit the schedulers still alive, drop the registry references (that
+ * free them) and remove the schedulers proc directory.
+*/
+void ums_sched_session_deinit(struct ums_session *session)
+{
+	unsigned long index;
+	struct id_ref *tmp_ref;
+
+	id_registry_reclaim(&session->scheds, index, tmp_ref,
+			    deinit_ums_scheduler);
+
+	ums_proc_delete(session->sched_dir);
+	session->sched_dir = NULL;
+}
+
+/**
+ * @brief Deinit the scheduler module
+ *
+ * Cleanup memory and destroy scheduler sub-module data, the sessions are
+ * already destroyed. Every block notifier pins the module, so none is
+ * registered anymore.
+ *
+ * @return void
+*/
+void ums_sched_deinit(void)
+{
+	/* it also waits for a ums_task_exit that is still returning */
+	profile_event_unregister(PROFILE_TASK_EXIT, &ums_task_exit_nb);
+
+	preempt_notifier_dec();
+}
+
+/**
+ * @brief Initialize a new ums_scheduler
+ *
+ * @param[in] session: session that owns the scheduler
+ * @param[in, out] sched: scheduler to be initialized
+ * @param[in] id: new scheduler id
+ * @param[in] comp_id: completion list linked to the scheduler
+ * @param[in] cpus: user CPU bitmap of the workers, NULL for the affinity of
+ *	current
+ * @param[in] cpus_size: size of cpus in bytes
+ *
+ * Initialize the workers of the CPUs in cpus that are possible, then
+ * publish the scheduler in the registry with its id_ref.
+ *
+ * @return 0 if no error occured, otherwise (sched is freed) -ENOMEM if a
+ *	worker or its entry context cannot be allocated, -EFAULT if cpus
+ *	cannot be read, -EINVAL if it has no possible CPU
+*/
+static int init_ums_scheduler(struct ums_session *session,
+			      struct ums_scheduler* sched, 
+			      ums_sched_id id,
+			      ums_complist_id comp_id,
+			      const void __user *cpus,
+			      unsigned int cpus_size)
+{
+	int cpu, res = 0;
+	struct id_ref *ref;
+
+	ref = kmalloc(sizeof(struct id_ref), GFP_KERNEL);
+
+	if (unlikely(! ref)) {
+		kfree(sched);
+		return -ENOMEM;
+	}
+
+	if (unlikely(! zalloc_cpumask_var(&sched->cpus, GFP_KERNEL))) {
+		kfree(ref);
+		kfree(sched);
+		return -ENOMEM;
+	}
+
+	if (cpus) {
+		/* the missing bits are zero, the extra ones are ignored */
+		if (copy_from_user(cpumask_bits(sched->cpus), cpus,
+				   min_t(unsigned int, cpus_size,
+					 cpumask_size())))
+			res = -EFAULT;
+
+		cpumask_and(sched->cpus, sched->cpus, cpu_possible_mask);
+	}
+	else {
+		cpumask_copy(sched->cpus, current->cpus_ptr);
+	}
+
+	if (! res && cpumask_empty(sched->cpus))
+		res = -EINVAL;
+
+	if (res) {
+		free_cpumask_var(sched->cpus);
+		kfree(ref);
+		kfree(sched);
+		return res;
+	}
+
+	sched->id = id;
+	sched->comp_id = comp_id;
+	sched->mm = current->mm;
+	sched->session = session;
+	sched->dead = 0;
+
+	sched->workers = alloc_percpu(struct ums_sched_worker*);
+
+	if (unlikely(! sched->workers)) {
+		res = -ENOMEM;
+		goto init_sched_free;
+	}
+
+	/* the other CPUs stay NULL */
+	for_each_cpu(cpu, sched->cpus) {
+		struct ums_sched_worker *worker;
+
+		/* no task, no current element and zeroed counters */
+		worker = kzalloc(sizeof(struct ums_sched_worker), GFP_KERNEL);
+
+		if (unlikely(! worker)) {
+			res = -ENOMEM;
+			goto init_sched_free;
+		}
+
+		worker->owner = sched;
+		INIT_LIST_HEAD(&worker->reserved);
+		INIT_LIST_HEAD(&worker->standby);
+		spin_lock_init(&worker->standby_lock);
+		init_irq_work(&worker->handover_work, worker_handover);
+		hrtimer_init(&worker->slice_timer, CLOCK_MONOTONIC,
+			     HRTIMER_MODE_REL_PINNED);
+		worker->slice_timer.function = slice_expired;
+		(*per_cpu_ptr(sched->workers, cpu)) = worker;
+
+		/* a missing page only disables UMS_MMAP_WORKER_PAGE */
+		worker->page = (void *)get_zeroed_page(GFP_KERNEL);
+
+		res = alloc_ums_context(&worker->entry_ctx);
+
+		if (unlikely(res))
+			goto init_sched_free;
+	}
+
+	init_waitqueue_head(&sched->end_wait);
+
+	ums_proc_geniddir(id, session->sched_dir, &sched->proc_dir);
+
+	/* the lookups see the scheduler only once it is initialized */
+	id_ref_init(id, sched, ref, free_ums_scheduler);
+
+	if (unlikely(id_registry_add(&session->scheds, ref))) {
+		deinit_ums_scheduler(sched);
+		/* frees sched */
+		id_ref_put(ref);
+		return -ENOMEM;
+	}
+
+	return 0;
+
+init_sched_free:
+	free_sched_workers(sched);
+	free_cpumask_var(sched->cpus);
+	kfree(ref);
+	kfree(sched);
+	return res;
+}
+
+/**
+ * @brief Internal function to deinit ums_scheduler structure
+ *
+ * @param[in] sched: pointer to the scheduler
+ *
+ * Set to invalid values the struct fields, send INT signal to workers
+ * (that might be waiting for ready elements), remove proc related
+ * data and release waiting processes
+ *
+ * @return void
+*/
+static void deinit_ums_scheduler(struct ums_scheduler* sched)
+{
+	int cpu;
+
+	/* the users that still hold a reference fail from now on */
+	WRITE_ONCE(sched->dead, 1);
+
+	/* kill all the workers */
+	for_each_cpu(cpu, sched->cpus) {
+		struct ums_sched_worker *worker = *per_cpu_ptr(sched->workers, cpu);
+
+		struct ums_block_notifier *bn;
+		unsigned long flags;
+
+		/* a concurrent register either sees dead or it is seen here */
+		spin_lock_irqsave(&worker->standby_lock, flags);
+
+		if (worker->worker)
+			send_sig(SIGINT, worker->worker, 0);
+
+		/* current is not a worker anymore for get_worker_by_current */
+		WRITE_ONCE(worker->worker, NULL);
+
+		spin_unlock_irqrestore(&worker->standby_lock, flags);
+
+		irq_work_sync(&worker->handover_work);
+		hrtimer_cancel(&worker->slice_timer);
+
+		spin_lock_irqsave(&worker->standby_lock, flags);
+		list_for_each_entry(bn, &worker->standby, standby_node)
+			send_sig(SIGINT, bn->task, 0);
+		spin_unlock_irqrestore(&worker->standby_lock, flags);
+
+		/* remove procfs data */
+		ums_proc_delete(worker->proc_info_file);
+		ums_proc_delete(worker->proc_dir);
+	}
+
+	/* the waiters check dead, set at the beginning */
+	wake_up_all(&sched->end_wait);
+
+	/* remove scheduler directory */
+	ums_proc_delete(sched->proc_dir);
+}
+
+/**
+ * @brief Free a scheduler torn down by deinit_ums_scheduler
+ *
+ * @param[in] data: the ums_scheduler
+ *
+ * Called by the last id_ref_put, nobody can reach the scheduler anymore
+ * through its id.
+*/
+static void free_ums_scheduler(void *data)
+{
+	struct ums_scheduler *sched = data;
+
+	free_sched_workers(sched);
+	free_cpumask_var(sched->cpus);
+	kfree(sched);
+}
+
+/**
+ * @brief Free the workers of a scheduler and their per-cpu table
+ *
+ * @param[in] sched: scheduler, its workers might be partially initialized
+ *	(see init_ums_scheduler)
+*/
+static void free_sched_workers(struct ums_scheduler *sched)
+{
+	int cpu;
+
+	if (! sched->workers)
+		return;
+
+	for_each_cpu(cpu, sched->cpus) {
+		struct ums_sched_worker *worker = *per_cpu_ptr(sched->workers, cpu);
+
+		if (! worker)
+			continue;
+
+		/* a handover or a slice queued after the deinit */
+		irq_work_sync(&worker->handover_work);
+		hrtimer_cancel(&worker->slice_timer);
+
+		/* user mappings keep their own reference to the page */
+		if (worker->page)
+			free_page((unsigned long)worker->page);
+		free_ums_context(&worker->entry_ctx);
+		kfree(worker);
+	}
+
+	free_percpu(sched->workers);
+}
+
+/**
+ * @brief proc_ops sched worker read function
+ *
+ * The scheduler worker proc read function is in charge of parsing the
+ * worker data into a readable char buffer to be readed in userspace
+ *
+ * The information passed to the user:
+ * - worker pid 
+ * - worker thread state [in integer]
+ * - number of switches
+ * - completion list linked to it
+ * - current completion element
+ * - time required in the last switch
+*/
+static ssize_t sched_worker_proc_read(struct file *file,
+				      char __user *ubuf,
+				      size_t count,
+				      loff_t *ppos)
+{
+	struct ums_sched_worker *worker;
+	struct task_struct *task;
+	pid_t pid = -1;
+	unsigned int state = 0;
+        char buf[512];
+        int len = 0;
+
+        if (*ppos > 0)
+                return 0;
+
+	worker = PDE_DATA(file_inode(file));
+
+	if (! worker)
+		return -EFAULT;
+
+	/* worker->worker is NULL before the registration and after the exit
+	 * of the thread (see block_notifier_unregister): take a snapshot */
+	rcu_read_lock();
+	task = READ_ONCE(worker->worker);
+	if (task)
+		get_task_struct(task);
+	rcu_read_unlock();
+
+	if (task) {
+		pid = task->pid;
+		state = task_state_index(task);
+		put_task_struct(task);
+	}
+
+	/* print pid: */
+	len += sprintf(buf + len, "pid=%d\n", pid);
+
+	if (len > count || len < 0)
+		return -EFAULT;
+
+	/* print task_state */
+	len += sprintf(buf + len, "state=%u\n", state);
+
+	if (len > count || len < 0)
+		return -EFAULT;
+
+	/* print switches */
+	len += sprintf(buf + len, "n_switch=%u\n", worker->n_switch);
+
+	if (len > count || len < 0)
 		return -EFAULT;
 
 	/* print completion list */
@@ -669,6 +1326,10 @@ static ssize_t sched_worker_proc_read(struct file *file,
 	if (len > count)
 		return -EFAULT;
 
+	len += sprintf(buf + len, "n_preempt=%u\n", worker->n_preempt);
+	if (len > count)
+		return -EFAULT;
+
         if (copy_to_user(ubuf, buf, len))
                 return -EFAULT;
 
@@ -678,22 +1339,462 @@ static ssize_t sched_worker_proc_read(struct file *file,
 }
 
 /**
- * @brief Utility function to get a worker by current pid
+ * @brief Utility function to get the worker of current
  *
  * @param[out] worker: resulting scheduler worker, [NULL] if worker is not found
  *
- * Search for registered ums_sched_worker from the pid 
+ * The worker is linked to the block notifier of current, which is the first
+ * (usually the only) preempt notifier of the task: no table is searched.
+ * Standby threads and tasks that lost their worker to a standby have a
+ * notifier too, so the worker must still be hosted by current.
  *
  * @return void
- * @sa ums_sched_worker_hash
+ * @sa ums_block_notifier
  * @sa ums_sched_worker
  *
 */
 static void get_worker_by_current(struct ums_sched_worker **worker)
 {
+	struct ums_block_notifier *bn = get_block_notifier();
+
 	*worker = NULL;
 
-	hash_for_each_possible_rcu(ums_sched_worker_hash, *worker, list, current->pid) {
-		if ((*worker)->worker->pid == current->pid) break;
+	if (bn && bn->worker && READ_ONCE(bn->worker->worker) == current)
+		*worker = bn->worker;
+}
+
+/**
+ * @brief Publish the worker state in its control page
+ *
+ * @param[in] worker: worker to publish, it must be the one of current
+ *
+ * The worker is the only writer of its page, so a sequence counter is
+ * enough to let user space read a consistent snapshot.
+ *
+ * @sa ums_worker_page
+*/
+static void worker_page_publish(struct ums_sched_worker *worker)
+{
+	struct ums_worker_page *page = worker->page;
+
+	if (unlikely(! page))
+		return;
+
+	WRITE_ONCE(page->seq, page->seq + 1);
+	smp_wmb();
+
+	WRITE_ONCE(page->current_elem, worker->current_elem);
+	WRITE_ONCE(page->complist_id, worker->complist_id);
+	WRITE_ONCE(page->sched_id, worker->owner->id);
+	WRITE_ONCE(page->n_switch, worker->n_switch);
+	WRITE_ONCE(page->switch_time, worker->switch_time);
+
+	smp_wmb();
+	WRITE_ONCE(page->seq, page->seq + 1);
+}
+
+/**
+ * @brief Get the block notifier of current
+ *
+ * @return the notifier, NULL if current never hosted a worker
+ *
+ * @sa block_notifier_register
+*/
+static struct ums_block_notifier *get_block_notifier(void)
+{
+	struct preempt_notifier *notifier;
+
+	hlist_for_each_entry(notifier, &current->preempt_notifiers, link) {
+		if (notifier->ops == &ums_block_ops)
+			return container_of(notifier, struct ums_block_notifier,
+					    notifier);
 	}
+
+	return NULL;
+}
+
+/**
+ * @brief Register the block notifier of current
+ *
+ * @param[in] worker: worker hosted (or to be hosted) by current, NULL
+ *	to set it later
+ * @param[in] sched_ref: reference of the scheduler that owns worker, the
+ *	notifier takes its own
+ *
+ * The notifier pins the module until current exits (see ums_task_exit).
+ *
+ * @return the notifier of current, NULL if it cannot be allocated or the
+ *	module is being unloaded
+*/
+static struct ums_block_notifier *
+block_notifier_register(struct ums_sched_worker *worker,
+			struct id_ref *sched_ref)
+{
+	struct ums_block_notifier *bn;
+
+	bn = get_block_notifier();
+
+	if (bn) {
+		if (worker)
+			block_notifier_set_worker(bn, worker, sched_ref);
+		return bn;
+	}
+
+	if (! try_module_get(THIS_MODULE))
+		return NULL;
+
+	bn = kzalloc(sizeof(struct ums_block_notifier), GFP_KERNEL);
+
+	if (! bn) {
+		module_put(THIS_MODULE);
+		return NULL;
+	}
+
+	bn->task = current;
+	INIT_LIST_HEAD(&bn->standby_node);
+	preempt_notifier_init(&bn->notifier, &ums_block_ops);
+
+	if (worker)
+		block_notifier_set_worker(bn, worker, sched_ref);
+
+	preempt_disable();
+	preempt_notifier_register(&bn->notifier);
+	preempt_enable();
+
+	return bn;
+}
+
+/**
+ * @brief Link the block notifier of current to a worker
+ *
+ * @param[in] bn: notifier of current
+ * @param[in] worker: new worker of current
+ * @param[in] sched_ref: reference of the scheduler that owns worker
+ *
+ * The reference of the previous worker is dropped: it might free its
+ * scheduler, current is not hosting it anymore.
+*/
+static void block_notifier_set_worker(struct ums_block_notifier *bn,
+				      struct ums_sched_worker *worker,
+				      struct id_ref *sched_ref)
+{
+	struct id_ref *old_ref = bn->sched_ref;
+
+	id_ref_get(sched_ref);
+
+	bn->worker = worker;
+	bn->sched_ref = sched_ref;
+
+	if (old_ref)
+		id_ref_put(old_ref);
+}
+
+/**
+ * @brief Unregister and free the block notifier of current
+ *
+ * @param[in] bn: notifier of current
+ *
+ * Current leaves its worker (a new worker task can be registered) and the
+ * standby list, then the scheduler reference and the module are released.
+*/
+static void block_notifier_unregister(struct ums_block_notifier *bn)
+{
+	struct ums_sched_worker *worker = bn->worker;
+	unsigned long flags;
+
+	preempt_disable();
+	preempt_notifier_unregister(&bn->notifier);
+	preempt_enable();
+
+	if (worker) {
+		spin_lock_irqsave(&worker->standby_lock, flags);
+
+		if (worker->worker == current)
+			WRITE_ONCE(worker->worker, NULL);
+
+		/* worker_handover unlinks it under the same lock */
+		list_del_init(&bn->standby_node);
+
+		spin_unlock_irqrestore(&worker->standby_lock, flags);
+
+		/* the last reference frees the scheduler and the worker */
+		id_ref_put(bn->sched_ref);
+	}
+
+	kfree(bn);
+
+	/* ums_sched_deinit waits for this callback to return */
+	module_put(THIS_MODULE);
+}
+
+/**
+ * @brief Task exit notifier: free the block notifier of the task
+ *
+ * @param[in] nb: ums_task_exit_nb
+ * @param[in] val: unused
+ * @param[in] data: exiting task, it is current
+ *
+ * The notifier cannot outlive its task, which is the only one that
+ * registers or unregisters it.
+ *
+ * @return NOTIFY_OK
+*/
+static int ums_task_exit(struct notifier_block *nb,
+			 unsigned long val,
+			 void *data)
+{
+	struct ums_block_notifier *bn;
+
+	if (data != current)
+		return NOTIFY_DONE;
+
+	bn = get_block_notifier();
+
+	if (bn)
+		block_notifier_unregister(bn);
+
+	return NOTIFY_OK;
+}
+
+/**
+ * @brief sched_out notifier: detect the block of a worker task
+ *
+ * @param[in] notifier: notifier of current
+ * @param[in] next: task that is going to run
+ *
+ * If current leaves the CPU in a sleeping state while it runs a completion
+ * element, the element is detached from the worker and a standby thread is
+ * woken up (through handover_work, the runqueue lock is held here).
+ *
+ * @note Preemption is not a block, neither is a sleep inside the module
+ *	(see ums_sched_kernel_enter), and nothing happens without standby
+ *	threads.
+*/
+static void ums_block_sched_out(struct preempt_notifier *notifier,
+				struct task_struct *next)
+{
+	struct ums_block_notifier *bn;
+	struct ums_sched_worker *worker;
+
+	bn = container_of(notifier, struct ums_block_notifier, notifier);
+	worker = bn->worker;
+
+	/* current_elem is only read after the flag, set after it */
+	if (! worker || ! READ_ONCE(bn->user_mode))
+		return;
+
+	if (READ_ONCE(current->state) == TASK_RUNNING ||
+	    (current->flags & PF_EXITING))
+		return;
+
+	if (worker->worker != current || ! worker->current_elem)
+		return;
+
+	/* racy check: a late standby still finds the handover */
+	if (list_empty(&worker->standby))
+		return;
+
+	trace_ums_block(worker->complist_id, worker->current_elem,
+			worker->owner->id);
+
+	bn->blocked_elem = worker->current_elem;
+	worker->current_elem = 0;
+
+	irq_work_queue(&worker->handover_work);
+}
+
+/**
+ * @brief sched_in notifier: notify the wake up of a blocked task
+ *
+ * @param[in] notifier: notifier of current
+ * @param[in] cpu: unused
+ *
+ * Send UMS_SIGNAL_BLOCKED once: its handler gives back the blocked element
+ * with ums_sched_blocked_park.
+*/
+static void ums_block_sched_in(struct preempt_notifier *notifier, int cpu)
+{
+	struct ums_block_notifier *bn;
+
+	bn = container_of(notifier, struct ums_block_notifier, notifier);
+
+	if (bn->blocked_elem && ! bn->signalled) {
+		bn->signalled = 1;
+		send_sig(UMS_SIGNAL_BLOCKED, current, 1);
+	}
+}
+
+/**
+ * @brief Wake up a standby thread of a worker whose task blocked
+ *
+ * @param[in] work: handover_work of the worker
+ *
+ * If there is no standby thread the handover stays pending until the next
+ * call of standby_wait.
+*/
+static void worker_handover(struct irq_work *work)
+{
+	struct ums_sched_worker *worker;
+	struct ums_block_notifier *bn;
+	unsigned long flags;
+
+	worker = container_of(work, struct ums_sched_worker, handover_work);
+
+	spin_lock_irqsave(&worker->standby_lock, flags);
+
+	bn = list_first_entry_or_null(&worker->standby,
+				      struct ums_block_notifier, standby_node);
+
+	if (bn) {
+		list_del_init(&bn->standby_node);
+		WRITE_ONCE(bn->takeover, 1);
+		wake_up_process(bn->task);
+	}
+	else
+		worker->handover = 1;
+
+	spin_unlock_irqrestore(&worker->standby_lock, flags);
+}
+
+/**
+ * @brief Wait as standby thread and take over the worker
+ *
+ * @param[in] bn: notifier of current
+ *
+ * On takeover current becomes the worker task: its notifier resolves it and
+ * the worker entry point context is put in current.
+ *
+ * @return UMS_EXEC_BLOCKED, -ENOENT if the scheduler is being removed, -EINTR
+ *	if a signal arrived before any takeover
+*/
+static int standby_wait(struct ums_block_notifier *bn)
+{
+	struct ums_sched_worker *worker = bn->worker;
+	unsigned long flags;
+	int res = 0;
+
+	spin_lock_irqsave(&worker->standby_lock, flags);
+
+	/* deinit_ums_scheduler signals the standby list after dead is set,
+	 * under the same lock: a later standby would never be woken up */
+	if (READ_ONCE(worker->owner->dead)) {
+		spin_unlock_irqrestore(&worker->standby_lock, flags);
+		return -ENOENT;
+	}
+
+	if (worker->handover) {
+		worker->handover = 0;
+		bn->takeover = 1;
+	}
+	else
+		list_add_tail(&bn->standby_node, &worker->standby);
+
+	spin_unlock_irqrestore(&worker->standby_lock, flags);
+
+	for (;;) {
+		set_current_state(TASK_INTERRUPTIBLE);
+
+		if (READ_ONCE(bn->takeover))
+			break;
+
+		if (signal_pending(current)) {
+			res = -EINTR;
+			break;
+		}
+
+		schedule();
+	}
+
+	__set_current_state(TASK_RUNNING);
+
+	if (res) {
+		spin_lock_irqsave(&worker->standby_lock, flags);
+
+		/* a takeover that raced with the signal wins */
+		if (bn->takeover)
+			res = 0;
+		else
+			list_del_init(&bn->standby_node);
+
+		spin_unlock_irqrestore(&worker->standby_lock, flags);
+
+		if (res)
+			return res;
+	}
+
+	bn->takeover = 0;
+
+	/* from now on get_worker_by_current resolves worker for current */
+	worker->current_elem = 0;
+	WRITE_ONCE(worker->worker, current);
+
+	put_ums_context(current, &worker->entry_ctx);
+	worker_page_publish(worker);
+
+	trace_ums_takeover(worker->complist_id, 0, worker->owner->id);
+
+	return UMS_EXEC_BLOCKED;
+}
+
+/**
+ * @brief Start the time slice of the element that current is running
+ *
+ * @param[in] worker: worker of current, running an element
+ * @param[in] budget: time slice in ns, 0 for the one of the completion list
+ *	of the element
+ *
+ * The timer is restarted from now, without a slice it is stopped.
+*/
+static void slice_start(struct ums_sched_worker *worker, u64 budget)
+{
+	WRITE_ONCE(worker->preempt_elem, 0);
+
+	if (! budget)
+		budget = ums_compelem_time_slice(worker->owner->session,
+						 worker->current_elem);
+
+	if (budget)
+		hrtimer_start(&worker->slice_timer, ns_to_ktime(budget),
+			      HRTIMER_MODE_REL_PINNED);
+	else
+		hrtimer_try_to_cancel(&worker->slice_timer);
+}
+
+/**
+ * @brief Stop the time slice when the worker goes back to the entry point
+ *
+ * @param[in] worker: worker of current
+*/
+static void slice_stop(struct ums_sched_worker *worker)
+{
+	hrtimer_try_to_cancel(&worker->slice_timer);
+	WRITE_ONCE(worker->preempt_elem, 0);
+}
+
+/**
+ * @brief slice_timer callback: preempt the running element
+ *
+ * @param[in] timer: slice_timer of the worker
+ *
+ * No switch is possible in interrupt context: UMS_SIGNAL_PREEMPT makes the
+ * worker task yield the element (UMS_REQUEST_PREEMPT_YIELD) on its next
+ * return to user mode. Nothing is sent if the element already left the
+ * worker (e.g. it blocked).
+*/
+static enum hrtimer_restart slice_expired(struct hrtimer *timer)
+{
+	struct ums_sched_worker *worker;
+	struct task_struct *task;
+	ums_compelem_id elem_id;
+
+	worker = container_of(timer, struct ums_sched_worker, slice_timer);
+	task = READ_ONCE(worker->worker);
+	elem_id = READ_ONCE(worker->current_elem);
+
+	if (task && elem_id) {
+		WRITE_ONCE(worker->preempt_elem, elem_id);
+		send_sig(UMS_SIGNAL_PREEMPT, task, 1);
+	}
+
+	return HRTIMER_NORESTART;
 }
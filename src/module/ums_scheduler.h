@@ -11,19 +11,24 @@
  * To enable module:
  * @code
  * ums_sched_init();
- * ums_sched_proc_init(ums_dir);
  * @endcode
  *
  * To deinit module:
  * @code 
- * ums_sched_proc_deinit(ums_dir);
  * ums_sched_deinit();
  * @endcode
  *
+ * The schedulers belong to a session (see ums_session.h), which calls:
+ * @code
+ * ums_sched_session_init(session);
+ * ...
+ * ums_sched_session_deinit(session);
+ * @endcode
  *
  * To create a new scheduler (without registered threads):
  * @code
- * ums_sched_add(complist_id, &id);
+ * // workers on the CPUs of the affinity of current
+ * ums_sched_add(session, complist_id, NULL, 0, &id);
  * @endcode
  *
  * To create a new scheduler with threads:
@@ -44,12 +49,12 @@
  * return 0;
  *
  * // KERNELMODE THREAD1
- * ums_sched_register_sched_thread(sched_id);
+ * ums_sched_register_sched_thread(session, sched_id);
  * @endcode
  *
  * To execute a completion element from a registered worker:
  * @code
- * ums_sched_exec(elem_id)
+ * ums_sched_exec(elem_id, 0, 0)
  * @endcode
  * NOTE: elem_id should have been registered with ums_complist_register by
  * the same thread
@@ -58,6 +63,12 @@
  * @code
  * ums_sched_yield();
  * @endocode
+ *
+ * To pass from the running completion element to another ready one without
+ * returning to entry_function:
+ * @code
+ * ums_sched_switch_to(elem_id);
+ * @endcode
 */
 #ifndef __UMS_SCHEDULER_H__
 #define __UMS_SCHEDULER_H__
@@ -67,33 +78,61 @@
 */
 typedef int ums_sched_id;
 
+struct ums_session;
+
 #include "ums_complist.h"
 #include <linux/proc_fs.h>
-
-/* 256 buckets should be more than enought */
-#define UMS_SCHED_HASH_BITS 8
+#include <linux/mm_types.h>
 
 int ums_sched_init(void);
 
 void ums_sched_deinit(void);
 
-int ums_sched_proc_init(struct proc_dir_entry *ums_dir);
+int ums_sched_session_init(struct ums_session *session);
 
-void ums_sched_proc_deinit(void);
+void ums_sched_session_deinit(struct ums_session *session);
 
-int ums_sched_add(ums_complist_id comp_list_id, ums_sched_id* identifier);
+int ums_sched_add(struct ums_session *session,
+		  ums_complist_id comp_list_id,
+		  const void __user *cpus,
+		  unsigned int cpus_size,
+		  ums_sched_id* identifier);
 
-int ums_sched_wait(ums_sched_id sched_id);
+int ums_sched_wait(struct ums_session *session,
+		   ums_sched_id sched_id,
+		   s64 timeout_ns);
 
-int ums_sched_remove(ums_sched_id identifier);
+int ums_sched_remove(struct ums_session *session, ums_sched_id identifier);
 
 int ums_sched_yield(void);
 
-int ums_sched_exec(ums_compelem_id elem_id);
+int ums_sched_exec(ums_compelem_id elem_id, unsigned int flags, u64 budget);
+
+int ums_sched_preempt_yield(void);
+
+int ums_sched_switch_to(ums_compelem_id elem_id);
+
+int ums_sched_register_sched_thread(struct ums_session *session,
+				    ums_sched_id sched_id);
+
+int ums_sched_dequeue(int to_reserve,
+		      ums_compelem_id *ret_array,
+		      int *size,
+		      int do_sleep);
+
+int ums_sched_worker_mmap(struct vm_area_struct *vma);
+
+int ums_sched_standby(struct ums_session *session, ums_sched_id sched_id);
+
+int ums_sched_blocked_park(struct ums_session *session);
+
+ums_complist_id ums_sched_current_complist(void);
+
+void ums_sched_compelem_removed(ums_compelem_id elem_id);
 
-int ums_sched_register_sched_thread(ums_sched_id sched_id);
+void ums_sched_kernel_enter(void);
 
-int ums_sched_complist_by_current(ums_complist_id *res_id);
+void ums_sched_kernel_exit(void);
 
 
 #endif /* __UMS_SCHEDULER_H__ */
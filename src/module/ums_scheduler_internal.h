@@ -14,10 +14,17 @@
 #include "ums_scheduler.h"
 #include "ums_complist.h"
 #include "ums_context_switch.h"
+#include "ums_device.h"
+#include "id_ref.h"
 
-#include <linux/hashtable.h>
 #include <linux/list.h>
 #include <linux/proc_fs.h>
+#include <linux/preempt.h>
+#include <linux/irq_work.h>
+#include <linux/spinlock.h>
+#include <linux/cpumask.h>
+#include <linux/hrtimer.h>
+#include <linux/wait.h>
 
 /**
  * @struct ums_sched_worker
@@ -51,11 +58,6 @@ struct ums_sched_worker {
 	*/
 	ums_complist_id complist_id;
 
-	/**
-	 * @brief entry for pid to sched_worker hashtable
-	*/
-	struct hlist_node list;
-
 	/** 
 	 * @brief Worker task that executes completion elements and entry function
 	 *
@@ -72,6 +74,14 @@ struct ums_sched_worker {
 	*/
 	struct ums_context entry_ctx;
 
+	/**
+	 * @brief Completion elements reserved by this worker
+	 *
+	 * Reservation list passed to ums_complist_reserve: it lives as long
+	 * as the worker, so dequeue does not allocate any list head.
+	*/
+	struct list_head reserved;
+
 	/** 
 	 * @brief Stat on the time required for context switch
 	*/
@@ -96,6 +106,112 @@ struct ums_sched_worker {
 	 * This files contains various info on this scheduler thread
 	*/
 	struct proc_dir_entry *proc_info_file;
+
+	/**
+	 * @brief Control page shared with user space
+	 *
+	 * Read-only copy of current_elem, complist_id and of the switch
+	 * stats, mapped by the scheduler thread with UMS_MMAP_WORKER_PAGE.
+	 *
+	 * @sa worker_page_publish
+	*/
+	struct ums_worker_page *page;
+
+	/**
+	 * @brief Standby threads (ums_block_notifier.standby_node)
+	 *
+	 * @sa UMS_REQUEST_STANDBY
+	*/
+	struct list_head standby;
+
+	/** @brief Lock of standby and handover (taken from irq_work) */
+	spinlock_t standby_lock;
+
+	/**
+	 * @brief The worker task blocked but no standby was available: the
+	 * next thread that becomes standby takes over immediately
+	*/
+	int handover;
+
+	/**
+	 * @brief Deferred wake up of a standby thread
+	 *
+	 * The block is detected in sched_out with the runqueue lock held,
+	 * where no task can be woken up.
+	*/
+	struct irq_work handover_work;
+
+	/**
+	 * @brief Time slice of the running completion element
+	 *
+	 * Armed on the CPU of the worker when an element starts running, it
+	 * sends UMS_SIGNAL_PREEMPT when it expires.
+	 *
+	 * @sa slice_start
+	*/
+	struct hrtimer slice_timer;
+
+	/**
+	 * @brief Element whose time slice expired, 0 if none
+	 *
+	 * Set by slice_timer, cleared by the next switch: a late
+	 * UMS_SIGNAL_PREEMPT does not yield another element.
+	*/
+	ums_compelem_id preempt_elem;
+
+	/**
+	 * @brief Counter of the elements preempted on the worker
+	*/
+	unsigned int n_preempt;
+};
+
+/**
+ * @struct ums_block_notifier
+ *
+ * @brief Preempt notifier of a task that hosts (or can host) a sched worker
+ *
+ * One for each worker or standby task, registered in the task itself. It
+ * detects the block of the task while it runs a completion element and it
+ * links the task to its worker (see get_worker_by_current).
+ *
+ * @note The notifier is unregistered and freed by the task itself when it
+ *	exits (see ums_task_exit), each notifier pins the module.
+*/
+struct ums_block_notifier {
+	/** @brief preempt notifier registered in task */
+	struct preempt_notifier notifier;
+
+	/** @brief worker hosted by task, if worker->worker is task */
+	struct ums_sched_worker *worker;
+
+	/** @brief reference of the scheduler that owns worker, it keeps the
+	 * worker allocated as long as the notifier points to it */
+	struct id_ref *sched_ref;
+
+	/**
+	 * @brief task runs a completion element in user mode
+	 *
+	 * Cleared when task enters the module and set when it leaves it (see
+	 * ums_sched_kernel_enter): the sleeps inside the module are not
+	 * blocks of the element. Only task writes it.
+	*/
+	int user_mode;
+
+	/** @brief owner task */
+	struct task_struct *task;
+
+	/** @brief completion element that task was running when it blocked,
+	 * 0 if none */
+	ums_compelem_id blocked_elem;
+
+	/** @brief UMS_SIGNAL_BLOCKED was sent for blocked_elem */
+	int signalled;
+
+	/** @brief set when task must take over the worker */
+	int takeover;
+
+	/** @brief entry of ums_sched_worker.standby */
+	struct list_head standby_node;
 };
 
 struct ums_scheduler {
@@ -111,6 +227,17 @@ struct ums_scheduler {
 	*/
 	struct mm_struct *mm;
 
+	/**
+	 * @brief Session that owns the scheduler and its completion list
+	*/
+	struct ums_session *session;
+
+	/**
+	 * @brief Set by deinit_ums_scheduler, the users that still hold a
+	 * reference must not register anything in the scheduler anymore
+	*/
+	int dead;
+
 	/**
 	 * @brief Completion list linked to the scheduler
 	 *
@@ -119,22 +246,25 @@ struct ums_scheduler {
 	*/
 	ums_complist_id	comp_id;
 
-	/** 
-	 * @brief hash table list node
-	 *
-	 * used by ums_sched_hash hash table
+	/**
+	 * @brief CPUs that have a worker, fixed at the creation
 	*/
-	struct hlist_node			list;
+	cpumask_var_t				cpus;
 
 	/**
 	 * @brier sched worker threads
 	 *
-	 * Workers that will run on the CPUs
+	 * Workers that will run on the CPUs, NULL for the CPUs that are not
+	 * in cpus
 	*/
 	struct ums_sched_worker __percpu	**workers;
 
-	/* TODO: remove? */
-	struct list_head			wait_procs;
+	/**
+	 * @brief Threads waiting for the removal of the scheduler (dead)
+	 *
+	 * @sa ums_sched_wait
+	*/
+	wait_queue_head_t			end_wait;
 
 	/**
 	 * @brief procfs directory 
@@ -145,9 +275,4 @@ struct ums_scheduler {
 	struct proc_dir_entry			*proc_dir;
 };
 
-struct ums_sched_wait {
-	struct task_struct *task;
-	struct list_head list;
-};
-
 #endif /* __UMS_SCHEDULER_INTERNAL_H__ */
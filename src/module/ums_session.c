@@ -0,0 +1,88 @@
+/**
+ * @author Alberto Bombardelli
+ *
+ * @file ums_session.c
+ *
+ * @brief Implementation file of the session sub-module
+ *
+ * @sa ums_session.h
+*/
+#include "ums_session.h"
+#include "ums_scheduler.h"
+#include "ums_complist.h"
+#include "ums_proc.h"
+#include "id_ref.h"
+
+#include <linux/slab.h>
+
+/**
+ * @brief Atomic counter for the session ids
+ *
+ * The session ids are only used to name the proc directories.
+*/
+static atomic_t ums_session_counter = ATOMIC_INIT(0);
+
+/**
+ * @brief Create a new session
+ *
+ * Initialize the tables and create the proc directories of the session.
+ *
+ * @return the new session, NULL if it cannot be allocated
+ *
+ * @sa ums_session_destroy
+*/
+struct ums_session *ums_session_create(void)
+{
+	struct ums_session *session;
+	int res;
+
+	session = kzalloc(sizeof(struct ums_session), GFP_KERNEL);
+
+	if (unlikely(! session))
+		return NULL;
+
+	session->id = atomic_inc_return(&ums_session_counter);
+
+	res = id_registry_init(&session->scheds);
+	res |= id_registry_init(&session->complists);
+	res |= id_registry_init(&session->compelems);
+
+	if (unlikely(res)) {
+		/* free_percpu ignores the batches never allocated */
+		id_registry_destroy(&session->scheds);
+		id_registry_destroy(&session->complists);
+		id_registry_destroy(&session->compelems);
+		kfree(session);
+		return NULL;
+	}
+
+	ums_proc_geniddir(session->id, ums_proc_root(), &session->proc_dir);
+
+	ums_sched_session_init(session);
+	ums_complist_session_init(session);
+
+	return session;
+}
+
+/**
+ * @brief Destroy a session and all its objects
+ *
+ * @param[in] session: session to destroy
+ *
+ * Called when the last reference to the device file is dropped, so no
+ * request of the session can run concurrently.
+*/
+void ums_session_destroy(struct ums_session *session)
+{
+	/* the completion lists remove their schedulers */
+	ums_complist_session_deinit(session);
+	ums_sched_session_deinit(session);
+
+	ums_proc_delete(session->proc_dir);
+
+	id_registry_destroy(&session->scheds);
+	id_registry_destroy(&session->complists);
+	id_registry_destroy(&session->compelems);
+
+	kfree(session);
+}
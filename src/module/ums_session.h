@@ -0,0 +1,74 @@
+/**
+ * @author Alberto Bombardelli
+ *
+ * @file ums_session.h
+ *
+ * @brief Public header of the ums session sub-module
+ *
+ * A session is created by each open of the ums device and it is stored in
+ * file->private_data. It owns the identifiers, the tables and the proc
+ * directories of the schedulers, completion lists and completion elements
+ * created through that file: independent users of the module never share an
+ * id space or a registry.
+ *
+ * To create and destroy a session:
+ * @code
+ * session = ums_session_create();
+ * ...
+ * ums_session_destroy(session);
+ * @endcode
+ *
+ * The proc files of a session are in /proc/ums/<session id>/.
+ *
+ * @sa ums_session.c
+*/
+#ifndef __UMS_SESSION_H__
+#define __UMS_SESSION_H__
+
+#include "ums_scheduler.h"
+#include "ums_complist.h"
+#include "id_ref.h"
+
+#include <linux/atomic.h>
+#include <linux/percpu.h>
+#include <linux/xarray.h>
+#include <linux/proc_fs.h>
+
+/**
+ * @struct ums_session
+ *
+ * @brief Objects created through an open file of the ums device
+*/
+struct ums_session {
+	/** @brief global identifier, name of the proc directory */
+	int id;
+
+	/*
+	 * The registries serialize their writers with their own lock, the
+	 * readers use RCU and a reference (id_ref) of the object.
+	*/
+
+	/** @brief schedulers registry (id_ref by id) */
+	struct id_registry scheds;
+
+	/** @brief completion lists registry (id_ref by id) */
+	struct id_registry complists;
+
+	/** @brief completion elements registry (id_ref by id) */
+	struct id_registry compelems;
+
+	/** @brief proc directory /proc/ums/<id> */
+	struct proc_dir_entry *proc_dir;
+
+	/** @brief proc directory of the schedulers */
+	struct proc_dir_entry *sched_dir;
+
+	/** @brief proc directory of the completion lists */
+	struct proc_dir_entry *complist_dir;
+};
+
+struct ums_session *ums_session_create(void);
+
+void ums_session_destroy(struct ums_session *session);
+
+#endif /* __UMS_SESSION_H__ */
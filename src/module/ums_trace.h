@@ -0,0 +1,153 @@
+/**
+ * @author Alberto Bombardelli
+ *
+ * @file ums_trace.h
+ *
+ * @brief Tracepoints of the ums module
+ *
+ * Every state transition of the module (reservation, execution, yield,
+ * store of the registers, completion element creation/removal and scheduler
+ * thread registration) is exposed as a tracepoint of the `ums` system.
+ * Each event carries the completion list, completion element, scheduler and
+ * CPU identifiers, so perf/trace-cmd can attribute the run time of every
+ * completion element to its scheduler thread:
+ *
+ * @code
+ * > trace-cmd record -e ums -e sched:sched_switch ./test1
+ * > perf record -e 'ums:*' -a
+ * @endcode
+ *
+ * @note The tracepoints are created in ums_device.c (CREATE_TRACE_POINTS),
+ *	the other files only include this header.
+*/
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM ums
+
+#if !defined(__UMS_TRACE_H__) || defined(TRACE_HEADER_MULTI_READ)
+#define __UMS_TRACE_H__
+
+#include <linux/tracepoint.h>
+
+/**
+ * @brief Class of the events that involve a single completion element
+ *
+ * A zero value means "none" (e.g. sched is 0 when the element has no host)
+*/
+DECLARE_EVENT_CLASS(ums_compelem_class,
+
+	TP_PROTO(int complist, int compelem, int sched),
+
+	TP_ARGS(complist, compelem, sched),
+
+	TP_STRUCT__entry(
+		__field(int, complist)
+		__field(int, compelem)
+		__field(int, sched)
+		__field(int, cpu)
+	),
+
+	TP_fast_assign(
+		__entry->complist = complist;
+		__entry->compelem = compelem;
+		__entry->sched = sched;
+		__entry->cpu = raw_smp_processor_id();
+	),
+
+	TP_printk("complist=%d compelem=%d sched=%d cpu=%d",
+		  __entry->complist, __entry->compelem,
+		  __entry->sched, __entry->cpu)
+);
+
+/** @brief A completion element has been reserved by a scheduler thread */
+DEFINE_EVENT(ums_compelem_class, ums_reserve,
+	TP_PROTO(int complist, int compelem, int sched),
+	TP_ARGS(complist, compelem, sched));
+
+/** @brief A scheduler thread switched to a completion element */
+DEFINE_EVENT(ums_compelem_class, ums_exec,
+	TP_PROTO(int complist, int compelem, int sched),
+	TP_ARGS(complist, compelem, sched));
+
+/** @brief A completion element yielded to its scheduler thread */
+DEFINE_EVENT(ums_compelem_class, ums_yield,
+	TP_PROTO(int complist, int compelem, int sched),
+	TP_ARGS(complist, compelem, sched));
+
+/** @brief A completion element has been parked in user space */
+DEFINE_EVENT(ums_compelem_class, ums_park,
+	TP_PROTO(int complist, int compelem, int sched),
+	TP_ARGS(complist, compelem, sched));
+
+/** @brief A scheduler thread blocked in a completion element */
+DEFINE_EVENT(ums_compelem_class, ums_block,
+	TP_PROTO(int complist, int compelem, int sched),
+	TP_ARGS(complist, compelem, sched));
+
+/** @brief A standby thread took over a scheduler thread (compelem is 0) */
+DEFINE_EVENT(ums_compelem_class, ums_takeover,
+	TP_PROTO(int complist, int compelem, int sched),
+	TP_ARGS(complist, compelem, sched));
+
+/** @brief A completion element used up its time slice and yielded */
+DEFINE_EVENT(ums_compelem_class, ums_preempt,
+	TP_PROTO(int complist, int compelem, int sched),
+	TP_ARGS(complist, compelem, sched));
+
+/** @brief The context of a completion element has been stored */
+DEFINE_EVENT(ums_compelem_class, ums_store_reg,
+	TP_PROTO(int complist, int compelem, int sched),
+	TP_ARGS(complist, compelem, sched));
+
+/** @brief A new completion element has been added to its list */
+DEFINE_EVENT(ums_compelem_class, ums_compelem_add,
+	TP_PROTO(int complist, int compelem, int sched),
+	TP_ARGS(complist, compelem, sched));
+
+/** @brief A completion element has been removed from its list */
+DEFINE_EVENT(ums_compelem_class, ums_compelem_remove,
+	TP_PROTO(int complist, int compelem, int sched),
+	TP_ARGS(complist, compelem, sched));
+
+/** @brief A new scheduler thread has been registered (compelem is 0) */
+DEFINE_EVENT(ums_compelem_class, ums_sched_register,
+	TP_PROTO(int complist, int compelem, int sched),
+	TP_ARGS(complist, compelem, sched));
+
+/**
+ * @brief A completion element switched directly to another one
+*/
+TRACE_EVENT(ums_switch_to,
+
+	TP_PROTO(int complist, int prev, int next, int sched),
+
+	TP_ARGS(complist, prev, next, sched),
+
+	TP_STRUCT__entry(
+		__field(int, complist)
+		__field(int, prev)
+		__field(int, next)
+		__field(int, sched)
+		__field(int, cpu)
+	),
+
+	TP_fast_assign(
+		__entry->complist = complist;
+		__entry->prev = prev;
+		__entry->next = next;
+		__entry->sched = sched;
+		__entry->cpu = raw_smp_processor_id();
+	),
+
+	TP_printk("complist=%d prev=%d next=%d sched=%d cpu=%d",
+		  __entry->complist, __entry->prev, __entry->next,
+		  __entry->sched, __entry->cpu)
+);
+
+#endif /* __UMS_TRACE_H__ */
+
+/* This part must be outside protection */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE ums_trace
+#include <trace/define_trace.h>
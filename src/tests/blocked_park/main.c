@@ -0,0 +1,134 @@
+#define _GNU_SOURCE
+#include "../../user/ums_api.h"
+#include <sched.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+/*
+ * Block notification and BLOCKED_PARK: a single scheduler thread (CPU 0)
+ * runs an element that sleeps in the kernel. The standby thread must take
+ * over (ExecuteUmsThread returns UMS_EXEC_BLOCKED) and run the other
+ * elements meanwhile, then the sleeper is parked back in the completion
+ * list when it wakes up and it must end like the others.
+*/
+
+#define N_WORKERS 3
+#define SLEEP_TIME 1
+
+/* shared by the clones (CLONE_VM) */
+static int finished = 0;
+static int sleeper_done = 0;
+static int ran_while_blocked = 0;
+static int blocked_returns = 0;
+
+static int sleeper(int ums_sched);
+
+static int worker(int ums_sched);
+
+static int entry_point(int ums_sched);
+
+int main(void) {
+	int i;
+	struct ums_caps caps;
+	cpu_set_t cpus;
+	ums_sched_id sched_id;
+	ums_complist_id complist_id;
+
+	if (GetUmsCapabilities(&caps) ||
+	    ! (caps.caps & UMS_CAP_BLOCK_NOTIFY)) {
+		fprintf(stderr, "blocked_park: not supported, skipped\n");
+		return 0;
+	}
+
+	if (UmsSetBlockNotification(1)) {
+		fprintf(stderr, "Fail enabling the block notification\n");
+		return -1;
+	}
+
+	if (CreateEmptyUmsCompletionList(&complist_id)) {
+		fprintf(stderr, "Fail creating complist\n");
+		return -1;
+	}
+
+	CreateUmsCompletionElement(complist_id, sleeper);
+
+	for (i = 0; i < N_WORKERS; i++)
+		CreateUmsCompletionElement(complist_id, worker);
+
+	/* the elements register asynchronously */
+	sleep(1);
+
+	CPU_ZERO(&cpus);
+	CPU_SET(0, &cpus);
+
+	if (EnterUmsSchedulingMode(entry_point, complist_id, &cpus,
+				   &sched_id)) {
+		fprintf(stderr, "Fail entering scheduling mode\n");
+		return -1;
+	}
+
+	WaitUmsChildren();
+
+	if (finished != N_WORKERS + 1 || ! sleeper_done ||
+	    ! blocked_returns) {
+		printf("blocked_park: FAIL (finished %d, sleeper %d, "
+		       "blocked returns %d)\n",
+		       finished, sleeper_done, blocked_returns);
+		return 1;
+	}
+
+	if (! ran_while_blocked)
+		fprintf(stderr, "blocked_park: the sleeper ran last\n");
+
+	printf("blocked_park: OK\n");
+	return 0;
+}
+
+static int sleeper(int ums_sched)
+{
+	fprintf(stderr, "I am completion element %d, sleeping\n", ums_sched);
+
+	/* blocks in the kernel: the standby thread takes over the CPU */
+	sleep(SLEEP_TIME);
+
+	__atomic_store_n(&sleeper_done, 1, __ATOMIC_RELEASE);
+	__atomic_add_fetch(&finished, 1, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+static int worker(int ums_sched)
+{
+	fprintf(stderr, "I am completion element %d\n", ums_sched);
+
+	if (! __atomic_load_n(&sleeper_done, __ATOMIC_ACQUIRE))
+		__atomic_add_fetch(&ran_while_blocked, 1, __ATOMIC_RELAXED);
+
+	__atomic_add_fetch(&finished, 1, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+static int entry_point(int ums_sched)
+{
+	int res_len;
+	int shared[2];
+
+	while (__atomic_load_n(&finished, __ATOMIC_ACQUIRE) <= N_WORKERS) {
+		int res;
+
+		if (DequeueUmsCompletionListItems(1, shared, &res_len) ||
+		    res_len <= 0)
+			return -1;
+
+		res = ExecuteUmsThread(shared[0]);
+
+		if (res == UMS_EXEC_BLOCKED)
+			__atomic_add_fetch(&blocked_returns, 1,
+					   __ATOMIC_RELAXED);
+	}
+
+	return 0;
+}
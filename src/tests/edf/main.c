@@ -0,0 +1,151 @@
+#define _GNU_SOURCE
+#include "../../user/ums_api.h"
+#include <sched.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * EDF ordering: the elements of a UMS_POLICY_EDF completion list are
+ * created in a shuffled order of deadline and they are all ready before a
+ * single scheduler thread (CPU 0) starts: they must run by earliest
+ * deadline.
+*/
+
+#define N_ELEMS 4
+
+/* deadline gap between two consecutive jobs in ns */
+#define DEADLINE_STEP 10000000ULL
+
+/* shared by the clones (CLONE_VM) */
+static int order[N_ELEMS];
+static int finished = 0;
+
+static int job0(int ums_sched);
+static int job1(int ums_sched);
+static int job2(int ums_sched);
+static int job3(int ums_sched);
+
+static int entry_point(int ums_sched);
+
+int main(void) {
+	int i, err = 0;
+	struct ums_caps caps;
+	struct timespec now;
+	unsigned long long base;
+	cpu_set_t cpus;
+	ums_sched_id sched_id;
+	ums_complist_id complist_id;
+
+	/* job k has the k-th deadline, they are created shuffled */
+	ums_function funcs[N_ELEMS] = { job0, job1, job2, job3 };
+	int created[N_ELEMS] = { 2, 0, 3, 1 };
+
+	if (GetUmsCapabilities(&caps) || ! (caps.caps & UMS_CAP_EDF)) {
+		fprintf(stderr, "edf: not supported, skipped\n");
+		return 0;
+	}
+
+	if (CreateEmptyUmsCompletionList(&complist_id)) {
+		fprintf(stderr, "Fail creating complist\n");
+		return -1;
+	}
+
+	/* the policy changes only while the list is empty */
+	if (UmsSetCompletionListPolicy(complist_id, UMS_POLICY_EDF, 0)) {
+		fprintf(stderr, "Fail setting the EDF policy\n");
+		return -1;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	base = now.tv_sec * 1000000000ULL + now.tv_nsec + 1000000000ULL;
+
+	for (i = 0; i < N_ELEMS; i++) {
+		int k = created[i];
+
+		CreateUmsCompletionElementDeadline(complist_id, funcs[k],
+						   base + k * DEADLINE_STEP);
+	}
+
+	/* the elements register asynchronously */
+	sleep(1);
+
+	CPU_ZERO(&cpus);
+	CPU_SET(0, &cpus);
+
+	if (EnterUmsSchedulingMode(entry_point, complist_id, &cpus,
+				   &sched_id)) {
+		fprintf(stderr, "Fail entering scheduling mode\n");
+		return -1;
+	}
+
+	WaitUmsChildren();
+
+	if (finished != N_ELEMS)
+		err = 1;
+
+	for (i = 0; i < N_ELEMS; i++)
+		if (order[i] != i)
+			err = 1;
+
+	if (err) {
+		printf("edf: FAIL (order");
+		for (i = 0; i < N_ELEMS; i++)
+			printf(" %d", order[i]);
+		printf(")\n");
+		return 1;
+	}
+
+	printf("edf: OK\n");
+	return 0;
+}
+
+static void record(int k)
+{
+	int pos = __atomic_fetch_add(&finished, 1, __ATOMIC_ACQ_REL);
+
+	if (pos < N_ELEMS)
+		order[pos] = k;
+}
+
+static int job0(int ums_sched)
+{
+	record(0);
+	return 0;
+}
+
+static int job1(int ums_sched)
+{
+	record(1);
+	return 0;
+}
+
+static int job2(int ums_sched)
+{
+	record(2);
+	return 0;
+}
+
+static int job3(int ums_sched)
+{
+	record(3);
+	return 0;
+}
+
+static int entry_point(int ums_sched)
+{
+	int res_len;
+	int shared[2];
+
+	while (__atomic_load_n(&finished, __ATOMIC_ACQUIRE) < N_ELEMS) {
+		if (DequeueUmsCompletionListItems(1, shared, &res_len) ||
+		    res_len <= 0)
+			return -1;
+
+		ExecuteUmsThread(shared[0]);
+	}
+
+	return 0;
+}
@@ -0,0 +1,125 @@
+#include "../../user/ums_api.h"
+#include <errno.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+/*
+ * Ring dequeue/exec path: every scheduler thread reserves and executes the
+ * elements with a single UmsRingSubmit (a dequeue entry and an exec entry
+ * linked with UMS_SQE_F_LINK_DEQUEUE). Each element must run exactly once.
+*/
+
+#define N_ELEMS 8
+
+#define DEQUEUE_TAG 1
+#define EXEC_TAG 2
+
+/* shared by the clones (CLONE_VM) */
+static int finished = 0;
+static int execs = 0;
+static int errors = 0;
+
+static int job(int ums_sched);
+
+static int entry_point(int ums_sched);
+
+int main(void) {
+	int i;
+	struct ums_caps caps;
+	ums_sched_id sched_id;
+	ums_complist_id complist_id;
+	ums_function funcs[N_ELEMS];
+
+	if (GetUmsCapabilities(&caps) || ! (caps.caps & UMS_CAP_RING)) {
+		fprintf(stderr, "ring: not supported, skipped\n");
+		return 0;
+	}
+
+	for (i = 0; i < N_ELEMS; i++)
+		funcs[i] = job;
+
+	if (CreateUmsCompletionList(&complist_id, funcs, N_ELEMS)) {
+		fprintf(stderr, "Fail creating complist\n");
+		return -1;
+	}
+
+	if (EnterUmsSchedulingMode(entry_point, complist_id, NULL, &sched_id)) {
+		fprintf(stderr, "Fail entering scheduling mode\n");
+		return -1;
+	}
+
+	WaitUmsChildren();
+
+	if (finished != N_ELEMS || execs != N_ELEMS || errors) {
+		printf("ring: FAIL (finished %d, execs %d, errors %d)\n",
+		       finished, execs, errors);
+		return 1;
+	}
+
+	printf("ring: OK\n");
+	return 0;
+}
+
+static int job(int ums_sched)
+{
+	fprintf(stderr, "I am completion element %d\n", ums_sched);
+
+	__atomic_add_fetch(&finished, 1, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+static int entry_point(int ums_sched)
+{
+	struct ums_user_ring ring;
+	struct ums_sqe *sqe;
+	struct ums_cqe *cqe;
+
+	if (UmsRingInit(&ring, 4)) {
+		__atomic_add_fetch(&errors, 1, __ATOMIC_RELAXED);
+		return -1;
+	}
+
+	while (__atomic_load_n(&finished, __ATOMIC_ACQUIRE) < N_ELEMS) {
+		int again = 0;
+
+		sqe = UmsRingGetSqe(&ring);
+		sqe->opcode = UMS_RING_OP_DEQUEUE;
+		sqe->len = 1;
+		sqe->user_data = DEQUEUE_TAG;
+
+		sqe = UmsRingGetSqe(&ring);
+		sqe->opcode = UMS_RING_OP_EXEC;
+		sqe->flags = UMS_SQE_F_LINK_DEQUEUE;
+		sqe->user_data = EXEC_TAG;
+
+		/* it returns when the executed element gives the thread back */
+		if (UmsRingSubmit(&ring) < 0)
+			break;
+
+		while ((cqe = UmsRingPeekCqe(&ring))) {
+			if (cqe->user_data == DEQUEUE_TAG && cqe->res == -EAGAIN)
+				again = 1;
+			/* the list is gone */
+			else if (cqe->user_data == DEQUEUE_TAG && cqe->res < 0)
+				again = -1;
+			else if (cqe->user_data == EXEC_TAG && ! cqe->res)
+				__atomic_add_fetch(&execs, 1, __ATOMIC_RELAXED);
+
+			UmsRingCqeSeen(&ring);
+		}
+
+		if (again < 0)
+			break;
+
+		/* the dequeue of the ring never sleeps */
+		if (again)
+			usleep(1000);
+	}
+
+	UmsRingExit(&ring);
+
+	return 0;
+}
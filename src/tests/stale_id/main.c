@@ -0,0 +1,147 @@
+#define _GNU_SOURCE
+#include "../../user/ums_api.h"
+#include <errno.h>
+#include <sched.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+/*
+ * Stale identifier after the reuse of its slot: the element "first" ends
+ * and a new element is created on the same CPU, so it gets the slot of
+ * "first" with the next generation. The old identifier must be rejected
+ * (-ENOENT) while the new one is accepted. A "keeper" element yields until
+ * the end of the check, so that the completion list stays alive.
+*/
+
+/* index bits of an identifier of the module (see id_ref.h) */
+#define ID_INDEX_MASK ((1 << 20) - 1)
+
+/* maximum wait for the removal of the first element in ms */
+#define REMOVE_TIMEOUT 5000
+
+/* shared by the clones (CLONE_VM) */
+static ums_compelem_id old_id = 0;
+static ums_compelem_id new_id = 0;
+static int stale_res = 0;
+static int new_res = -1;
+static int checked = 0;
+
+static int first(int ums_sched);
+
+static int second(int ums_sched);
+
+static int keeper(int ums_sched);
+
+static int entry_point(int ums_sched);
+
+int main(void) {
+	int i;
+	cpu_set_t cpus;
+	ums_sched_id sched_id;
+	ums_complist_id complist_id;
+
+	/* the clones inherit it: every id is reserved and freed on CPU 0 */
+	CPU_ZERO(&cpus);
+	CPU_SET(0, &cpus);
+	sched_setaffinity(0, sizeof(cpus), &cpus);
+
+	if (CreateEmptyUmsCompletionList(&complist_id)) {
+		fprintf(stderr, "Fail creating complist\n");
+		return -1;
+	}
+
+	CreateUmsCompletionElement(complist_id, keeper);
+	CreateUmsCompletionElement(complist_id, first);
+
+	if (EnterUmsSchedulingMode(entry_point, complist_id, &cpus,
+				   &sched_id)) {
+		fprintf(stderr, "Fail entering scheduling mode\n");
+		return -1;
+	}
+
+	/* wait for the removal of the first element */
+	for (i = 0; i < REMOVE_TIMEOUT; i++) {
+		ums_compelem_id id = __atomic_load_n(&old_id, __ATOMIC_ACQUIRE);
+
+		if (id && UmsSetPriority(id, UMS_PRIO_NORMAL) == -ENOENT)
+			break;
+
+		usleep(1000);
+	}
+
+	if (i == REMOVE_TIMEOUT) {
+		printf("stale_id: FAIL (first element %d never removed)\n",
+		       old_id);
+		__atomic_store_n(&checked, 1, __ATOMIC_RELEASE);
+		WaitUmsChildren();
+		return 1;
+	}
+
+	CreateUmsCompletionElement(complist_id, second);
+
+	WaitUmsChildren();
+
+	if (! new_id || new_id == old_id ||
+	    (new_id & ID_INDEX_MASK) != (old_id & ID_INDEX_MASK) ||
+	    stale_res != -ENOENT || new_res) {
+		printf("stale_id: FAIL (old %d, new %d, stale res %d, "
+		       "new res %d)\n", old_id, new_id, stale_res, new_res);
+		return 1;
+	}
+
+	printf("stale_id: OK (old %d, new %d)\n", old_id, new_id);
+	return 0;
+}
+
+static int first(int ums_sched)
+{
+	fprintf(stderr, "I am completion element %d\n", ums_sched);
+
+	__atomic_store_n(&old_id, ums_sched, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+static int second(int ums_sched)
+{
+	fprintf(stderr, "I am completion element %d\n", ums_sched);
+
+	new_id = ums_sched;
+	stale_res = UmsSetPriority(old_id, UMS_PRIO_NORMAL);
+	new_res = UmsSetPriority(new_id, UMS_PRIO_NORMAL);
+
+	__atomic_store_n(&checked, 1, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+static int keeper(int ums_sched)
+{
+	fprintf(stderr, "I am completion element %d, keeping the list\n",
+		ums_sched);
+
+	while (! __atomic_load_n(&checked, __ATOMIC_ACQUIRE)) {
+		usleep(1000);
+		UmsThreadYield();
+	}
+
+	return 0;
+}
+
+static int entry_point(int ums_sched)
+{
+	int res_len;
+	int shared[2];
+
+	while (1) {
+		if (DequeueUmsCompletionListItems(1, shared, &res_len) ||
+		    res_len <= 0)
+			return -1;
+
+		ExecuteUmsThread(shared[0]);
+	}
+
+	return 0;
+}
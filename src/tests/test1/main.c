@@ -48,8 +48,8 @@ int main(void) {
 
 	fprintf(stderr, "Completion list: %d\n", complist_id);
 
-	EnterUmsSchedulingMode(entry_point, complist_id, &sched_id);
-	EnterUmsSchedulingMode(entry_point, complist_id, &sched_id2);
+	EnterUmsSchedulingMode(entry_point, complist_id, NULL, &sched_id);
+	EnterUmsSchedulingMode(entry_point, complist_id, NULL, &sched_id2);
 
 	if (WaitUmsChildren())
 		fprintf(stderr, "Oh no, res: %d", err ? err : (++err));
@@ -21,21 +21,33 @@
 #include <sys/sysinfo.h>
 #include <sys/wait.h>
 #include <fcntl.h>
+#include <sys/mman.h>
 #include "ll/list.h"
 #include <string.h>
+#include <errno.h>
+#include <sys/syscall.h>
+#include <asm/prctl.h>
 
 /**
  * @brief Size of the stack of the threads created by clone syscalls
 */
 #define TASK_STACK_SIZE 65536
 
+/**
+ * @brief Parked elements resumed by a scheduler thread in hybrid mode
+ * before it asks the module for a ready element first
+ *
+ * @sa dequeue_items
+*/
+#define HYBRID_PARKED_BATCH 4
+
 /**
  * @brief Complist creation ioctl call
  *
  * @sa ums_device.h
  * @sa ums_complist_add
 */
-#define create_ums_complist(id)  ioctl(global_fd, UMS_REQUEST_NEW_COMPLETION_LIST, id)
+#define create_ums_complist(args) ioctl(global_fd, UMS_REQUEST_NEW_COMPLETION_LIST, args)
 
 /**
  * @brief Compelem creation ioctl call
@@ -43,7 +55,39 @@
  * @sa ums_device.h
  * @sa ums_compelem_add
 */
-#define create_ums_compelem(id)  ioctl(global_fd, UMS_REQUEST_REGISTER_COMPLETION_ELEM, id)
+#define create_ums_compelem(args) ioctl(global_fd, UMS_REQUEST_REGISTER_COMPLETION_ELEM_PRIO, args)
+
+/**
+ * @brief Compelem priority ioctl call
+ *
+ * @sa ums_device.h
+ * @sa ums_compelem_set_prio
+*/
+#define set_priority(args)	 ioctl(global_fd, UMS_REQUEST_SET_PRIORITY, args)
+
+/**
+ * @brief Compelem deadline ioctl call
+ *
+ * @sa ums_device.h
+ * @sa ums_compelem_set_deadline
+*/
+#define set_deadline(args)	 ioctl(global_fd, UMS_REQUEST_SET_DEADLINE, args)
+
+/**
+ * @brief Complist policy ioctl call
+ *
+ * @sa ums_device.h
+ * @sa ums_complist_set_policy
+*/
+#define set_complist_policy(args) ioctl(global_fd, UMS_REQUEST_SET_COMPLIST_POLICY, args)
+
+/**
+ * @brief Completion list idle spin ioctl call
+ *
+ * @sa ums_device.h
+ * @sa ums_complist_set_idle
+*/
+#define set_complist_idle(args) ioctl(global_fd, UMS_REQUEST_SET_COMPLIST_IDLE, args)
 
 /**
  * @brief UMS scheduler creation ioctl call
@@ -51,9 +95,24 @@
  * @sa ums_device.h
  * @sa ums_sched_add
 */
-#define enter_ums_sched(id)      ioctl(global_fd, UMS_REQUEST_ENTER_UMS_SCHEDULING, id)
+#define enter_ums_sched(args)    ioctl(global_fd, UMS_REQUEST_ENTER_UMS_SCHEDULING_CPUS, args)
 
-#define wait_ums_sched(id)       ioctl(global_fd, UMS_REQUEST_WAIT_UMS_SCHEDULER, id)
+/**
+ * @brief UMS scheduler wait ioctl call
+ *
+ * @sa ums_device.h
+ * @sa ums_sched_wait
+*/
+#define wait_ums_sched(args)     ioctl(global_fd, UMS_REQUEST_WAIT_UMS_SCHEDULER, args)
+
+/**
+ * @brief UMS scheduler or completion list wait with timeout ioctl call
+ *
+ * @sa ums_device.h
+ * @sa ums_sched_wait
+ * @sa ums_complist_wait
+*/
+#define wait_ums(args)           ioctl(global_fd, UMS_REQUEST_WAIT, args)
 
 /**
  * @brief yield ioctl call
@@ -61,7 +120,7 @@
  * @sa ums_device.h
  * @sa ums_sched_yield
 */
-#define thread_yield(id)         ioctl(global_fd, UMS_REQUEST_YIELD, id)
+#define thread_yield()           ioctl(global_fd, UMS_REQUEST_YIELD)
 
 /**
  * @brief complist execution ioctl call
@@ -70,7 +129,55 @@
  * @sa ums_sched_exec
  * @sa ums_compelem_exec
 */
-#define exec_thread(id)          ioctl(global_fd, UMS_REQUEST_EXEC, id)
+#define exec_thread(args)        ioctl(global_fd, UMS_REQUEST_EXEC, args)
+
+/**
+ * @brief complist execution with a time slice ioctl call
+ *
+ * @sa ums_device.h
+ * @sa ums_sched_exec
+*/
+#define exec_thread_budget(args) ioctl(global_fd, UMS_REQUEST_EXEC_BUDGET, args)
+
+/**
+ * @brief direct compelem to compelem switch ioctl call
+ *
+ * @sa ums_device.h
+ * @sa ums_sched_switch_to
+*/
+#define switch_to_thread(args)   ioctl(global_fd, UMS_REQUEST_SWITCH_TO, args)
+
+/**
+ * @brief standby thread registration ioctl call
+ *
+ * @sa ums_device.h
+ * @sa ums_sched_standby
+*/
+#define standby_thread(args)     ioctl(global_fd, UMS_REQUEST_STANDBY, args)
+
+/**
+ * @brief blocked element park ioctl call
+ *
+ * @sa ums_device.h
+ * @sa ums_sched_blocked_park
+*/
+#define blocked_park()           ioctl(global_fd, UMS_REQUEST_BLOCKED_PARK)
+
+/**
+ * @brief preempted element yield ioctl call
+ *
+ * @sa ums_device.h
+ * @sa ums_sched_preempt_yield
+*/
+#define preempt_yield()          ioctl(global_fd, UMS_REQUEST_PREEMPT_YIELD)
+
+/**
+ * @brief Completion list time slice ioctl call
+ *
+ * @sa ums_device.h
+ * @sa ums_complist_set_time_slice
+*/
+#define set_time_slice(args)     ioctl(global_fd, UMS_REQUEST_SET_TIME_SLICE, args)
 
 /**
  * @brief UMS scheduler thread creation ioctl call
@@ -78,7 +185,7 @@
  * @sa ums_device.h
  * @sa ums_sched_register_sched_thread
 */
-#define do_reg_thread(id)        ioctl(global_fd, UMS_REQUEST_REGISTER_SCHEDULER_THREAD, id)
+#define do_reg_thread(args)      ioctl(global_fd, UMS_REQUEST_REGISTER_SCHEDULER_THREAD, args)
 
 /**
  * @brief dequeue ioctl call
@@ -86,7 +193,23 @@
  * @sa ums_device.h
  * @sa ums_complist_reserve
 */
-#define dequeue_complist(id)	 ioctl(global_fd, UMS_REQUEST_DEQUEUE_COMPLETION_LIST, id)
+#define dequeue_complist(args)	 ioctl(global_fd, UMS_REQUEST_DEQUEUE_COMPLETION_LIST, args)
+
+/**
+ * @brief non-blocking dequeue ioctl call
+ *
+ * @sa ums_device.h
+ * @sa ums_complist_reserve
+*/
+#define try_dequeue_complist(args) ioctl(global_fd, UMS_REQUEST_TRY_DEQUEUE_COMPLETION_LIST, args)
+
+/**
+ * @brief complist poll descriptor ioctl call
+ *
+ * @sa ums_device.h
+ * @sa ums_complist_fd
+*/
+#define complist_fd(args)        ioctl(global_fd, UMS_REQUEST_COMPLIST_FD, args)
 
 /**
  * @brief Delete completion element ioctl call
@@ -94,7 +217,38 @@
  * @sa ums_device.h
  * @sa ums_compelem_remove
 */
-#define delete_compelem(id)	 ioctl(global_fd, UMS_REQUEST_REMOVE_COMPLETION_ELEM, id)
+#define delete_compelem(args)	 ioctl(global_fd, UMS_REQUEST_REMOVE_COMPLETION_ELEM, args)
+
+/**
+ * @brief Capabilities ioctl call
+ *
+ * @sa ums_device.h
+*/
+#define get_caps(caps)		 ioctl(global_fd, UMS_REQUEST_GET_CAPS, caps)
+
+/**
+ * @brief Ring creation ioctl call
+ *
+ * @sa ums_device.h
+ * @sa ums_ring_create
+*/
+#define setup_ring(params)	 ioctl(global_fd, UMS_REQUEST_RING_SETUP, params)
+
+/**
+ * @brief Ready ring creation ioctl call
+ *
+ * @sa ums_device.h
+ * @sa ums_complist_ready_ring_setup
+*/
+#define setup_ready_ring(args)	 ioctl(global_fd, UMS_REQUEST_READY_RING_SETUP, args)
+
+/**
+ * @brief Ring consumption ioctl call (on the ring file descriptor)
+ *
+ * @sa ums_device.h
+ * @sa ums_ring_enter
+*/
+#define enter_ring(fd, n)	 ioctl(fd, UMS_RING_REQUEST_ENTER, n)
 
 /**
  * @brief Macro to create a new thread using clone
@@ -133,6 +287,211 @@ struct sched_thread_args {
 	ums_function entry_point;
 };
 
+/**
+ * @struct compelem_thread_args
+ *
+ * @brief Struct to pass completion element info through clone
+ *
+ * @sa __reg_compelem
+*/
+struct compelem_thread_args {
+	ums_complist_id complist_id;
+	ums_function	func;
+	int		prio;
+	unsigned long long deadline;
+};
+
+/**
+ * @struct ums_user_ctx
+ *
+ * @brief User mode context of a hybrid switch
+ *
+ * A switch is a function call, so only the callee-saved registers (and the
+ * control words of the floating point units) must be saved.
+ *
+ * @sa __ums_ctx_save
+ * @sa __ums_ctx_swap
+*/
+struct ums_user_ctx {
+	unsigned long rsp;
+	unsigned long rbp;
+	unsigned long rbx;
+	unsigned long r12;
+	unsigned long r13;
+	unsigned long r14;
+	unsigned long r15;
+	unsigned long rip;
+	unsigned int mxcsr;
+	unsigned short fpucw;
+};
+
+/**
+ * @struct ums_user_elem
+ *
+ * @brief Completion element switched by the library in hybrid mode
+ *
+ * It lives on the stack of the completion element itself (see
+ * __reg_compelem), so it exists as long as the element.
+*/
+struct ums_user_elem {
+	ums_compelem_id id;
+	ums_complist_id complist_id;
+	/** context saved when the element was parked */
+	struct ums_user_ctx ctx;
+	/** entry of parked_list */
+	struct list_head list;
+};
+
+/**
+ * @brief Save the current context in ctx
+ *
+ * @return 0 when the context is saved, 1 when it is resumed
+*/
+int __ums_ctx_save(struct ums_user_ctx *ctx) __attribute__((returns_twice));
+
+/**
+ * @brief Save the current context in save and resume load
+ *
+ * @return 1 when the saved context is resumed
+*/
+int __ums_ctx_swap(struct ums_user_ctx *save, struct ums_user_ctx *load);
+
+/**
+ * @brief Resume ctx, never returns
+*/
+void __ums_ctx_jump(struct ums_user_ctx *ctx) __attribute__((noreturn));
+
+__asm__ (
+	"	.text\n"
+	"	.globl __ums_ctx_save\n"
+	"	.hidden __ums_ctx_save\n"
+	"	.type __ums_ctx_save, @function\n"
+	"__ums_ctx_save:\n"
+	"	movq (%rsp), %rax\n"
+	"	leaq 8(%rsp), %rcx\n"
+	"	movq %rcx, 0(%rdi)\n"
+	"	movq %rbp, 8(%rdi)\n"
+	"	movq %rbx, 16(%rdi)\n"
+	"	movq %r12, 24(%rdi)\n"
+	"	movq %r13, 32(%rdi)\n"
+	"	movq %r14, 40(%rdi)\n"
+	"	movq %r15, 48(%rdi)\n"
+	"	movq %rax, 56(%rdi)\n"
+	"	stmxcsr 64(%rdi)\n"
+	"	fnstcw 68(%rdi)\n"
+	"	xorl %eax, %eax\n"
+	"	ret\n"
+	"	.size __ums_ctx_save, .-__ums_ctx_save\n"
+	"\n"
+	"	.globl __ums_ctx_swap\n"
+	"	.hidden __ums_ctx_swap\n"
+	"	.type __ums_ctx_swap, @function\n"
+	"__ums_ctx_swap:\n"
+	"	movq (%rsp), %rax\n"
+	"	leaq 8(%rsp), %rcx\n"
+	"	movq %rcx, 0(%rdi)\n"
+	"	movq %rbp, 8(%rdi)\n"
+	"	movq %rbx, 16(%rdi)\n"
+	"	movq %r12, 24(%rdi)\n"
+	"	movq %r13, 32(%rdi)\n"
+	"	movq %r14, 40(%rdi)\n"
+	"	movq %r15, 48(%rdi)\n"
+	"	movq %rax, 56(%rdi)\n"
+	"	stmxcsr 64(%rdi)\n"
+	"	fnstcw 68(%rdi)\n"
+	"	movq %rsi, %rdi\n"
+	"	.globl __ums_ctx_jump\n"
+	"	.hidden __ums_ctx_jump\n"
+	"	.type __ums_ctx_jump, @function\n"
+	"__ums_ctx_jump:\n"
+	"	ldmxcsr 64(%rdi)\n"
+	"	fldcw 68(%rdi)\n"
+	"	movq 0(%rdi), %rsp\n"
+	"	movq 8(%rdi), %rbp\n"
+	"	movq 16(%rdi), %rbx\n"
+	"	movq 24(%rdi), %r12\n"
+	"	movq 32(%rdi), %r13\n"
+	"	movq 40(%rdi), %r14\n"
+	"	movq 48(%rdi), %r15\n"
+	"	movl $1, %eax\n"
+	"	jmpq *56(%rdi)\n"
+	"	.size __ums_ctx_swap, .-__ums_ctx_swap\n"
+);
+
+/**
+ * @struct ums_thread_info
+ *
+ * @brief Per scheduler thread data of the library
+ *
+ * The threads are created by clone without a new TLS, so __thread variables
+ * are shared by all of them: the library stores this struct in the GS base
+ * of each scheduler thread instead. The GS base follows the scheduler
+ * thread, so the completion elements it runs see the same struct.
+ *
+ * @sa get_thread_info
+*/
+struct ums_thread_info {
+	/** self pointer, read through %gs:0 */
+	struct ums_thread_info *self;
+	/** worker control page mapped read-only */
+	const struct ums_worker_page *page;
+	/** hybrid mode: context of the entry point */
+	struct ums_user_ctx entry_ctx;
+	/** hybrid mode: running element, NULL if the entry point runs */
+	struct ums_user_elem *running;
+	/** hybrid mode: parked element returned by the last dequeue */
+	struct ums_user_elem *reserved;
+	/** hybrid mode: element to park once its stack has been left */
+	struct ums_user_elem *park;
+	/** hybrid mode: last element executed through the module, it is
+	 * detached with UMS_EXEC_F_PARKED */
+	ums_compelem_id kernel_elem;
+	/** hybrid mode: parked elements returned since the last element
+	 * reserved from the module */
+	int n_parked;
+};
+
+/**
+ * @brief Hybrid mode flag, see UmsSetHybridMode
+*/
+static int hybrid_mode = 0;
+
+/**
+ * @brief Block notification flag, see UmsSetBlockNotification
+*/
+static int block_notify = 0;
+
+/**
+ * @brief Time slice flag: the UMS_SIGNAL_PREEMPT handler is installed, see
+ * UmsSetTimeSlice
+*/
+static int time_slice = 0;
+
+/**
+ * @brief Completion elements parked in user space (hybrid mode)
+*/
+static LIST_HEAD(parked_list);
+
+/**
+ * @brief Spin lock of parked_list
+*/
+static int parked_lock = 0;
+
+/**
+ * @brief Get the ums_thread_info of the calling scheduler thread
+ *
+ * @warning It must be called only by a scheduler thread (entry point or
+ *	completion element)
+*/
+static inline struct ums_thread_info *get_thread_info(void)
+{
+	struct ums_thread_info *info;
+
+	__asm__ volatile ("mov %%gs:0, %0" : "=r" (info));
+
+	return info;
+}
+
 /**
  * @struct id_elem
  *
@@ -147,70 +506,251 @@ struct id_elem {
 };
 
 static void register_threads(ums_sched_id sched_id,
-			     ums_function entry_point);
+			     ums_function entry_point,
+			     const cpu_set_t *cpus);
 
 static int __entry_point(void *sched_ep);
 
 static int __reg_thread(void *sched_thread);
 
-static int __reg_compelem(void *idxs);
+static int set_thread_info(void);
+
+static int __standby_thread(void *sched_thread);
+
+static void blocked_handler(int sig);
+
+static void preempt_handler(int sig);
+
+static int dequeue_items(int max_elements,
+			 ums_compelem_id *result_array,
+			 int *result_length,
+			 int do_sleep);
+
+static void parked_push(struct ums_user_elem *elem);
+
+static struct ums_user_elem *parked_pop(ums_complist_id complist_id,
+					ums_compelem_id id);
+
+static void finish_switch(void);
+
+static int hybrid_exec(ums_compelem_id next, unsigned int flags);
+
+static int __reg_compelem(void *elem_args);
 
 static void new_id_elem(int thread_id,
 			void *stack);
 
+/**
+ * @brief Get the ABI version and the capabilities of the ums module
+ *
+ * @param[out] caps: capabilities of the loaded module
+ *
+ * A caller should check that caps->abi_version is UMS_ABI_VERSION and use
+ * the UMS_CAP_* bits before relying on optional requests (e.g. rings).
+ *
+ * @return 0 if no error occured, -errno otherwise
+*/
+int GetUmsCapabilities(struct ums_caps *caps)
+{
+	OPEN_GLOBAL_FD();
+
+	return get_caps(caps) ? -errno : 0;
+}
+
+/**
+ * @brief Enable or disable the hybrid mode
+ *
+ * @param[in] enable: non-zero to enable the hybrid mode
+ *
+ * In hybrid mode the voluntary switches (UmsThreadYield, UmsThreadYieldTo
+ * and the execution of a yielded element) are done by the library in user
+ * space: the module executes an element only the first time and it is
+ * involved again only to create, block or remove the elements.
+ *
+ * @note It must be set before creating the completion elements, the entry
+ *	points must use DequeueUmsCompletionListItems and ExecuteUmsThread
+ *	(or the ready ring with ExecuteClaimedUmsThread).
+ *
+ * @return 0 if no error occured, -ENOTSUP if the module does not support
+ *	UMS_EXEC_F_PARKED
+*/
+int UmsSetHybridMode(int enable)
+{
+	struct ums_caps caps;
+
+	if (enable && (GetUmsCapabilities(&caps) ||
+		       ! (caps.caps & UMS_CAP_PARKED_EXEC)))
+		return -ENOTSUP;
+
+	if (enable && (block_notify || time_slice))
+		return -EINVAL;
+
+	hybrid_mode = !! enable;
+
+	return 0;
+}
+
+/**
+ * @brief Enable or disable the block notification
+ *
+ * @param[in] enable: non-zero to enable the block notification
+ *
+ * Each scheduler thread gets a standby thread on its CPU: when a completion
+ * element blocks in the kernel, the standby thread resumes the entry point
+ * and ExecuteUmsThread returns UMS_EXEC_BLOCKED. The blocked element goes
+ * back to the completion list once it wakes up.
+ *
+ * @note It must be set before EnterUmsSchedulingMode, it cannot be used
+ *	with the hybrid mode.
+ *
+ * @return 0 if no error occured, -ENOTSUP if the module does not support
+ *	UMS_REQUEST_STANDBY, -EINVAL in hybrid mode, -errno if the signal
+ *	handler cannot be installed
+*/
+int UmsSetBlockNotification(int enable)
+{
+	struct ums_caps caps;
+	struct sigaction act;
+
+	if (! enable) {
+		block_notify = 0;
+		return 0;
+	}
+
+	if (GetUmsCapabilities(&caps) || ! (caps.caps & UMS_CAP_BLOCK_NOTIFY))
+		return -ENOTSUP;
+
+	if (hybrid_mode)
+		return -EINVAL;
+
+	/* the scheduler threads copy the handler when they are cloned. The
+	 * handler does not return on the thread that takes the signal (it
+	 * becomes a standby thread and resumes an entry point), so the signal
+	 * must not stay blocked on it */
+	memset(&act, 0, sizeof(act));
+	act.sa_handler = blocked_handler;
+	act.sa_flags = SA_RESTART | SA_NODEFER;
+	sigemptyset(&act.sa_mask);
+
+	if (sigaction(UMS_SIGNAL_BLOCKED, &act, NULL))
+		return -errno;
+
+	block_notify = 1;
+
+	return 0;
+}
+
 /**
  * @brief Function to register an new scheduler with his threads
  *
  * @param[in] entry_point: Entry point function executed by the scheduler threads
  * @param[in] complist_id: completion list to be linked with the scheduler
+ * @param[in] cpus: CPUs of the scheduler threads, NULL for the affinity of
+ *	the caller (which is already restricted by its cgroup cpuset)
  * @param[out] result: resulting scheduler identifier
  *
- * The function register the scheduler, creates new threads (one for each CPU)
- * that will be execute the complist jobs.
+ * The function register the scheduler, creates new threads (one for each CPU
+ * of cpus) that will be execute the complist jobs.
  * The scheduler will be automatically removed when all the job of the completion
  * element will be completed.
  *
- * @return 0 if no error non-zero otherwise
+ * @return 0 if no error, -errno otherwise
 */
 int EnterUmsSchedulingMode(ums_function entry_point,
                            ums_complist_id complist_id,
+			   const cpu_set_t *cpus,
 			   ums_sched_id *result)
 {
-	int buff = 0;
-	int err = 1;
+	cpu_set_t set;
+	struct ums_sched_cpus_args args = { 0 };
 
 	OPEN_GLOBAL_FD();
 
-	buff = complist_id;
+	if (! cpus) {
+		if (sched_getaffinity(0, sizeof(set), &set))
+			return -errno;
 
-	err = enter_ums_sched(&buff);
+		cpus = &set;
+	}
+
+	args.complist_id = complist_id;
+	args.cpus = (__u64)(unsigned long)cpus;
+	args.cpus_size = sizeof(*cpus);
 
-	if (err) {
+	if (enter_ums_sched(&args)) {
 		fprintf(stderr, "Error: cannot create User Mode Scheduler thread!\n");
-		return err;
+		return -errno;
 	}
 
-	*result = buff;
+	*result = args.sched_id;
 
-	register_threads(*result, entry_point);
+	register_threads(*result, entry_point, cpus);
 
-	return err;
+	return 0;
 }
 
 /**
  * @brief Block this thread until the ums_scheduler get destroyed
  *
- * @return 0 if the wait was successful, non-zero otherwise
+ * @return 0 if the wait was successful, -errno otherwise
 */
 int WaitUmsScheduler(ums_sched_id sched_id)
 {
-	int err;
+	struct ums_sched_args args = { 0 };
 
 	OPEN_GLOBAL_FD();
 
-	err = wait_ums_sched(&sched_id);
+	args.sched_id = sched_id;
 
-	return err;
+	return wait_ums_sched(&args) ? -errno : 0;
+}
+
+/**
+ * @brief Block this thread until the ums_scheduler get destroyed or the
+ * timeout expires
+ *
+ * @param[in] sched_id: scheduler to wait for
+ * @param[in] timeout_ns: maximum wait in ns, negative to wait forever
+ *
+ * Any number of threads can wait for the same scheduler.
+ *
+ * @return 0 if the scheduler was destroyed, -ETIMEDOUT if the timeout
+ *	expired, -errno otherwise
+*/
+int WaitUmsSchedulerTimeout(ums_sched_id sched_id, long long timeout_ns)
+{
+	struct ums_wait_args args = { 0 };
+
+	OPEN_GLOBAL_FD();
+
+	args.id = sched_id;
+	args.timeout_ns = timeout_ns;
+
+	return wait_ums(&args) ? -errno : 0;
+}
+
+/**
+ * @brief Block this thread until all the elements of a complist end
+ *
+ * @param[in] complist_id: completion list to wait for
+ * @param[in] timeout_ns: maximum wait in ns, negative to wait forever
+ *
+ * The completion list is removed when its last element ends.
+ *
+ * @return 0 if the completion list was removed, -ETIMEDOUT if the timeout
+ *	expired, -errno otherwise
+*/
+int WaitUmsCompletionList(ums_complist_id complist_id, long long timeout_ns)
+{
+	struct ums_wait_args args = { 0 };
+
+	OPEN_GLOBAL_FD();
+
+	args.id = complist_id;
+	args.flags = UMS_WAIT_F_COMPLIST;
+	args.timeout_ns = timeout_ns;
+
+	return wait_ums(&args) ? -errno : 0;
 }
 
 /**
@@ -258,8 +798,16 @@ int WaitUmsChildren(void)
 */
 int CreateEmptyUmsCompletionList(ums_complist_id *id)
 {
+	struct ums_complist_args args = { 0 };
+
 	OPEN_GLOBAL_FD();
-	return create_ums_complist(id);
+
+	if (create_ums_complist(&args))
+		return -errno;
+
+	*id = args.complist_id;
+
+	return 0;
 }
 
 /**
@@ -280,8 +828,7 @@ int CreateUmsCompletionList(ums_complist_id *id,
 {
 	int err, i;
 
-	OPEN_GLOBAL_FD();
-	err = create_ums_complist(id);
+	err = CreateEmptyUmsCompletionList(id);
 
 	if (err)
 		return err;
@@ -290,11 +837,13 @@ int CreateUmsCompletionList(ums_complist_id *id,
 		int thread_id = 0;
 		void *stack = malloc(TASK_STACK_SIZE);
 		/* Initialise the buffer for the sub-thread */
-		void *buff = malloc(sizeof(int) + sizeof(ums_function));
+		struct compelem_thread_args *buff = malloc(sizeof(*buff));
 		
 		/* assign the complist id + function to execute */
-		memcpy(buff, id, sizeof(*id));
-		memcpy(buff+sizeof(int), &list[i], sizeof(list[i]));
+		buff->complist_id = *id;
+		buff->func = list[i];
+		buff->prio = UMS_PRIO_NORMAL;
+		buff->deadline = 0;
 
 		thread_id = create_thread(__reg_compelem, stack, buff);
 		      
@@ -321,23 +870,86 @@ int CreateUmsCompletionList(ums_complist_id *id,
  * @note Process remains blocked until compelem ends
  *
  * @sa CreateUmsCompletionList
+ * @sa CreateUmsCompletionElementPrio
 */
 int CreateUmsCompletionElement(ums_complist_id id,
 		               ums_function func)
 {
-	void *stack;
-	int thread_id;
-	int *arg = malloc(sizeof(int));
-
-	OPEN_GLOBAL_FD();
-	stack = malloc(TASK_STACK_SIZE);
-
-	*arg = id;
-
-	thread_id = create_thread(__reg_compelem, stack, arg);
+	return CreateUmsCompletionElementPrio(id, func, UMS_PRIO_NORMAL);
+}
 
-	if (thread_id < 0)
-		return -1;
+/**
+ * @brief Create a completion element with a priority for a complist
+ *
+ * @param[in] id: completion list id
+ * @param[in] func: function to be executed
+ * @param[in] prio: priority of the element (UMS_PRIO_*)
+ *
+ * The ready elements of a higher priority are dequeued first.
+ *
+ * @return 0 if no error occured, nonzero otherwise
+ *
+ * @sa CreateUmsCompletionElement
+ * @sa UmsSetPriority
+*/
+int CreateUmsCompletionElementPrio(ums_complist_id id,
+				   ums_function func,
+				   int prio)
+{
+	void *stack;
+	int thread_id;
+	struct compelem_thread_args *arg = malloc(sizeof(*arg));
+
+	OPEN_GLOBAL_FD();
+	stack = malloc(TASK_STACK_SIZE);
+
+	arg->complist_id = id;
+	arg->func = func;
+	arg->prio = prio;
+	arg->deadline = 0;
+
+	thread_id = create_thread(__reg_compelem, stack, arg);
+
+	if (thread_id < 0)
+		return -1;
+
+	new_id_elem(thread_id, stack);
+
+	return 0;
+}
+
+/**
+ * @brief Create a completion element with a deadline for a complist
+ *
+ * @param[in] id: completion list id (see UmsSetCompletionListPolicy)
+ * @param[in] func: function to be executed
+ * @param[in] deadline: absolute deadline in ns (CLOCK_MONOTONIC)
+ *
+ * @return 0 if no error occured, nonzero otherwise
+ *
+ * @sa CreateUmsCompletionElement
+ * @sa UmsSetDeadline
+*/
+int CreateUmsCompletionElementDeadline(ums_complist_id id,
+				       ums_function func,
+				       unsigned long long deadline)
+{
+	void *stack;
+	int thread_id;
+	struct compelem_thread_args *arg = malloc(sizeof(*arg));
+
+	OPEN_GLOBAL_FD();
+	stack = malloc(TASK_STACK_SIZE);
+
+	arg->complist_id = id;
+	arg->func = func;
+	arg->prio = UMS_PRIO_NORMAL;
+	arg->deadline = deadline;
+
+	thread_id = create_thread(__reg_compelem, stack, arg);
+
+	if (thread_id < 0)
+		return -1;
 
 	new_id_elem(thread_id, stack);
 
@@ -345,112 +957,862 @@ int CreateUmsCompletionElement(ums_complist_id id,
 }
 
 /**
- * @brief Execute a compelem thread
+ * @brief Change the priority of a completion element
+ *
+ * @param[in] id: completion element id
+ * @param[in] prio: new priority (UMS_PRIO_*)
+ *
+ * A ready element is moved to its new priority level right away.
+ *
+ * @return 0 if no error occured, -errno otherwise
+ *
+ * @sa CreateUmsCompletionElementPrio
+*/
+int UmsSetPriority(ums_compelem_id id, int prio)
+{
+	struct ums_compelem_prio_args args = { 0 };
+
+	OPEN_GLOBAL_FD();
+
+	args.compelem_id = id;
+	args.prio = prio;
+
+	if (set_priority(&args))
+		return -errno;
+
+	return 0;
+}
+
+/**
+ * @brief Change the deadline of a completion element
+ *
+ * @param[in] id: completion element id
+ * @param[in] deadline: absolute deadline in ns (CLOCK_MONOTONIC), 0 for none
+ *
+ * A running element sets the deadline of its next job before yielding.
+ *
+ * @return 0 if no error occured, -errno otherwise
+ *
+ * @sa UmsSetCompletionListPolicy
+*/
+int UmsSetDeadline(ums_compelem_id id, unsigned long long deadline)
+{
+	struct ums_compelem_prio_args args = { 0 };
+
+	OPEN_GLOBAL_FD();
+
+	args.compelem_id = id;
+	args.deadline = deadline;
+
+	if (set_deadline(&args))
+		return -errno;
+
+	return 0;
+}
+
+/**
+ * @brief Set the policy of an empty completion list
+ *
+ * @param[in] id: completion list id
+ * @param[in] policy: one of the UMS_POLICY_* values
+ * @param[in] flags: UMS_POLICY_F_* flags
+ *
+ * With UMS_POLICY_F_KERNEL_DISPATCH UmsThreadYield (out of hybrid mode)
+ * runs the next ready element directly, the entry point is called only when
+ * none is ready.
+ *
+ * @return 0 if no error occured, -errno otherwise (-EBUSY if the list
+ *	already has elements)
+ *
+ * @sa CreateEmptyUmsCompletionList
+*/
+int UmsSetCompletionListPolicy(ums_complist_id id,
+			       unsigned int policy,
+			       unsigned int flags)
+{
+	struct ums_complist_policy_args args = { 0 };
+
+	OPEN_GLOBAL_FD();
+
+	args.complist_id = id;
+	args.policy = policy;
+	args.flags = flags;
+
+	if (set_complist_policy(&args))
+		return -errno;
+
+	return 0;
+}
+
+/**
+ * @brief Set how long an idle scheduler thread spins before sleeping
+ *
+ * @param[in] id: completion list id
+ * @param[in] spin_ns: maximum spin in ns (at most UMS_IDLE_SPIN_MAX_NS),
+ *	0 to always sleep
+ *
+ * A dequeue that finds no ready element spins for twice the average gap
+ * between the ready elements of the list, at most spin_ns, before sleeping.
+ * The default is UMS_IDLE_SPIN_DEFAULT_NS.
+ *
+ * @return 0 if no error occured, -errno otherwise
+*/
+int UmsSetCompletionListIdleSpin(ums_complist_id id,
+				 unsigned long long spin_ns)
+{
+	struct ums_complist_idle_args args = { 0 };
+
+	OPEN_GLOBAL_FD();
+
+	args.complist_id = id;
+	args.spin_ns = spin_ns;
+
+	if (set_complist_idle(&args))
+		return -errno;
+
+	return 0;
+}
+
+/**
+ * @brief Set the time slice of the elements of a completion list
+ *
+ * @param[in] id: completion list id
+ * @param[in] slice_ns: time slice in ns, 0 for none
+ *
+ * An element that runs for longer than slice_ns without yielding is
+ * preempted: the scheduler thread receives UMS_SIGNAL_PREEMPT, whose
+ * handler yields the element, and the entry point runs again. The element
+ * resumes from the interrupted instruction the next time it is executed.
+ *
+ * @note The first call must happen before EnterUmsSchedulingMode, it
+ *	cannot be used with the hybrid mode.
+ *
+ * @return 0 if no error occured, -ENOTSUP if the module does not support
+ *	the time slices, -EINVAL in hybrid mode, -errno otherwise
+ *
+ * @sa ExecuteUmsThreadBudget
+*/
+int UmsSetTimeSlice(ums_complist_id id, unsigned long long slice_ns)
+{
+	struct ums_caps caps;
+	struct ums_complist_slice_args args = { 0 };
+
+	OPEN_GLOBAL_FD();
+
+	if (GetUmsCapabilities(&caps) || ! (caps.caps & UMS_CAP_TIME_SLICE))
+		return -ENOTSUP;
+
+	if (hybrid_mode)
+		return -EINVAL;
+
+	if (! time_slice) {
+		struct sigaction act;
+
+		/* the scheduler threads copy the handler when they are
+		 * cloned. The signal stays unblocked in the handler: the
+		 * entry point resumes with the signal mask of the handler */
+		memset(&act, 0, sizeof(act));
+		act.sa_handler = preempt_handler;
+		act.sa_flags = SA_RESTART | SA_NODEFER;
+		sigemptyset(&act.sa_mask);
+
+		if (sigaction(UMS_SIGNAL_PREEMPT, &act, NULL))
+			return -errno;
+
+		time_slice = 1;
+	}
+
+	args.complist_id = id;
+	args.slice_ns = slice_ns;
+
+	if (set_time_slice(&args))
+		return -errno;
+
+	return 0;
+}
+
+/**
+ * @brief Execute a compelem thread
+ *
+ * @param[in] next: next compelem to be executed
+ *
+ * @note the thread must have been reserved with DequeueUmsCompletionListItems
+ *
+ * In hybrid mode a parked element is resumed without entering the kernel,
+ * the call returns when the executed element yields.
+ *
+ * @return 0 if no error occured, UMS_EXEC_BLOCKED if next blocked in the
+ *	kernel (see UmsSetBlockNotification), -errno otherwise
+ *
+ * @sa DequeueUmsCompletionListItems
+ * @sa UmsSetHybridMode
+*/
+int ExecuteUmsThread(ums_compelem_id next)
+{
+	struct ums_exec_args args = { 0 };
+	int res;
+
+	OPEN_GLOBAL_FD();
+
+	if (hybrid_mode) {
+		struct ums_thread_info *info = get_thread_info();
+		struct ums_user_elem *elem = info->reserved;
+
+		if (! elem || elem->id != next)
+			return hybrid_exec(next, 0);
+
+		/* parked element: switch without the module */
+		info->reserved = NULL;
+		info->running = elem;
+
+		__ums_ctx_swap(&info->entry_ctx, &elem->ctx);
+
+		finish_switch();
+		return 0;
+	}
+
+	args.compelem_id = next;
+
+	/* We will eventually return! */
+	res = exec_thread(&args);
+
+	return res < 0 ? -errno : res;
+}
+
+/**
+ * @brief Execute a compelem thread with its own time slice
+ *
+ * @param[in] next: next compelem to be executed
+ * @param[in] budget_ns: time slice of this execution in ns, 0 for the one
+ *	of the completion list
+ *
+ * Same as ExecuteUmsThread, next is preempted after budget_ns (see
+ * UmsSetTimeSlice, which must have been called once to install the
+ * preemption handler).
+ *
+ * @return 0 if no error occured, UMS_EXEC_BLOCKED if next blocked in the
+ *	kernel, -errno otherwise (-EINVAL in hybrid mode)
+ *
+ * @sa ExecuteUmsThread
+*/
+int ExecuteUmsThreadBudget(ums_compelem_id next, unsigned long long budget_ns)
+{
+	struct ums_exec_budget_args args = { 0 };
+	int res;
+
+	OPEN_GLOBAL_FD();
+
+	if (hybrid_mode)
+		return -EINVAL;
+
+	args.compelem_id = next;
+	args.budget_ns = budget_ns;
+
+	/* We will eventually return! */
+	res = exec_thread_budget(&args);
+
+	return res < 0 ? -errno : res;
+}
+
+/**
+ * @brief Execute a compelem thread claimed from the ready ring
+ *
+ * @param[in] next: compelem returned by UmsReadyRingClaim
+ *
+ * @return 0 if no error occured, UMS_EXEC_BLOCKED if next blocked in the
+ *	kernel, -errno otherwise (-EAGAIN if next was not published in the
+ *	ready ring)
+ *
+ * @sa UmsReadyRingClaim
+*/
+int ExecuteClaimedUmsThread(ums_compelem_id next)
+{
+	struct ums_exec_args args = { 0 };
+	int res;
+
+	OPEN_GLOBAL_FD();
+
+	if (hybrid_mode)
+		return hybrid_exec(next, UMS_EXEC_F_CLAIMED);
+
+	args.compelem_id = next;
+	args.flags = UMS_EXEC_F_CLAIMED;
+
+	/* We will eventually return! */
+	res = exec_thread(&args);
+
+	return res < 0 ? -errno : res;
+}
+
+/**
+ * @brief Yield from a worker to the scheduler thread execution
+ *
+ * Resume the entry point function by stopping the worker (compelem) execution.
+ *
+ * In hybrid mode the element is parked in user space and the entry point is
+ * resumed without entering the kernel.
+ *
+ * @return 0 if no error occured, nonzero otherwise
+ *
+ * @sa ExecuteUmsThread
+*/
+int UmsThreadYield(void)
+{
+	int err;
+
+	OPEN_GLOBAL_FD();
+
+	if (hybrid_mode) {
+		struct ums_thread_info *info = get_thread_info();
+		struct ums_user_elem *self = info->running;
+
+		/* Yield triggered by an entry_point function is an NOP */
+		if (! self)
+			return 0;
+
+		info->running = NULL;
+		info->park = self;
+
+		__ums_ctx_swap(&self->ctx, &info->entry_ctx);
+
+		/* resumed, maybe by another scheduler thread */
+		finish_switch();
+		return 0;
+	}
+
+	err = thread_yield();
+
+	fprintf(stderr, "Returned from yield: %d\n", err);
+	/* We will eventually return! */
+	return err;
+}
+
+
+/**
+ * @brief Yield from a worker directly to another ready worker
+ *
+ * @param[in] next: ready compelem of the same completion list
+ *
+ * The calling worker goes back to the ready queue and next is executed by
+ * the same scheduler thread without passing through the entry point.
+ *
+ * In hybrid mode next must be parked: the calling worker is parked and next
+ * is resumed without entering the kernel.
+ *
+ * @return 0 if no error occured, -errno otherwise (-EAGAIN if next is not
+ *	ready)
+ *
+ * @sa UmsThreadYield
+*/
+int UmsThreadYieldTo(ums_compelem_id next)
+{
+	struct ums_exec_args args = { 0 };
+
+	OPEN_GLOBAL_FD();
+
+	if (hybrid_mode) {
+		struct ums_thread_info *info = get_thread_info();
+		struct ums_user_elem *self = info->running;
+		struct ums_user_elem *elem;
+
+		if (! self)
+			return -EPERM;
+
+		elem = parked_pop(self->complist_id, next);
+
+		if (! elem)
+			return -EAGAIN;
+
+		info->running = elem;
+		info->park = self;
+
+		__ums_ctx_swap(&self->ctx, &elem->ctx);
+
+		finish_switch();
+		return 0;
+	}
+
+	args.compelem_id = next;
+
+	/* We will eventually return! */
+	return switch_to_thread(&args) ? -errno : 0;
+}
+
+/**
+ * @brief Reserve completion elements from a complist
+ *
+ * @param[in] max_elements: maximum elements gettable (the module returns at
+ *	most UMS_DEQUEUE_MAX elements, see GetUmsCapabilities)
+ * @param[out] result_array: array with the reserved elements, it must have
+ *	space for max_elements + 1 entries (the list is zero terminated)
+ * @param[out] result_length: resulting length
+ *
+ * @return 0 if no error occured, -errno otherwise
+ *
+ * @note Calling dequeue 2 times without any Execution in between might lead
+ *	to deadlock
+ *
+ * In hybrid mode a parked element (if any) is returned alone, without
+ * entering the kernel. Every HYBRID_PARKED_BATCH parked elements the ready
+ * elements of the module are tried first, so that a busy parked set does
+ * not starve the elements that never ran.
+ *
+ * @sa UmsThreadYield
+ * @sa ExecuteUmsThread
+*/
+int DequeueUmsCompletionListItems(int max_elements,
+				  ums_compelem_id *result_array,
+				  int *result_length)
+{
+	return dequeue_items(max_elements, result_array, result_length, 1);
+}
+
+/**
+ * @brief Reserve completion elements from a complist without sleeping
+ *
+ * @param[in] max_elements: maximum elements gettable
+ * @param[out] result_array: array with the reserved elements, it must have
+ *	space for max_elements + 1 entries (the list is zero terminated)
+ * @param[out] result_length: resulting length
+ *
+ * Same as DequeueUmsCompletionListItems, usually called once the descriptor
+ * of UmsCompletionListFd is readable.
+ *
+ * @return 0 if no error occured, -EAGAIN if no element is ready, -errno
+ *	otherwise
+ *
+ * @sa UmsCompletionListFd
+*/
+int TryDequeueUmsCompletionListItems(int max_elements,
+				     ums_compelem_id *result_array,
+				     int *result_length)
+{
+	return dequeue_items(max_elements, result_array, result_length, 0);
+}
+
+/**
+ * @brief Get a descriptor to poll the ready elements of a complist
+ *
+ * @param[in] id: completion list id
+ *
+ * The descriptor is readable (POLLIN) while the completion list has ready
+ * elements and it reports POLLHUP once the list is removed: the entry point
+ * can wait on it with epoll together with its sockets and timers, and then
+ * reserve with TryDequeueUmsCompletionListItems. The caller closes it.
+ *
+ * @return the new file descriptor, -errno otherwise
+ *
+ * @sa TryDequeueUmsCompletionListItems
+*/
+int UmsCompletionListFd(ums_complist_id id)
+{
+	struct ums_complist_args args = { 0 };
+	int fd;
+
+	OPEN_GLOBAL_FD();
+
+	args.complist_id = id;
+
+	fd = complist_fd(&args);
+
+	return fd < 0 ? -errno : fd;
+}
+
+/**
+ * @brief Internal function to reserve completion elements
+ *
+ * @param[in] max_elements: maximum elements gettable
+ * @param[out] result_array: zero terminated array of the reserved elements
+ * @param[out] result_length: resulting length
+ * @param[in] do_sleep: wait for the first element if none is ready
+ *
+ * @sa DequeueUmsCompletionListItems
+*/
+static int dequeue_items(int max_elements,
+			 ums_compelem_id *result_array,
+			 int *result_length,
+			 int do_sleep)
+{
+	struct ums_dequeue_args args = { 0 };
+
+	OPEN_GLOBAL_FD();
+
+	if (hybrid_mode) {
+		struct ums_thread_info *info = get_thread_info();
+		ums_complist_id complist_id = 0;
+
+		/* a reserved element that was not executed is parked again */
+		if (info->reserved) {
+			parked_push(info->reserved);
+			info->reserved = NULL;
+		}
+
+		if (info->page)
+			complist_id = info->page->complist_id;
+
+		args.max_elements = max_elements;
+		args.elements = (__u64)(unsigned long)result_array;
+
+		/* the turn of the module: the parked elements are used only
+		 * if it has no ready element */
+		if (info->n_parked >= HYBRID_PARKED_BATCH) {
+			info->n_parked = 0;
+
+			if (! try_dequeue_complist(&args))
+				goto dequeue_items_done;
+
+			if (errno != EAGAIN)
+				return -errno;
+		}
+
+		info->reserved = parked_pop(complist_id, 0);
+
+		if (info->reserved) {
+			info->n_parked++;
+			result_array[0] = info->reserved->id;
+			result_array[1] = 0;
+			*result_length = 1;
+			return 0;
+		}
+	}
+
+	args.max_elements = max_elements;
+	args.elements = (__u64)(unsigned long)result_array;
+
+	if (do_sleep ? dequeue_complist(&args) : try_dequeue_complist(&args))
+		return -errno;
+
+dequeue_items_done:
+	*result_length = args.count;
+
+	/* zero terminate the list */
+	/* 0 is ok because idx are always > 0 */
+	*(result_array + *result_length) = 0;
+
+	return 0;
+}
+
+/**
+ * @brief Read a consistent snapshot of the worker control page
  *
- * @param[in] next: next compelem to be executed
+ * @param[out] snapshot: state of the scheduler thread running the caller
  *
- * @note the thread must have been reserved with DequeueUmsCompletionListItems
+ * The page is shared with the module, so the read does not enter the
+ * kernel. It must be called by the entry point or by a running completion
+ * element.
  *
- * @return 0 if no error occured, nonzero otherwise
+ * @return 0 if no error occured, -ENODEV if the page is not mapped
  *
- * @sa DequeueUmsCompletionListItems
+ * @sa UmsGetCurrentCompelem
 */
-int ExecuteUmsThread(ums_compelem_id next)
+int UmsGetWorkerPage(struct ums_worker_page *snapshot)
 {
-	int err;
+	const struct ums_worker_page *page = get_thread_info()->page;
+	unsigned int seq;
 
-	OPEN_GLOBAL_FD();
+	if (! page)
+		return -ENODEV;
 
-	err = exec_thread(next);
+	do {
+		seq = __atomic_load_n(&page->seq, __ATOMIC_ACQUIRE);
 
-	/* We will eventually return! */
-	return err;
+		snapshot->current_elem = __atomic_load_n(&page->current_elem,
+							 __ATOMIC_RELAXED);
+		snapshot->complist_id = __atomic_load_n(&page->complist_id,
+							__ATOMIC_RELAXED);
+		snapshot->sched_id = __atomic_load_n(&page->sched_id,
+						     __ATOMIC_RELAXED);
+		snapshot->n_switch = __atomic_load_n(&page->n_switch,
+						     __ATOMIC_RELAXED);
+		snapshot->switch_time = __atomic_load_n(&page->switch_time,
+							__ATOMIC_RELAXED);
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while ((seq & 1) ||
+		 seq != __atomic_load_n(&page->seq, __ATOMIC_RELAXED));
+
+	snapshot->seq = seq;
+
+	return 0;
 }
 
 /**
- * @brief Yield from a worker to the scheduler thread execution
+ * @brief Get the completion element run by the calling scheduler thread
  *
- * Resume the entry point function by stopping the worker (compelem) execution.
+ * @return the running compelem, 0 if the entry point is running (or the
+ *	page is not mapped)
  *
- * @return 0 if no error occured, nonzero otherwise
+ * @sa UmsGetWorkerPage
+*/
+ums_compelem_id UmsGetCurrentCompelem(void)
+{
+	const struct ums_worker_page *page = get_thread_info()->page;
+
+	/* the module does not see the hybrid switches */
+	if (hybrid_mode)
+		return get_thread_info()->running ?
+			get_thread_info()->running->id : 0;
+
+	if (! page)
+		return 0;
+
+	return __atomic_load_n(&page->current_elem, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Publish the ready elements of a completion list in a ready ring
  *
- * @sa ExecuteUmsThread
+ * @param[out] ring: ring to initialize
+ * @param[in] complist_id: completion list that publishes the ring
+ * @param[in] entries: number of entries
+ *
+ * Scheduler threads claim the ready elements without entering the kernel
+ * and enter it only to execute them:
+ *
+ * @code
+ * next = UmsReadyRingClaim(&ring);
+ *
+ * if (next)
+ *	ExecuteClaimedUmsThread(next);
+ * else if (! DequeueUmsCompletionListItems(1, elems, &len))
+ *	ExecuteUmsThread(elems[0]);
+ * @endcode
+ *
+ * @return 0 if no error occured, -errno otherwise
+ *
+ * @sa UmsReadyRingExit
 */
-int UmsThreadYield(void)
+int UmsReadyRingInit(struct ums_user_ready_ring *ring,
+		     ums_complist_id complist_id,
+		     unsigned int entries)
 {
-	int err;
+	struct ums_ready_ring_args args = { 0 };
 
 	OPEN_GLOBAL_FD();
-	err = thread_yield(NULL);
 
-	fprintf(stderr, "Returned from yield: %d\n", err);
-	/* We will eventually return! */
-	return err;
+	args.complist_id = complist_id;
+	args.entries = entries;
+
+	if (setup_ready_ring(&args))
+		return -errno;
+
+	ring->mem = mmap(NULL, args.ring_size, PROT_READ | PROT_WRITE,
+			 MAP_SHARED, global_fd,
+			 UMS_MMAP_READY_RING(complist_id));
+
+	if (ring->mem == MAP_FAILED)
+		return -errno;
+
+	ring->size = args.ring_size;
+	ring->hdr = ring->mem;
+	ring->ids = (ums_compelem_id *)((char *)ring->mem + args.ids_off);
+
+	return 0;
+}
+
+/**
+ * @brief Claim the first ready element of a ready ring
+ *
+ * The element must then be executed with ExecuteClaimedUmsThread.
+ *
+ * @return the claimed element, 0 if the ring is empty
+*/
+ums_compelem_id UmsReadyRingClaim(struct ums_user_ready_ring *ring)
+{
+	unsigned int head;
+	ums_compelem_id id;
+
+	head = __atomic_load_n(&ring->hdr->head, __ATOMIC_ACQUIRE);
+
+	do {
+		if (head == __atomic_load_n(&ring->hdr->tail, __ATOMIC_ACQUIRE))
+			return 0;
+
+		id = ring->ids[head & ring->hdr->mask];
+	} while (! __atomic_compare_exchange_n(&ring->hdr->head, &head,
+					       head + 1, 0,
+					       __ATOMIC_ACQ_REL,
+					       __ATOMIC_ACQUIRE));
+
+	return id;
 }
 
+/**
+ * @brief Unmap a ready ring
+*/
+void UmsReadyRingExit(struct ums_user_ready_ring *ring)
+{
+	munmap(ring->mem, ring->size);
+	ring->mem = NULL;
+}
 
 /**
- * @brief Reserve completion elements from a complist
+ * @brief Create a submission/completion ring for the calling thread
  *
- * @param[in] max_elements: maximum elements gettable
- * @param[out] result_array: array with the reserved elements
- * @param[out] result_length: resulting length
+ * @param[out] ring: ring to initialize
+ * @param[in] entries: number of submission entries
  *
- * @return 0 if no error occured, nonzero otherwise
+ * The ring permits to queue several requests (e.g. a dequeue and an exec
+ * linked with UMS_SQE_F_LINK_DEQUEUE) and to let the module consume them
+ * with a single UmsRingSubmit.
  *
- * @note Calling dequeue 2 times without any Execution in between might lead
- *	to deadlock
+ * @code
+ * sqe = UmsRingGetSqe(&ring);
+ * sqe->opcode = UMS_RING_OP_DEQUEUE;
+ * sqe->len = 1;
+ * sqe = UmsRingGetSqe(&ring);
+ * sqe->opcode = UMS_RING_OP_EXEC;
+ * sqe->flags = UMS_SQE_F_LINK_DEQUEUE;
+ * UmsRingSubmit(&ring);
+ * @endcode
  *
- * @sa UmsThreadYield
- * @sa ExecuteUmsThread
+ * @return 0 if no error occured, nonzero otherwise
+ *
+ * @sa UmsRingExit
 */
-int DequeueUmsCompletionListItems(int max_elements,
-				  ums_compelem_id *result_array,
-				  int *result_length)
+int UmsRingInit(struct ums_user_ring *ring, unsigned int entries)
 {
-	int res;
+	struct ums_ring_params params;
+	int fd, err;
 
 	OPEN_GLOBAL_FD();
 
-	/* the first expected element is the size */
-	*result_array = max_elements;
-	res = dequeue_complist(result_array);
+	memset(&params, 0, sizeof(params));
+	params.sq_entries = entries;
 
-	if (res)
-		return res;
+	fd = setup_ring(&params);
 
-	*result_length = *result_array;
+	if (fd < 0) {
+		fprintf(stderr, "Error: cannot create ums ring!\n");
+		return -errno;
+	}
 
-	*result_array = *(result_array + *result_length);
+	ring->mem = mmap(NULL, params.ring_size, PROT_READ | PROT_WRITE,
+			 MAP_SHARED, fd, 0);
 
-	/* zero terminate the list */
-	/* 0 is ok because idx are always > 0 */
-	*(result_array + *result_length) = 0;
+	if (ring->mem == MAP_FAILED) {
+		err = -errno;
+		close(fd);
+		return err;
+	}
+
+	ring->fd = fd;
+	ring->size = params.ring_size;
+	ring->hdr = ring->mem;
+	ring->sqes = (struct ums_sqe *)((char *)ring->mem + params.sq_off);
+	ring->cqes = (struct ums_cqe *)((char *)ring->mem + params.cq_off);
+	ring->sq_tail = ring->hdr->sq_tail;
 
 	return 0;
 }
 
+/**
+ * @brief Get a free submission entry
+ *
+ * The entry is zeroed and it is published by the next UmsRingSubmit.
+ *
+ * @return the entry, NULL if the submission queue is full
+*/
+struct ums_sqe *UmsRingGetSqe(struct ums_user_ring *ring)
+{
+	struct ums_sqe *sqe;
+	unsigned int head;
+
+	head = __atomic_load_n(&ring->hdr->sq_head, __ATOMIC_ACQUIRE);
+
+	if (ring->sq_tail - head >= ring->hdr->sq_entries)
+		return NULL;
+
+	sqe = &ring->sqes[ring->sq_tail & ring->hdr->sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+
+	ring->sq_tail++;
+
+	return sqe;
+}
+
+/**
+ * @brief Publish the prepared entries and let the module consume them
+ *
+ * @note If an entry switches context (exec, yield) the call returns only
+ *	when the thread goes back to the calling context.
+ *
+ * @return the value of the ring enter request, negative on error
+*/
+int UmsRingSubmit(struct ums_user_ring *ring)
+{
+	unsigned int to_submit;
+
+	__atomic_store_n(&ring->hdr->sq_tail, ring->sq_tail, __ATOMIC_RELEASE);
+
+	to_submit = ring->sq_tail -
+		__atomic_load_n(&ring->hdr->sq_head, __ATOMIC_ACQUIRE);
+
+	return enter_ring(ring->fd, to_submit);
+}
+
+/**
+ * @brief Get the oldest completion without consuming it
+ *
+ * @return the completion, NULL if the completion queue is empty
+ *
+ * @sa UmsRingCqeSeen
+*/
+struct ums_cqe *UmsRingPeekCqe(struct ums_user_ring *ring)
+{
+	unsigned int head = ring->hdr->cq_head;
+
+	if (head == __atomic_load_n(&ring->hdr->cq_tail, __ATOMIC_ACQUIRE))
+		return NULL;
+
+	return &ring->cqes[head & ring->hdr->cq_mask];
+}
+
+/**
+ * @brief Consume the completion returned by UmsRingPeekCqe
+*/
+void UmsRingCqeSeen(struct ums_user_ring *ring)
+{
+	__atomic_store_n(&ring->hdr->cq_head, ring->hdr->cq_head + 1,
+			 __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Unmap and close a ring
+*/
+void UmsRingExit(struct ums_user_ring *ring)
+{
+	munmap(ring->mem, ring->size);
+	close(ring->fd);
+}
+
 /**
  * @brief Internal function to register a thread using clone
  *
  * @param[in] sched_id: scheduler identifier
  * @param[in] entry_point: function that the scheduler thread will execute
+ * @param[in] cpus: CPUs of the scheduler threads
  * Just uses clone and call __reg_thread.
  *
  * @sa __reg_thread
 */
 static void register_threads(ums_sched_id sched_id,
-			     ums_function entry_point)
+			     ums_function entry_point,
+			     const cpu_set_t *cpus)
 {
 	int i;
-	int n_cpu = get_nprocs();
 
-	fprintf(stderr, "n_cpus: %d\n", n_cpu);
+	fprintf(stderr, "n_cpus: %d\n", CPU_COUNT(cpus));
 
-	for (i = 0; i < n_cpu; i++) {
+	for (i = 0; i < CPU_SETSIZE; i++) {
 		int thread_id;
-		void *stack = malloc(TASK_STACK_SIZE);
+		void *stack;
 		struct sched_thread_args *info;
+
+		if (! CPU_ISSET(i, cpus))
+			continue;
+
+		stack = malloc(TASK_STACK_SIZE);
 	       
 		info = malloc(sizeof(struct sched_thread_args));
 
@@ -484,6 +1846,7 @@ static int __reg_thread(void *sched_thread)
 	ums_sched_id id;
 	cpu_set_t set;
 	struct sched_thread_args* thread_info;
+	struct ums_sched_args args = { 0 };
 	ums_function entry_point;
 
 	thread_info = (struct sched_thread_args*)sched_thread;
@@ -498,10 +1861,32 @@ static int __reg_thread(void *sched_thread)
 	sched_setaffinity(0, sizeof(set), &set);
 
 	fprintf(stderr, "registering thread for cpu: %d\n", cpu);
-	res = do_reg_thread(&id);
+	args.sched_id = id;
+	res = do_reg_thread(&args);
 
 	if (res)
 		fprintf(stderr, "reg failed!!\n");
+	else if (set_thread_info())
+		fprintf(stderr, "worker page setup failed!\n");
+
+	if (! res && block_notify) {
+		struct sched_thread_args *standby;
+		void *stack = malloc(TASK_STACK_SIZE);
+		int standby_id;
+
+		standby = malloc(sizeof(struct sched_thread_args));
+
+		standby->id = id;
+		standby->cpu = cpu;
+		standby->entry_point = entry_point;
+
+		/* the clone inherits the GS base, i.e. the thread info */
+		standby_id = create_thread(__standby_thread, stack, standby);
+
+		if (standby_id < 0)
+			fprintf(stderr, "standby thread for CPU %d failed!\n",
+				cpu);
+	}
 
 	res = -1;
 	res = entry_point(id);
@@ -511,30 +1896,169 @@ static int __reg_thread(void *sched_thread)
 	return 0;
 }
 
+/**
+ * @brief Standby thread of a scheduler thread
+ *
+ * Pinned to the CPU of the scheduler thread, it waits in the module until
+ * the scheduler thread blocks in a completion element: then it returns in
+ * the entry point of the scheduler thread and it never comes back here.
+ *
+ * @return non-zero if the standby registration failed
+ *
+ * @sa UmsSetBlockNotification
+*/
+static int __standby_thread(void *sched_thread)
+{
+	int res;
+	cpu_set_t set;
+	struct sched_thread_args *thread_info;
+	struct ums_sched_args args = { 0 };
+
+	thread_info = (struct sched_thread_args*)sched_thread;
+	args.sched_id = thread_info->id;
+
+	CPU_ZERO(&set);
+	CPU_SET(thread_info->cpu, &set);
+	sched_setaffinity(0, sizeof(set), &set);
+
+	free(thread_info);
+
+	res = standby_thread(&args);
+
+	fprintf(stderr, "%s: standby failed: %d!\n", __func__, res);
+	return res;
+}
+
+/**
+ * @brief UMS_SIGNAL_BLOCKED handler
+ *
+ * @param[in] sig: unused
+ *
+ * The thread woke up after a block in a completion element: the element
+ * is given back to the module (it resumes here) and the thread becomes a
+ * standby thread.
+*/
+static void blocked_handler(int sig)
+{
+	int err = errno;
+
+	(void)sig;
+
+	blocked_park();
+
+	errno = err;
+}
+
+/**
+ * @brief UMS_SIGNAL_PREEMPT handler
+ *
+ * @param[in] sig: unused
+ *
+ * The running element used up its time slice: it is yielded from here and
+ * it returns from the handler when it is executed again.
+*/
+static void preempt_handler(int sig)
+{
+	int err = errno;
+
+	(void)sig;
+
+	preempt_yield();
+
+	errno = err;
+}
+
+/**
+ * @brief Map the worker control page and install the thread info
+ *
+ * Called by a scheduler thread right after its registration. Without the
+ * control page the thread info is installed anyway with a NULL page, which
+ * its readers handle (e.g. UmsGetWorkerPage fails with -ENODEV).
+ *
+ * @return 0 if the thread info is installed, -errno otherwise
+ *
+ * @sa ums_thread_info
+*/
+static int set_thread_info(void)
+{
+	struct ums_thread_info *info;
+	void *page;
+
+	info = calloc(1, sizeof(struct ums_thread_info));
+
+	if (! info)
+		return -ENOMEM;
+
+	info->self = info;
+	info->page = NULL;
+
+	page = mmap(NULL, getpagesize(), PROT_READ, MAP_SHARED, global_fd,
+		    UMS_MMAP_WORKER_PAGE);
+
+	/* without the page the thread info is still valid */
+	if (page != MAP_FAILED)
+		info->page = page;
+
+	if (syscall(SYS_arch_prctl, ARCH_SET_GS, info)) {
+		int err = -errno;
+
+		if (info->page)
+			munmap(page, getpagesize());
+		free(info);
+		return err;
+	}
+
+	return 0;
+}
+
 /**
  * @brief Register current thread as completion element then freeze process
  *
  * @return 0 if everything was OK (after compelem completion) or non-zero
  *	if error
 */
-static int __reg_compelem(void *idxs)
+static int __reg_compelem(void *elem_args)
 {
-	int res, id, *buff;
+	int res;
 	ums_function func;
+	struct compelem_thread_args *thread_args = elem_args;
+	struct ums_compelem_prio_args reg_args = { 0 };
+	struct ums_compelem_args args = { 0 };
+	struct ums_user_elem self;
 
-	id = *((int*) idxs);
-	func = *((ums_function*) (idxs + sizeof(int)));
+	reg_args.complist_id = thread_args->complist_id;
+	reg_args.prio = thread_args->prio;
+	reg_args.deadline = thread_args->deadline;
+	func = thread_args->func;
 
-	free(idxs);
+	free(thread_args);
 
-	// fprintf(stderr, "Registering new compelem to complist %d\n", id);
+	/* the module writes reg_args.compelem_id before blocking the thread */
+	res = create_ums_compelem(&reg_args);
 
-	res = create_ums_compelem(&id);
+	args.complist_id = reg_args.complist_id;
+	args.compelem_id = reg_args.compelem_id;
+
+	/* from here on the element runs on a scheduler thread */
+	if (hybrid_mode) {
+		self.id = args.compelem_id;
+		self.complist_id = args.complist_id;
+		get_thread_info()->running = &self;
+	}
 
 	fprintf(stderr, "I am going to execute func!\n");
-	func(id);
-	fprintf(stderr, "Calling delete_compelem: %d\n", id);
-	delete_compelem(id);
+	func(args.compelem_id);
+	fprintf(stderr, "Calling delete_compelem: %d\n", args.compelem_id);
+	delete_compelem(&args);
+
+	if (hybrid_mode) {
+		struct ums_thread_info *info = get_thread_info();
+
+		/* the stack of the element is left forever */
+		info->running = NULL;
+		__ums_ctx_jump(&info->entry_ctx);
+	}
+
 	/* NOTE: after delete compelem 2 processes will try to get yield*/
 	UmsThreadYield();
 
@@ -547,6 +2071,125 @@ static int __reg_compelem(void *idxs)
 	return res;
 }
 
+/**
+ * @brief Execute an element through the module in hybrid mode
+ *
+ * @param[in] next: element to execute
+ * @param[in] flags: UMS_EXEC_F_* flags
+ *
+ * The context of the entry point is saved in user space, so that a hybrid
+ * yield of next resumes it from here. The element previously executed
+ * through the module (if any) has been parked, so the module is told to
+ * detach it.
+ *
+ * @return 0 if no error occured (after next yields), -errno otherwise
+*/
+static int hybrid_exec(ums_compelem_id next, unsigned int flags)
+{
+	struct ums_exec_args args = { 0 };
+	struct ums_thread_info *info = get_thread_info();
+	ums_compelem_id prev = info->kernel_elem;
+
+	args.compelem_id = next;
+	args.flags = flags | (prev ? UMS_EXEC_F_PARKED : 0);
+
+	if (__ums_ctx_save(&info->entry_ctx)) {
+		/* resumed by a hybrid yield */
+		finish_switch();
+		return 0;
+	}
+
+	info->kernel_elem = next;
+
+	if (exec_thread(&args)) {
+		int err = -errno;
+
+		/* prev is detached again by the next exec if needed */
+		info->kernel_elem = prev;
+		return err;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Complete a hybrid switch on the new stack
+ *
+ * The element that left the CPU can be parked only once its stack is not
+ * used anymore, i.e. by the context that has been resumed.
+*/
+static void finish_switch(void)
+{
+	struct ums_thread_info *info = get_thread_info();
+
+	if (info->park) {
+		parked_push(info->park);
+		info->park = NULL;
+	}
+}
+
+/**
+ * @brief Lock parked_list
+*/
+static inline void parked_list_lock(void)
+{
+	while (__atomic_exchange_n(&parked_lock, 1, __ATOMIC_ACQUIRE))
+		while (__atomic_load_n(&parked_lock, __ATOMIC_RELAXED))
+			__builtin_ia32_pause();
+}
+
+/**
+ * @brief Unlock parked_list
+*/
+static inline void parked_list_unlock(void)
+{
+	__atomic_store_n(&parked_lock, 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Append a parked element to parked_list
+*/
+static void parked_push(struct ums_user_elem *elem)
+{
+	parked_list_lock();
+	list_add_tail(&elem->list, &parked_list);
+	parked_list_unlock();
+}
+
+/**
+ * @brief Remove a parked element from parked_list
+ *
+ * @param[in] complist_id: completion list of the element, 0 for any
+ * @param[in] id: element to remove, 0 for the first one
+ *
+ * @return the removed element, NULL if there is no such element
+*/
+static struct ums_user_elem *parked_pop(ums_complist_id complist_id,
+					ums_compelem_id id)
+{
+	struct list_head *iter;
+	struct ums_user_elem *elem = NULL;
+
+	parked_list_lock();
+
+	list_for_each(iter, &parked_list) {
+		struct ums_user_elem *tmp;
+
+		tmp = list_entry(iter, struct ums_user_elem, list);
+
+		if ((! complist_id || tmp->complist_id == complist_id) &&
+		    (! id || tmp->id == id)) {
+			elem = tmp;
+			list_del(&elem->list);
+			break;
+		}
+	}
+
+	parked_list_unlock();
+
+	return elem;
+}
+
 /**
  * @brief Add new thread to the one alloced
  *
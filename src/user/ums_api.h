@@ -9,6 +9,10 @@
 #ifndef __UMS_LINUX_H__
 #define __UMS_LINUX_H__
 
+#include <stddef.h>
+#include <sched.h>
+#include "../module/ums_device.h"
+
 /**
  * @brief complist identifier
  *
@@ -35,12 +39,69 @@ typedef int ums_sched_id;
 */
 typedef int (*ums_function)(int);
 
+/**
+ * @struct ums_user_ring
+ *
+ * @brief User side of a submission/completion ring
+ *
+ * A ring must be used by a single scheduler thread.
+ *
+ * @sa UmsRingInit
+*/
+struct ums_user_ring {
+	/** ring file descriptor */
+	int fd;
+	/** mapped ring memory */
+	void *mem;
+	/** size of the mapped memory */
+	size_t size;
+	/** shared header */
+	struct ums_ring_hdr *hdr;
+	/** submission entries */
+	struct ums_sqe *sqes;
+	/** completion entries */
+	struct ums_cqe *cqes;
+	/** local tail: entries prepared but not yet published */
+	unsigned int sq_tail;
+};
+
+int GetUmsCapabilities(struct ums_caps *caps);
+
+/**
+ * @struct ums_user_ready_ring
+ *
+ * @brief User side of the ready ring of a completion list
+ *
+ * The ring can be shared by all the scheduler threads of the process.
+ *
+ * @sa UmsReadyRingInit
+*/
+struct ums_user_ready_ring {
+	/** mapped ring memory */
+	void *mem;
+	/** size of the mapped memory */
+	size_t size;
+	/** shared header */
+	struct ums_ready_ring_hdr *hdr;
+	/** ready element identifiers */
+	ums_compelem_id *ids;
+};
+
+int UmsSetHybridMode(int enable);
+
+int UmsSetBlockNotification(int enable);
+
 int EnterUmsSchedulingMode(ums_function entry_point,
                            ums_complist_id complist_id,
+			   const cpu_set_t *cpus,
 			   ums_sched_id *result);
 
 int WaitUmsScheduler(ums_sched_id sched_id);
 
+int WaitUmsSchedulerTimeout(ums_sched_id sched_id, long long timeout_ns);
+
+int WaitUmsCompletionList(ums_complist_id complist_id, long long timeout_ns);
+
 int WaitUmsChildren(void);
 
 int CreateEmptyUmsCompletionList(ums_complist_id *id);
@@ -52,17 +113,74 @@ int CreateUmsCompletionList(ums_complist_id *id,
 int CreateUmsCompletionElement(ums_complist_id id,
 		               ums_function func);
 
+int CreateUmsCompletionElementPrio(ums_complist_id id,
+				   ums_function func,
+				   int prio);
+
+int CreateUmsCompletionElementDeadline(ums_complist_id id,
+				       ums_function func,
+				       unsigned long long deadline);
+
+int UmsSetPriority(ums_compelem_id id, int prio);
+
+int UmsSetDeadline(ums_compelem_id id, unsigned long long deadline);
+
+int UmsSetCompletionListPolicy(ums_complist_id id,
+			       unsigned int policy,
+			       unsigned int flags);
+
+int UmsSetCompletionListIdleSpin(ums_complist_id id,
+				 unsigned long long spin_ns);
+
+int UmsSetTimeSlice(ums_complist_id id, unsigned long long slice_ns);
+
+int UmsCompletionListFd(ums_complist_id id);
+
 
 int ExecuteUmsThread(ums_compelem_id next);
 
+int ExecuteUmsThreadBudget(ums_compelem_id next, unsigned long long budget_ns);
+
+int ExecuteClaimedUmsThread(ums_compelem_id next);
+
 int UmsThreadYield(void);
 
+int UmsThreadYieldTo(ums_compelem_id next);
+
 
 int DequeueUmsCompletionListItems(int max_elements,
 				  ums_compelem_id *result_array,
 				  int *result_length);
 
+int TryDequeueUmsCompletionListItems(int max_elements,
+				     ums_compelem_id *result_array,
+				     int *result_length);
+
 int UnregisterCompletionElements(ums_compelem_id *elements,
 				 int elem_count);
 
+int UmsGetWorkerPage(struct ums_worker_page *snapshot);
+
+ums_compelem_id UmsGetCurrentCompelem(void);
+
+int UmsReadyRingInit(struct ums_user_ready_ring *ring,
+		     ums_complist_id complist_id,
+		     unsigned int entries);
+
+ums_compelem_id UmsReadyRingClaim(struct ums_user_ready_ring *ring);
+
+void UmsReadyRingExit(struct ums_user_ready_ring *ring);
+
+int UmsRingInit(struct ums_user_ring *ring, unsigned int entries);
+
+struct ums_sqe *UmsRingGetSqe(struct ums_user_ring *ring);
+
+int UmsRingSubmit(struct ums_user_ring *ring);
+
+struct ums_cqe *UmsRingPeekCqe(struct ums_user_ring *ring);
+
+void UmsRingCqeSeen(struct ums_user_ring *ring);
+
+void UmsRingExit(struct ums_user_ring *ring);
+
 #endif /* __UMS_SCHED_LINUX_H__ */